@@ -1,12 +1,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/mman.h>
-#include <errno.h>
-#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -15,75 +16,165 @@
 #include "dos.h"
 
 
-static int imagesize = 0;
-
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
-{
-    struct stat statbuf;
-    uint8_t *image_buf;
-    char pathname[MAXPATHLEN+1];
-
-
-    /* If filename isn't an absolute pathname, then we'd better prepend
-       the current working directory to it */
-
-    if (filename[0] == '/') 
-    {
-	strncpy(pathname, filename, MAXPATHLEN);
-    } 
-    else 
-    {
-	getcwd(pathname, MAXPATHLEN);
-	if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) 
-	{
-	    fprintf(stderr, "Filename too long\n");
-	    exit(1);
-	}
-	strcat(pathname, "/");
-	strcat(pathname, filename);
-    }
-
-
-    /* Step 2: find out how big the disk image file is */
-    /* we can use "stat" to do this, by checking the file status */
-
-    if (stat(pathname, &statbuf) < 0) 
-    {
-	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
-		pathname, strerror(errno));
-	exit(1);
-    }
-    imagesize = statbuf.st_size;
+/* ---------- geometry-specialized accessors ---------- */
 
+/* Nearly every image is a standard floppy, so the FAT and cluster
+   accessors are generated once per common layout with the geometry as
+   compile-time constants, and once more reading it from the BPB.
+   check_bootsector picks the set to use, and the public functions
+   below go through it. */
 
-    /* Step 3: open the file for read/write */
-
-    *fd = open(pathname, O_RDWR);
-    if (*fd < 0) 
-    {
-	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
-		pathname, strerror(errno));
-	exit(1);
-    }
-
-
-    /* Step 4: we memory map the file */
-
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-    if (image_buf == MAP_FAILED) 
-    {
-	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-	exit(1);
-    }
-    return image_buf;
-}
+/* name, bytes/sector, sectors/cluster, reserved, FATs, sectors/FAT,
+   root entries, total sectors */
+#define FLOPPY_GEOMETRIES(X)				\
+    X(floppy_1440k, 512, 1, 1, 2, 9, 224, 2880)		\
+    X(floppy_720k,  512, 2, 1, 2, 3, 112, 1440)		\
+    X(floppy_1200k, 512, 1, 1, 2, 7, 224, 2400)		\
+    X(floppy_2880k, 512, 2, 1, 2, 9, 240, 5760)
 
+struct geometry_ops
+{
+    const char *name;
+    uint16_t (*get_fat_entry)(uint16_t, uint8_t *, struct bpb33 *);
+    void (*set_fat_entry)(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+    int (*is_valid_cluster)(uint16_t, struct bpb33 *);
+    uint8_t *(*root_dir_addr)(uint8_t *, struct bpb33 *);
+    uint8_t *(*cluster_to_addr)(uint16_t, uint8_t *, struct bpb33 *);
+};
+
+/* check_bootsector hands out a bpb33 with the chosen ops, and the
+   volume's counters, behind it */
+struct bpb_geometry
+{
+    struct bpb33 bpb;
+    const struct geometry_ops *ops;
+    struct dos_stats stats;
+};
+
+#define GEOMETRY_OPS(bpb) (((struct bpb_geometry *)(bpb))->ops)
+
+/* inside dos.c the counters are reached without a call */
+#undef DOS_STAT
+#ifdef DOS_NO_STATS
+#define DOS_STAT(bpb, field, n) ((void)0)
+#else
+#define DOS_STAT(bpb, field, n) (((struct bpb_geometry *)(bpb))->stats.field += (n))
+#endif
 
-void unmmap_file(uint8_t *image, int *fd)
+/* The bodies are macros rather than functions so that the constants
+   fold even when the tools are built without optimization. */
+
+/* this involves some really ugly bit shifting.  This probably only
+   works on a little-endian machine. */
+#define FAT12_GET(fat, clusternum)					\
+    (((clusternum) % 2 == 0)						\
+     ? (uint16_t)(((0x0f & (fat)[3 * ((clusternum) / 2) + 1]) << 8)	\
+		  | (fat)[3 * ((clusternum) / 2)])			\
+     : (uint16_t)(((fat)[3 * ((clusternum) / 2) + 2] << 4)		\
+		  | ((0xf0 & (fat)[3 * ((clusternum) / 2) + 1]) >> 4)))
+
+#define FAT12_SET(fat, clusternum, value)				\
+    do {								\
+	uint8_t *p1_ = (fat) + 3 * ((clusternum) / 2);			\
+	if ((clusternum) % 2 == 0)					\
+	{								\
+	    /* mjh: little-endian CPUs are really ugly! */		\
+	    p1_[0] = (uint8_t)(0xff & (value));				\
+	    p1_[1] = (uint8_t)((0xf0 & p1_[1]) | (0x0f & ((value) >> 8))); \
+	}								\
+	else								\
+	{								\
+	    p1_[1] = (uint8_t)((0x0f & p1_[1]) | ((0x0f & (value)) << 4)); \
+	    p1_[2] = (uint8_t)(0xff & ((value) >> 4));			\
+	}								\
+    } while (0)
+
+#define FAT_OFFSET(bps, res) ((uint32_t)(bps) * (res))
+
+#define ROOT_OFFSET(bps, res, nfats, fatsecs)			\
+    ((uint32_t)(bps) * ((res) + (nfats) * (fatsecs)))
+
+/* cluster 0 is the root directory */
+#define CLUSTER_OFFSET(cluster, bps, spc, res, nfats, fatsecs, rootents) \
+    (ROOT_OFFSET(bps, res, nfats, fatsecs)				\
+     + ((cluster) == MSDOSFSROOT ? 0					\
+	: (rootents) * (uint32_t)sizeof(struct direntry)		\
+	  + (uint32_t)(bps) * (spc) * ((cluster) - CLUST_FIRST)))
+
+/* one past the last cluster that has both room in the data area and an
+   entry in the FAT; negative for a nonsensical geometry */
+#define DATA_LIMIT(bps, spc, res, nfats, fatsecs, rootents, sectors)	\
+    ((int)CLUST_FIRST							\
+     + ((int)(sectors) - (int)(res) - (int)(nfats) * (int)(fatsecs)	\
+	- ((int)(rootents) * (int)sizeof(struct direntry) + (int)(bps) - 1) \
+	  / (int)(bps))							\
+       / (int)(spc))
+
+#define FAT_LIMIT(bps, fatsecs) ((int)(fatsecs) * (int)(bps) * 2 / 3)
+
+#define MIN_LIMIT(a, b) ((a) < (b) ? (a) : (b))
+
+#define CLUSTER_LIMIT(bps, spc, res, nfats, fatsecs, rootents, sectors)	\
+    MIN_LIMIT(MIN_LIMIT(DATA_LIMIT(bps, spc, res, nfats, fatsecs,	\
+				   rootents, sectors),			\
+			FAT_LIMIT(bps, fatsecs)),			\
+	      (int)(FAT12_MASK & CLUST_LAST) + 1)
+
+#define VALID_CLUSTER(cluster, limit)					\
+    ((cluster) >= (FAT12_MASK & CLUST_FIRST) && (int)(cluster) < (limit))
+
+#define DEFINE_GEOMETRY(name, bps, spc, res, nfats, fatsecs, rootents, sectors) \
+static uint16_t get_fat_entry_##name(uint16_t clusternum,		\
+				     uint8_t *image_buf, struct bpb33 *bpb) \
+{									\
+    return FAT12_GET(image_buf + FAT_OFFSET(bps, res), clusternum);	\
+}									\
+static void set_fat_entry_##name(uint16_t clusternum, uint16_t value,	\
+				 uint8_t *image_buf, struct bpb33 *bpb) \
+{									\
+    FAT12_SET(image_buf + FAT_OFFSET(bps, res), clusternum, value);	\
+}									\
+static int is_valid_cluster_##name(uint16_t cluster, struct bpb33 *bpb) \
+{									\
+    return VALID_CLUSTER(cluster, CLUSTER_LIMIT(bps, spc, res, nfats,	\
+						fatsecs, rootents,	\
+						sectors)) ? TRUE : FALSE; \
+}									\
+static uint8_t *root_dir_addr_##name(uint8_t *image_buf, struct bpb33 *bpb) \
+{									\
+    return image_buf + ROOT_OFFSET(bps, res, nfats, fatsecs);		\
+}									\
+static uint8_t *cluster_to_addr_##name(uint16_t cluster,		\
+				       uint8_t *image_buf, struct bpb33 *bpb) \
+{									\
+    return image_buf + CLUSTER_OFFSET(cluster, bps, spc, res, nfats,	\
+				      fatsecs, rootents);		\
+}									\
+static const struct geometry_ops geometry_##name = {			\
+    #name, get_fat_entry_##name, set_fat_entry_##name,			\
+    is_valid_cluster_##name, root_dir_addr_##name,			\
+    cluster_to_addr_##name						\
+};
+
+FLOPPY_GEOMETRIES(DEFINE_GEOMETRY)
+
+/* the generic set reads everything from the BPB */
+DEFINE_GEOMETRY(generic, bpb->bpbBytesPerSec, bpb->bpbSecPerClust,
+		bpb->bpbResSectors, bpb->bpbFATs, bpb->bpbFATsecs,
+		bpb->bpbRootDirEnts, bpb->bpbSectors)
+
+static const struct geometry_ops *pick_geometry(struct bpb33 *bpb)
 {
-    munmap(image, imagesize);
-    close(*fd);
+#define MATCH_GEOMETRY(name, bps, spc, res, nfats, fatsecs, rootents, sectors) \
+    if (bpb->bpbBytesPerSec == (bps) && bpb->bpbSecPerClust == (spc)	\
+	&& bpb->bpbResSectors == (res) && bpb->bpbFATs == (nfats)	\
+	&& bpb->bpbFATsecs == (fatsecs) && bpb->bpbRootDirEnts == (rootents) \
+	&& bpb->bpbSectors == (sectors))				\
+	return &geometry_##name;
+
+    FLOPPY_GEOMETRIES(MATCH_GEOMETRY)
+#undef MATCH_GEOMETRY
+    return &geometry_generic;
 }
 
 
@@ -95,6 +186,7 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     struct bootsector33* bootsect;
     struct byte_bpb33* bpb;  /* BIOS parameter block */
     struct bpb33* bpb_aligned;
+    struct bpb_geometry *geom;
 
 #ifdef DEBUG
     fprintf(stderr, "Size of BPB: %lu\n", sizeof(struct bootsector33));
@@ -110,9 +202,11 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     } 
     else 
     {
+#ifdef DEBUG
 	fprintf(stderr, "illegal boot sector jump inst: %x%x%x\n", 
 		bootsect->bsJump[0], bootsect->bsJump[1], 
 		bootsect->bsJump[2]); 
+#endif
     } 
 
 #ifdef DEBUG
@@ -129,9 +223,11 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     } 
     else 
     {
+#ifdef DEBUG
 	fprintf(stderr, "Boot sector signature %x%x\n", 
 		bootsect->bsBootSectSig0, 
 		bootsect->bsBootSectSig1);
+#endif
     }
 
     bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
@@ -139,7 +235,10 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     /* bpb is a byte-based struct, because this data is unaligned.
        This makes it hard to access the multi-byte fields, so we copy
        it to a slightly larger struct that is word-aligned */
-    bpb_aligned = malloc(sizeof(struct bpb33));
+    geom = calloc(1, sizeof(struct bpb_geometry));
+    if (geom == NULL)
+	return NULL;
+    bpb_aligned = &geom->bpb;
 
     bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
     bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
@@ -162,6 +261,11 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     fprintf(stderr, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
 #endif
 
+    geom->ops = pick_geometry(bpb_aligned);
+#ifdef DEBUG
+    fprintf(stderr, "Geometry: %s\n", geom->ops->name);
+#endif
+
     return bpb_aligned;
 }
 
@@ -170,30 +274,8 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
 uint16_t get_fat_entry(uint16_t clusternum, 
 		       uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    uint16_t value;
-    uint8_t b1, b2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
-    {
-    case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
-
-	/* mjh: little-endian CPUs are ugly! */
-	value = ((0x0f & b2) << 8) | b1;
-	break;
-    case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
-	value = b2 << 4 | ((0xf0 & b1) >> 4);
-	break;
-    }
-    return value;
+    DOS_STAT(bpb, fat_reads, 1);
+    return GEOMETRY_OPS(bpb)->get_fat_entry(clusternum, image_buf, bpb);
 }
 
 
@@ -201,41 +283,26 @@ uint16_t get_fat_entry(uint16_t clusternum,
 void set_fat_entry(uint16_t clusternum, uint16_t value,
 		   uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    uint8_t *p1, *p2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
-    {
-    case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
-	/* mjh: little-endian CPUs are really ugly! */
-	*p1 = (uint8_t)(0xff & value);
-	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
-	break;
-    case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
-	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
-	*p2 = (uint8_t)(0xff & (value >> 4));
-	break;
-    }
+    DOS_STAT(bpb, fat_writes, 1);
+    GEOMETRY_OPS(bpb)->set_fat_entry(clusternum, value, image_buf, bpb);
 }
 
 
 int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 {
-    uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
+    return GEOMETRY_OPS(bpb)->is_valid_cluster(cluster, bpb);
+}
+
 
-    if (cluster >= (FAT12_MASK & CLUST_FIRST) && 
-        cluster <= (FAT12_MASK & CLUST_LAST) &&
-        cluster < max_cluster)
-        return TRUE;
-    return FALSE;
+/* cluster_limit returns one more than the highest valid cluster
+   number, or 0 if the BPB describes no data area at all */
+uint16_t cluster_limit(struct bpb33 *bpb)
+{
+    int limit = CLUSTER_LIMIT(bpb->bpbBytesPerSec, bpb->bpbSecPerClust,
+			      bpb->bpbResSectors, bpb->bpbFATs,
+			      bpb->bpbFATsecs, bpb->bpbRootDirEnts,
+			      bpb->bpbSectors);
+    return limit > CLUST_FIRST ? limit : 0;
 }
 
 
@@ -259,11 +326,7 @@ int is_end_of_file(uint16_t cluster)
    start of the root directory, as indicated in the boot sector */
 uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    offset = 
-	(bpb->bpbBytesPerSec 
-	 * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-    return image_buf + offset;
+    return GEOMETRY_OPS(bpb)->root_dir_addr(image_buf, bpb);
 }
 
 
@@ -272,16 +335,338 @@ uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
 uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
 			 struct bpb33* bpb)
 {
-    uint8_t *p;
-    p = root_dir_addr(image_buf, bpb);
-    if (cluster != MSDOSFSROOT) 
+    DOS_STAT(bpb, cluster_addrs, 1);
+    return GEOMETRY_OPS(bpb)->cluster_to_addr(cluster, image_buf, bpb);
+}
+
+
+/* dos_option removes every copy of the flag opt from argv, returning
+   TRUE if there was one */
+int dos_option(int *argc, char **argv, const char *opt)
+{
+    int i, j, found = FALSE;
+
+    for (i = 1, j = 1; i < *argc; i++)
+    {
+	if (strcmp(argv[i], opt) == 0)
+	    found = TRUE;
+	else
+	    argv[j++] = argv[i];
+    }
+    argv[j] = NULL;
+    *argc = j;
+    return found;
+}
+
+
+/* dos_option_arg removes "opt value" or "opt=value" from argv and
+   returns the value of the last one, "" if it had none, or NULL if opt
+   was not given */
+const char *dos_option_arg(int *argc, char **argv, const char *opt)
+{
+    const char *value = NULL;
+    size_t len = strlen(opt);
+    int i, j;
+
+    for (i = 1, j = 1; i < *argc; i++)
+    {
+	if (strcmp(argv[i], opt) == 0)
+	    value = i + 1 < *argc ? argv[++i] : "";
+	else if (strncmp(argv[i], opt, len) == 0 && argv[i][len] == '=')
+	    value = argv[i] + len + 1;
+	else
+	    argv[j++] = argv[i];
+    }
+    argv[j] = NULL;
+    *argc = j;
+    return value;
+}
+
+
+/* dos_stats_option removes a --stats argument from argv, returning
+   TRUE if there was one */
+int dos_stats_option(int *argc, char **argv)
+{
+    return dos_option(argc, argv, "--stats");
+}
+
+
+/* dos_stats_of returns the counters of the volume bpb belongs to */
+struct dos_stats *dos_stats_of(struct bpb33 *bpb)
+{
+    return &((struct bpb_geometry *)bpb)->stats;
+}
+
+
+/* dos_print_stats prints the counters, plus page faults and peak RSS
+   of the process from getrusage, one per line */
+void dos_print_stats(FILE *out, const struct dos_stats *stats)
+{
+    struct rusage ru;
+
+    fprintf(out, "fat_reads %llu\n", (unsigned long long)stats->fat_reads);
+    fprintf(out, "fat_writes %llu\n", (unsigned long long)stats->fat_writes);
+    fprintf(out, "cluster_addrs %llu\n", (unsigned long long)stats->cluster_addrs);
+    fprintf(out, "dirents_scanned %llu\n", (unsigned long long)stats->dirents_scanned);
+    fprintf(out, "chains_walked %llu\n", (unsigned long long)stats->chains_walked);
+    fprintf(out, "bytes_read %llu\n", (unsigned long long)stats->bytes_read);
+    fprintf(out, "bytes_written %llu\n", (unsigned long long)stats->bytes_written);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+	fprintf(out, "minor_faults %ld\n", ru.ru_minflt);
+	fprintf(out, "major_faults %ld\n", ru.ru_majflt);
+	fprintf(out, "max_rss_kb %ld\n", ru.ru_maxrss);
+    }
+}
+
+
+/* ---------- sparse output ---------- */
+
+/* dos_is_zero: a buffer is all zeros if its first 16 bytes are and it
+   matches itself shifted by 16, which memcmp checks with vector loads
+   whatever this file was built with */
+int dos_is_zero(const void *buf, size_t len)
+{
+    static const uint8_t zeros[16];
+    const uint8_t *p = buf;
+
+    if (len <= 16)
+	return memcmp(p, zeros, len) == 0;
+    return memcmp(p, zeros, 16) == 0 && memcmp(p, p + 16, len - 16) == 0;
+}
+
+
+/* Output is sparse only when it is a regular file written at its end,
+   so that every byte skipped reads back as zero; not for pipes and
+   terminals, or files opened for append. */
+void dos_sparse_init(struct dos_sparse *s, FILE *out)
+{
+    struct stat st;
+    int flags = fcntl(fileno(out), F_GETFL);
+
+    s->out = out;
+    s->hole = 0;
+    fflush(out);
+    s->enabled = fstat(fileno(out), &st) == 0 && S_ISREG(st.st_mode)
+	&& flags >= 0 && (flags & O_APPEND) == 0 && ftello(out) >= st.st_size;
+}
+
+
+/* the length of the block at p, and whether it can be skipped */
+static size_t block_len(const uint8_t *p, const uint8_t *end, size_t block)
+{
+    return end - p < block ? end - p : block;
+}
+
+static int skip_block(struct dos_sparse *s, const uint8_t *p, const uint8_t *end,
+		      size_t block)
+{
+    return s->enabled && dos_is_zero(p, block_len(p, end, block));
+}
+
+
+/* dos_sparse_write writes len bytes, seeking over each block of them
+   that is all zeros; returns 0, or -1 with errno set */
+int dos_sparse_write(struct dos_sparse *s, const void *buf, size_t len, size_t block)
+{
+    const uint8_t *p = buf, *end = p + len, *run;
+
+    while (p < end)
+    {
+	/* blocks with data in them go out in one write */
+	for (run = p; p < end && !skip_block(s, p, end, block); )
+	    p += block_len(p, end, block);
+	if (p > run)
+	{
+	    if (s->hole > 0 && fseeko(s->out, s->hole, SEEK_CUR) < 0)
+		return -1;
+	    s->hole = 0;
+	    if (fwrite(run, 1, p - run, s->out) != p - run)
+		return -1;
+	}
+	for (; p < end && skip_block(s, p, end, block); p += block_len(p, end, block))
+	    s->hole += block_len(p, end, block);
+    }
+    return 0;
+}
+
+
+/* dos_sparse_finish extends the file over a hole left at the end */
+int dos_sparse_finish(struct dos_sparse *s)
+{
+    off_t end;
+
+    if (s->hole == 0)
+	return 0;
+    if (fflush(s->out) != 0)
+	return -1;
+    end = ftello(s->out) + s->hole;
+    s->hole = 0;
+    if (ftruncate(fileno(s->out), end) < 0 || fseeko(s->out, end, SEEK_SET) < 0)
+	return -1;
+    return 0;
+}
+
+
+/* ---------- CRC32C ---------- */
+
+/* CRC32C (Castagnoli), as iSCSI and ext4 use it.  Where the CPU has the
+   SSE4.2 crc32 instruction it takes eight bytes a step; elsewhere an
+   eight-way sliced table does. */
+
+#define CRC32C_POLY 0x82f63b78	/* reflected */
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+	crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8)
     {
-	/* move to the end of the root directory */
-	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
+	uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+	uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
 
-	/* move forward the right number of clusters */
-	p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust * (cluster - CLUST_FIRST);
+	crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+	    ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+	    ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+	    ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
     }
-    return p;
+    for (; len > 0; len--)
+	crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c;
+
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+	crc = _mm_crc32_u8(crc, *p++);
+    c = crc;
+    for (; len >= 8; len -= 8, p += 8)
+	c = _mm_crc32_u64(c, *(const uint64_t *)p);
+    crc = (uint32_t)c;
+    for (; len > 0; len--)
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
 }
+#endif
 
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+	crc = i;
+	for (j = 0; j < 8; j++)
+	    crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+	crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+	for (j = 1; j < 8; j++)
+	    crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff]
+		^ (crc32c_table[j - 1][i] >> 8);
+
+    crc32c_fn = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+	crc32c_fn = crc32c_hw;
+#endif
+}
+
+
+/* dos_crc32c carries crc, 0 to start, on over len bytes at buf */
+uint32_t dos_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_fn(~crc, buf, len);
+}
+
+
+/* ---------- free space ---------- */
+
+/* The FAT is unpacked four entries at a time: six bytes hold four
+   12-bit entries, so one 48-bit load and four shifts decode them, with
+   no branch on odd or even.  Free entries become bits in a map, and
+   runs are then measured a word at a time by counting trailing bits. */
+
+#define FREE_WORDS ((FAT12_MASK + 1) / 64)
+
+static void add_run(struct dos_free *f, uint32_t run)
+{
+    if (run == 0)
+	return;
+    f->runs++;
+    if (run > f->largest)
+	f->largest = run;
+    f->histogram[31 - __builtin_clz(run)]++;
+}
+
+
+/* dos_free_space counts the free clusters and measures the runs they
+   make; a run of n clusters goes in histogram[floor(log2(n))] */
+void dos_free_space(uint8_t *image_buf, struct bpb33 *bpb, struct dos_free *f)
+{
+    const uint8_t *fat = image_buf + FAT_OFFSET(bpb->bpbBytesPerSec, bpb->bpbResSectors);
+    uint32_t fat_len = (uint32_t)bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    uint32_t limit = cluster_limit(bpb), run = 0, c, i;
+    uint64_t map[FREE_WORDS];
+
+    memset(f, 0, sizeof(struct dos_free));
+    memset(map, 0, sizeof(map));
+    for (c = 0; c < limit; c += 4)
+    {
+	uint32_t off = c / 2 * 3;
+	uint64_t w = 0;
+	int k;
+
+	memcpy(&w, fat + off, fat_len - off < 6 ? fat_len - off : 6);
+	for (k = 0; k < 4; k++)
+	    map[c / 64] |= (uint64_t)(((w >> (12 * k)) & FAT12_MASK) == CLUST_FREE)
+		<< ((c + k) % 64);
+    }
+    /* clusters 0 and 1 are not clusters, and nothing past the limit is */
+    map[0] &= ~(uint64_t)3;
+    if (limit % 64 != 0)
+	map[limit / 64] &= ((uint64_t)1 << (limit % 64)) - 1;
+    for (i = (limit + 63) / 64; i < FREE_WORDS; i++)
+	map[i] = 0;
+
+    for (i = 0; i < (limit + 63) / 64; i++)
+    {
+	uint64_t w = map[i];
+	int pos = 0;
+
+	f->clusters += __builtin_popcountll(w);
+	while (pos < 64)
+	{
+	    uint64_t rest = w >> pos;
+	    int n;
+
+	    if (rest & 1)
+	    {
+		n = ~rest == 0 ? 64 : __builtin_ctzll(~rest);
+		if (n > 64 - pos)
+		    n = 64 - pos;
+		run += n;
+	    }
+	    else
+	    {
+		n = rest == 0 ? 64 - pos : __builtin_ctzll(rest);
+		add_run(f, run);
+		run = 0;
+	    }
+	    pos += n;
+	}
+    }
+    add_run(f, run);
+}
@@ -12,9 +12,8 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
-
-uint8_t *mmap_file(char *, int *);
-void unmmap_file(uint8_t *, int *);
+#include <stdio.h>
+#include <sys/types.h>
 
 struct bpb33* check_bootsector(uint8_t *);
 
@@ -24,9 +23,65 @@ void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
 
 int is_end_of_file(uint16_t);
 int is_valid_cluster(uint16_t, struct bpb33 *);
+uint16_t cluster_limit(struct bpb33 *);
 
 uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
 
 uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
 
+/* hot-path counters, kept per volume and bumped with DOS_STAT(); each
+   is a single add, so they stay compiled in unless built with
+   -DDOS_NO_STATS */
+struct dos_stats
+{
+    uint64_t fat_reads;		/* get_fat_entry calls */
+    uint64_t fat_writes;	/* set_fat_entry calls */
+    uint64_t cluster_addrs;	/* cluster_to_addr calls */
+    uint64_t dirents_scanned;
+    uint64_t chains_walked;
+    uint64_t bytes_read;	/* file data read from the image */
+    uint64_t bytes_written;	/* file data written into the image */
+};
+
+struct dos_stats *dos_stats_of(struct bpb33 *);
+
+#ifdef DOS_NO_STATS
+#define DOS_STAT(bpb, field, n) ((void)0)
+#else
+#define DOS_STAT(bpb, field, n) (dos_stats_of(bpb)->field += (n))
+#endif
+
+/* writing files out sparsely: all-zero blocks become holes when the
+   output is a regular file (see dos.c) */
+struct dos_sparse
+{
+    FILE *out;
+    int enabled;
+    off_t hole;			/* zeros skipped and not yet seeked over */
+};
+
+int dos_is_zero(const void *, size_t);
+void dos_sparse_init(struct dos_sparse *, FILE *);
+int dos_sparse_write(struct dos_sparse *, const void *, size_t, size_t);
+int dos_sparse_finish(struct dos_sparse *);
+
+uint32_t dos_crc32c(uint32_t, const void *, size_t);
+
+/* free space, from dos_free_space */
+#define DOS_FREE_BUCKETS 12
+struct dos_free
+{
+    uint32_t clusters;		/* free clusters */
+    uint32_t runs;		/* runs of free clusters */
+    uint32_t largest;		/* the longest run, in clusters */
+    uint32_t histogram[DOS_FREE_BUCKETS]; /* runs of 2^i to 2^(i+1)-1 */
+};
+
+void dos_free_space(uint8_t *, struct bpb33 *, struct dos_free *);
+
+int dos_option(int *, char **, const char *);
+const char *dos_option_arg(int *, char **, const char *);
+int dos_stats_option(int *, char **);
+void dos_print_stats(FILE *, const struct dos_stats *);
+
 #endif // __DOS_H__
@@ -1,535 +1,437 @@
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
-#include <sys/mman.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
-#include <ctype.h>
+#include <sys/stat.h>
 
-#include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
-#include "fat.h"
-#include "dos.h"
+#include "libfat.h"
 
 
-/* get_name retrieves the filename from a directory entry */
+#define COPY_CHUNK (64 * 1024)
 
-void get_name(char *fullname, struct direntry *dirent) 
+/* copyout copies a file from the FAT-12 memory disk image to a
+   regular file in the file system, leaving clusters of zeros as holes */
+
+void copyout(fat_volume *vol, char *infilename, char* outfilename)
 {
-    char name[9];
-    char extension[4];
-    int i;
+    static uint8_t buf[COPY_CHUNK];
+    struct bpb33 *bpb = fat_bpb(vol);
+    struct fat_stat st;
+    struct fat_readahead ra;
+    struct fat_skip skip;
+    struct dos_sparse out;
+    FILE *fd;
+    uint32_t offset = 0;
+    ssize_t n;
+    int rv;
 
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
+    /* skip the volume name */
+    assert(strncmp("a:", infilename, 2)==0);
+    infilename+=2;
 
-    /* names are space padded - remove the padding */
-    for (i = 8; i > 0; i--) 
+    /* find the file in the memory disk image */
+    rv = fat_lookup(vol, infilename, &st);
+    if (rv == FAT_ENOENT || rv == FAT_ENOTDIR) 
     {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
+	fprintf(stderr, "No file called %s exists in the disk image\n",
+		infilename);
+	exit(1);
     }
-
-    /* extensions aren't normally space padded - but remove the
-       padding anyway if it's there */
-    for (i = 3; i > 0; i--) 
+    if (rv < 0)
     {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
+	fprintf(stderr, "%s: %s\n", infilename, fat_strerror(rv));
+	exit(1);
     }
-    fullname[0]='\0';
-    strcat(fullname, name);
-
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
+    if (st.is_dir) 
     {
-	strcat(fullname, ".");
-	strcat(fullname, extension);
+	fprintf(stderr, "Cannot copy out a directory\n");
+	exit(1);
     }
-}
-
-
-/* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
-
-/* flags, depending on whether we're searching for a file or a
-   directory */
-#define FIND_FILE 0
-#define FIND_DIR 1
-
-struct direntry* find_file(char *infilename, uint16_t cluster,
-			   int find_mode,
-			   uint8_t *image_buf, struct bpb33* bpb)
-{
-    char buf[MAXPATHLEN];
-    char *seek_name, *next_name;
-    int d;
-    struct direntry *dirent;
-    uint16_t dir_cluster;
-    char fullname[13];
-
-    /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
 
-    /* first we need to split the file name we're looking for into the
-       first part of the path, and the remainder.  We hunt through the
-       current directory for the first part.  If there's a remainder,
-       and what we find is a directory, then we recurse, and search
-       that directory for the remainder */
-
-    strncpy(buf, infilename, MAXPATHLEN);
-    seek_name = buf;
-
-    /* trim leading slashes */
-    while (*seek_name == '/' || *seek_name == '\\') 
+    /* open the real file for writing */
+    fd = fopen(outfilename, "w");
+    if (fd == NULL) 
     {
-	seek_name++;
+	fprintf(stderr, "Can't open file %s to copy data out\n",
+		outfilename);
+	exit(1);
     }
 
-    /* search for any more slashes - if so, it's a dirname */
-    next_name = seek_name;
-    while (1) 
+    /* do the actual copy out, with the chain held steady */
+    rv = fat_hold_file(vol, &st);
+    if (rv < 0)
     {
-	if (*next_name == '/' || *next_name == '\\') 
-	{
-	    *next_name = '\0';
-	    next_name ++;
-	    break;
-	}
-	if (*next_name == '\0') 
-	{
-	    /* end of name - no slashes found */
-	    next_name = NULL;
-	    if (find_mode == FIND_DIR) 
-	    {
-		return dirent;
-	    }
+	fprintf(stderr, "%s: %s\n", infilename,
+		rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	fclose(fd);
+	exit(1);
+    }
+    fat_skip_init(&skip, &st);
+    fat_readahead_init(&ra, &st);
+    dos_sparse_init(&out, fd);
+    while (fat_readahead(vol, &st, &ra, offset),
+	   (n = fat_read_at(vol, &st, &skip, offset, buf, sizeof(buf))) > 0)
+    {
+	if (dos_sparse_write(&out, buf, n,
+			     bpb->bpbBytesPerSec * bpb->bpbSecPerClust) < 0)
 	    break;
-	}
-	next_name++;
+	offset += n;
     }
+    fat_release_file(vol, &st);
+    if (n < 0)
+	fprintf(stderr, "Bad file termination\n");
+    else if (n > 0 || dos_sparse_finish(&out) < 0)
+	fprintf(stderr, "Can't write file %s: %s\n", outfilename, strerror(errno));
+    
+    fclose(fd);
+}
 
-    while (1) 
-    {
-	/* hunt a cluster for the relevant dirent.  If we reach the
-	   end of the cluster, we'll need to go to the next cluster
-	   for this directory */
-	for (d = 0; 
-	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
-	     d += sizeof(struct direntry)) 
-	{
-	    if (dirent->deName[0] == SLOT_EMPTY) 
-	    {
-		/* we failed to find the file */
-		return NULL;
-	    }
+/* read_all slurps a host file into memory */
 
-	    if (dirent->deName[0] == SLOT_DELETED) 
-	    {
-		/* skip over a deleted file */
-		dirent++;
-		continue;
-	    }
+uint8_t *read_all(FILE *fd, uint32_t *size)
+{
+    uint8_t *buf = NULL;
+    size_t len = 0, alloc = 0, bytes;
 
-	    get_name(fullname, dirent);
-	    if (strcmp(fullname, seek_name)==0) 
+    do
+    {
+	if (len == alloc)
+	{
+	    alloc = alloc ? alloc * 2 : COPY_CHUNK;
+	    buf = realloc(buf, alloc);
+	    if (buf == NULL)
 	    {
-		/* found it! */
-		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-		{
-		    /* it's a directory */
-		    if (next_name == NULL) 
-		    {
-			fprintf(stderr, "Cannot copy out a directory\n");
-			exit(1);
-		    }
-		    dir_cluster = getushort(dirent->deStartCluster);
-		    return find_file(next_name, dir_cluster, 
-				     find_mode, image_buf, bpb);
-		} 
-		else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-		{
-		    /* it's a volume */
-		    fprintf(stderr, "Cannot copy out a volume\n");
-		    exit(1);
-		} 
-		else 
-		{
-		    /* assume it's a file */
-		    return dirent;
-		}
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	    }
-	    dirent++;
 	}
+	bytes = fread(buf + len, 1, alloc - len, fd);
+	len += bytes;
+    } while (bytes > 0);
 
-	/* we've reached the end of the cluster for this directory.
-	   Where's the next cluster? */
-	if (cluster == 0) 
-	{
-	    // root dir is special
-	    dirent++;
-	} 
-	else 
-	{
-	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
-						       image_buf, bpb);
-	}
-    }
+    *size = len;
+    return buf;
+}
+
+/* fits checks a regular file's size against the free space before
+   anything is read; other inputs are left for fat_write to judge */
+int fits(fat_volume *vol, FILE *fd)
+{
+    struct bpb33 *bpb = fat_bpb(vol);
+    uint32_t csize = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct dos_free space;
+    struct stat st;
+
+    if (fstat(fileno(fd), &st) < 0 || !S_ISREG(st.st_mode)
+	|| fat_free_space(vol, &space) < 0)
+	return TRUE;
+    return (st.st_size + csize - 1) / csize <= space.clusters;
 }
 
+/* the ways a file can go into the image; they take the same arguments */
+typedef int (*put_fn)(fat_volume *vol, const char *path, const void *buf,
+		      uint32_t len, struct fat_stat *st);
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+/* copyin copies a file from a regular file on the filesystem into a
+   file in the FAT-12 memory disk image, with fat_write, fat_append or
+   fat_overwrite  */
 
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-		   uint8_t *image_buf, struct bpb33* bpb)
+void copyin(fat_volume *vol, char *infilename, char* outfilename, put_fn put)
 {
-    int total_clusters, clust_size;
-    uint8_t *p;
+    char path[MAXPATHLEN];
+    const char *base;
+    FILE *fd;
+    uint8_t *buf;
+    uint32_t size;
+    int rv;
 
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    assert(strncmp("a:", outfilename, 2)==0);
+    outfilename+=2;
 
-    assert(cluster <= total_clusters);
+    /* files always get an extension */
+    base = strrchr(outfilename, '/');
+    if (strrchr(outfilename, '\\') > base)
+	base = strrchr(outfilename, '\\');
+    base = base ? base + 1 : outfilename;
+    strncpy(path, outfilename, MAXPATHLEN - 5);
+    path[MAXPATHLEN - 5] = '\0';
+    if (strchr(base, '.') == NULL) 
+    {
+	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+	strcat(path, ".___");
+    }
 
-    if (cluster == 0) 
+    /* open the real file for reading */
+    fd = fopen(infilename, "r");
+    if (fd == NULL) 
     {
-	fprintf(stderr, "Bad file termination\n");
-	return;
+	fprintf(stderr, "Can't open file %s to copy data in\n",
+		infilename);
+	exit(1);
     }
-    else if (is_end_of_file(cluster)) 
+    /* the others can reuse clusters the file has, and judge for
+       themselves */
+    if (put == fat_write && !fits(vol, fd))
     {
-	return;	
-    } 
-
-
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
+	fprintf(stderr, "No more space in filesystem for %s\n", infilename);
+	exit(1);
+    }
+    buf = read_all(fd, &size);
+    fclose(fd);
 
-    if (bytes_remaining <= clust_size) 
+    /* do the actual copy in */
+    rv = put(vol, path, buf, size, NULL);
+    free(buf);
+    if (rv == FAT_EISDIR) 
     {
-	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
-    } 
-    else 
+	fprintf(stderr, "%s is a directory\n", outfilename);
+	exit(1);
+    }
+    if (rv == FAT_EEXIST) 
     {
-	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
-
-	/* recurse, continuing to copy */
-	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+	fprintf(stderr, "File %s already exists\n", outfilename);
+	exit(1);
     }
-    return;
-}
-
-/* copyout copies a file from the FAT-12 memory disk image to a
-   regular file in the file system */
-
-void copyout(char *infilename, char* outfilename,
-	     uint8_t *image_buf, struct bpb33* bpb)
-{
-    struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size;
-
-    /* skip the volume name */
-    assert(strncmp("a:", infilename, 2)==0);
-    infilename+=2;
-
-    /* find the dirent of the file in the memory disk image */
-    dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent == NULL) 
+    if (rv == FAT_ENOENT || rv == FAT_ENOTDIR) 
     {
-	fprintf(stderr, "No file called %s exists in the disk image\n",
-		infilename);
+	fprintf(stderr, "Directory does not exists in the disk image\n");
 	exit(1);
     }
-
-    /* open the real file for writing */
-    fd = fopen(outfilename, "w");
-    if (fd == NULL) 
+    if (rv == FAT_ENOSPC) 
     {
-	fprintf(stderr, "Can't open file %s to copy data out\n",
-		outfilename);
+	fprintf(stderr, "No more space in filesystem\n");
 	exit(1);
     }
-
-    /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
-    size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
-    
-    fclose(fd);
-}
-
-/* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
-
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
-		      uint32_t *size)
-{
-    uint32_t clust_size, total_clusters, i;
-    uint8_t *buf;
-    size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
-    
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    buf = malloc(clust_size);
-    while(1) 
-    {
-	/* read a block of data, and store it */
-	bytes = fread(buf, 1, clust_size, fd);
-	if (bytes > 0) {
-	    *size += bytes;
-
-	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) 
-	    {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
-		{
-		    break;
-		}
-	    }
-
-	    if (i == total_clusters) 
-	    {
-		/* oops - we ran out of disk space */
-		fprintf(stderr, "No more space in filesystem\n");
-		/* we should clean up here, rather than just exit */ 
-		exit(1);
-	    }
-
-	    /* remember the first cluster, as we need to store this in
-	       the dirent */
-	    if (start_cluster == 0) 
-	    {
-		start_cluster = i;
-	    } 
-	    else 
-	    {
-		/* link the previous cluster to this one in the FAT */
-		assert(prev_cluster != 0);
-		set_fat_entry(prev_cluster, i, image_buf, bpb);
-	    }
-
-	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
-
-	    /* copy the data into the cluster */
-	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
-	}
-
-	if (bytes < clust_size) 
-	{
-	    /* We didn't real a full cluster, so we either got a read
-	       error, or reached end of file.  We exit anyway */
-	    break;
-	}
-	prev_cluster = i;
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", outfilename, fat_strerror(rv));
+	exit(1);
     }
-
-    free(buf);
-    return start_cluster;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
-
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+/* copytree copies from, a file or a directory and all below it, out of
+   one image into another as to, with no host file in between.  It
+   returns the number of files that could not be copied. */
 
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
+int copytree(fat_volume *src, const char *from, fat_volume *dst, const char *to)
+{
+    struct fat_stat st, dst_st;
+    struct fat_dir dir;
+    char subfrom[MAXPATHLEN], subto[MAXPATHLEN];
+    int rv, failed = 0;
+
+    rv = fat_lookup(src, from, &st);
+    if (rv == FAT_OK && !st.is_dir)
+	rv = fat_copy(src, &st, dst, to, NULL);
+    else if (rv == FAT_OK && st.name[0] != '\0')
     {
-	if (p2[i] == '/' || p2[i] == '\\') 
-	{
-	    uppername = p2+i+1;
-	}
+	/* copying into a directory that is there already merges them */
+	rv = fat_mkdir(dst, to, NULL);
+	if (rv == FAT_EEXIST && fat_lookup(dst, to, &dst_st) == FAT_OK && dst_st.is_dir)
+	    rv = FAT_OK;
     }
-
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
+    if (rv < 0)
     {
-	uppername[i] = toupper(uppername[i]);
+	fprintf(stderr, "Cannot copy %s to %s: %s\n", from, to,
+		rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	return 1;
     }
+    if (!st.is_dir)
+	return 0;
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
+    rv = fat_opendir(src, from, &dir);
+    while (rv == FAT_OK && (rv = fat_readdir(&dir, &st)) > 0)
     {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+	rv = FAT_OK;
+	if ((st.attr & ATTR_VOLUME) != 0)
+	    continue;
+	snprintf(subfrom, sizeof(subfrom), "%s/%s", from, st.name);
+	snprintf(subto, sizeof(subto), "%s/%s", to, st.name);
+	failed += copytree(src, subfrom, dst, subto);
     }
-    else 
-    {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
-    }
-
-    if (strlen(uppername)>8) 
+    if (rv < 0)
     {
-	uppername[8]='\0';
+	fprintf(stderr, "%s/: %s\n", from, fat_strerror(rv));
+	failed++;
     }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
-
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
-
-    /* could also set time and date here if we really
-       cared... */
+    return failed;
 }
 
+/* within tells whether path names the directory from or something
+   below it, in the image from is in.  Each leading part of path is
+   looked up and compared with from's entry, so case and 8.3 cutting
+   are judged as the library judges them. */
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
-
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+int within(fat_volume *vol, const char *from, const char *path)
 {
-    while (1) 
-    {
-	if (dirent->deName[0] == SLOT_EMPTY) 
-	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
-	}
+    struct fat_stat top, st;
+    char prefix[MAXPATHLEN];
+    size_t i;
 
-	if (dirent->deName[0] == SLOT_DELETED) 
+    if (fat_lookup(vol, from, &top) < 0 || !top.is_dir)
+	return FALSE;
+    for (i = 0; i < MAXPATHLEN; i++)
+    {
+	if (path[i] == '/' || path[i] == '\\' || path[i] == '\0')
 	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    memcpy(prefix, path, i);
+	    prefix[i] = '\0';
+	    if (fat_lookup(vol, prefix, &st) < 0)
+		return FALSE;
+	    if (st.entry == top.entry)
+		return TRUE;
 	}
-	dirent++;
+	if (path[i] == '\0')
+	    break;
     }
+    return FALSE;
 }
 
-/* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+/* copyimg opens both images and copies a:from in one to a:to in the
+   other; into to if that is a directory already */
 
-void copyin(char *infilename, char* outfilename,
-	    uint8_t *image_buf, struct bpb33* bpb)
+int copyimg(char *srcname, char *from, char *dstname, char *to, int flags,
+	    int stats)
 {
-    struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size = 0;
-
-    assert(strncmp("a:", outfilename, 2)==0);
-    outfilename+=2;
-
-    /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) 
+    fat_volume *src, *dst;
+    struct fat_stat st;
+    struct stat src_file, dst_file;
+    char path[MAXPATHLEN];
+    const char *base;
+    int rv, failed, same;
+
+    if (strncmp("a:", from, 2) != 0 || strncmp("a:", to, 2) != 0)
+	return -1;
+    from += 2;
+    to += 2;
+
+    same = stat(srcname, &src_file) == 0 && stat(dstname, &dst_file) == 0
+	&& src_file.st_dev == dst_file.st_dev && src_file.st_ino == dst_file.st_ino;
+    rv = fat_open(srcname, FAT_RDONLY, &src);
+    if (rv < 0)
     {
-	fprintf(stderr, "File %s already exists\n", outfilename);
+	fprintf(stderr, "%s: %s\n", srcname, rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
 	exit(1);
     }
-
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) 
+    rv = fat_open(dstname, FAT_RDWR | flags, &dst);
+    if (rv < 0)
     {
-	fprintf(stderr, "Directory does not exists in the disk image\n");
+	fprintf(stderr, "%s: %s\n", dstname, rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
 	exit(1);
     }
 
-    /* open the real file for reading */
-    fd = fopen(infilename, "r");
-    if (fd == NULL) 
+    base = strrchr(from, '/');
+    if (strrchr(from, '\\') > base)
+	base = strrchr(from, '\\');
+    base = base ? base + 1 : from;
+    strncpy(path, to, MAXPATHLEN - 1);
+    path[MAXPATHLEN - 1] = '\0';
+    if (*base != '\0' && fat_lookup(dst, to, &st) == FAT_OK && st.is_dir)
+	snprintf(path, sizeof(path), "%s/%s", to, base);
+
+    /* within one image a tree cannot go inside itself: it would copy
+       its own copy until the image filled */
+    if (same && within(src, from, path))
     {
-	fprintf(stderr, "Can't open file %s to copy data in\n",
-		infilename);
-	exit(1);
+	fprintf(stderr, "Cannot copy %s into itself\n", from);
+	fat_close(src);
+	fat_close(dst);
+	return 1;
     }
+    failed = copytree(src, from, dst, path);
 
-    /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
-
-    /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
-    
-    fclose(fd);
+    if (stats)
+    {
+	dos_print_stats(stderr, fat_stats(src));
+	dos_print_stats(stderr, fat_stats(dst));
+    }
+    fat_close(src);
+    rv = fat_close(dst);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", dstname, rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	failed++;
+    }
+    return failed > 0;
 }
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> a:<filename1> <filename2>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] <imagename> a:<filename1> <filename2>\n", progname);
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
-    fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] [--punch] [--sync none|ordered|full] [--append|--overwrite] <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "\t--append adds it to the end of filename4 instead, and --overwrite replaces\n");
+    fprintf(stderr, "\tfilename4's contents in place; either creates it if need be\n");
+    fprintf(stderr, "\t--punch leaves the image sparse over its free clusters\n");
+    fprintf(stderr, "\t--sync ordered waits for the data, then the FAT, then the directory\n");
+    fprintf(stderr, "\tto reach the disk; full also syncs the image file (default $FAT_SYNC)\n");
+    fprintf(stderr, "usage: %s [--stats] [--punch] [--sync none|ordered|full] <imagename1> a:<path1> <imagename2> a:<path2>\n", progname);
+    fprintf(stderr, "\tcopies path1, a file or a directory tree, from one image to the other\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    int fd;
-    uint8_t *image_buf;
-    struct bpb33* bpb;
-    if (argc < 4 || argc > 4) 
+    fat_volume *vol;
+    int rv;
+    int stats = dos_stats_option(&argc, argv);
+    int punch = dos_option(&argc, argv, "--punch");
+    int append = dos_option(&argc, argv, "--append");
+    int overwrite = dos_option(&argc, argv, "--overwrite");
+    const char *sync = dos_option_arg(&argc, argv, "--sync");
+    int policy = sync != NULL ? fat_sync_mode(sync) : 0;
+    if (argc < 4 || argc > 5 || policy < 0 || (append && overwrite)) 
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+    /* from one image straight into another */
+    if (argc == 5)
+    {
+	rv = copyimg(argv[1], argv[2], argv[3], argv[4],
+		     policy | (punch ? FAT_PUNCH : 0), stats);
+	if (rv < 0)
+	    usage(argv[0]);
+	return rv;
+    }
 
     /* use the "a:" bit to determine whether we're copying in or out */
+    if (strncmp("a:", argv[2], 2) != 0 && strncmp("a:", argv[3], 2) != 0)
+    {
+	usage(argv[0]);
+    }
+
+    rv = fat_open(argv[1], strncmp("a:", argv[2], 2)==0 ? FAT_RDONLY
+		  : FAT_RDWR | policy | (punch ? FAT_PUNCH : 0), &vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[1], fat_strerror(rv));
+	exit(1);
+    }
+
     if (strncmp("a:", argv[2], 2)==0) 
     {
 	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
+	copyout(vol, argv[2], argv[3]);
     }
-    else if (strncmp("a:", argv[3], 2)==0) 
+    else 
     {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	copyin(vol, argv[2], argv[3], append ? fat_append
+	       : overwrite ? fat_overwrite : fat_write);
     } 
-    else 
+
+    if (stats)
+	dos_print_stats(stderr, fat_stats(vol));
+    rv = fat_close(vol);
+    if (rv < 0)
     {
-	usage(argv[0]);
+	fprintf(stderr, "%s: %s\n", argv[1], rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	exit(1);
     }
-
-    unmmap_file(image_buf, &fd);
     return 0;
 }
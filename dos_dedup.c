@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "libfat.h"
+
+/* dos_dedup measures how much of one image, or of a set of images, is
+   held twice:
+
+       dos_dedup [-v] [-j jobs] <imagename>...
+
+   Every cluster in use is hashed where it lies in the image.  The
+   threads split the data area into runs, so each one reads in physical
+   order.  Clusters are the same when their hashes match and their
+   bytes compare equal.  A file's hash is built from its clusters'
+   hashes in chain order, with the last one cut at the file's end, so
+   whole files that are the same are found too.  -v lists them. */
+
+struct image
+{
+    const char *name;
+    fat_volume *vol;
+    uint8_t *buf;
+    struct bpb33 *bpb;
+    uint32_t csize;
+    uint16_t limit;
+    uint8_t *used;		/* by cluster */
+    uint64_t *hash;		/* by cluster, where used */
+    uint32_t inuse;
+    int files;
+};
+
+struct cluster_ref
+{
+    uint64_t hash;
+    uint32_t csize;
+    int image;
+    uint16_t cluster;
+};
+
+struct file_ref
+{
+    uint64_t hash;
+    uint32_t size;
+    uint32_t alloc;		/* bytes of clusters it holds */
+    int image;
+    char *path;
+};
+
+struct job
+{
+    struct image *img;
+    uint16_t first, end;	/* clusters [first, end) */
+    pthread_t thread;
+    int started;
+};
+
+static struct image *images;
+static int nimages;
+
+static struct file_ref *files;
+static int nfiles, files_size;
+
+
+/* ---------- hashing ---------- */
+
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/* a 64 bit hash of len bytes, in four independent lanes so that the
+   compiler can keep them in vector registers */
+uint64_t hash_bytes(const uint8_t *p, size_t len)
+{
+    uint64_t lane[4] = { 0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+			 0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL };
+    uint64_t h, w;
+    size_t i;
+    int l;
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+	for (l = 0; l < 4; l++)
+	{
+	    memcpy(&w, p + i + 8 * l, 8);
+	    lane[l] = (lane[l] ^ w) * 0x100000001b3ULL;
+	    lane[l] ^= lane[l] >> 29;
+	}
+    }
+    h = len;
+    for (l = 0; l < 4; l++)
+	h = mix(h ^ lane[l]);
+    for (; i < len; i++)
+	h = (h ^ p[i]) * 0x100000001b3ULL;
+    return mix(h);
+}
+
+
+void *hash_run(void *arg)
+{
+    struct job *job = arg;
+    struct image *img = job->img;
+    uint16_t c;
+
+    for (c = job->first; c < job->end; c++)
+	if (img->used[c])
+	    img->hash[c] = hash_bytes(cluster_to_addr(c, img->buf, img->bpb), img->csize);
+    return NULL;
+}
+
+
+/* hash every cluster in use, each thread taking a run of them */
+int hash_clusters(struct image *img, int jobs)
+{
+    struct job *job = calloc(jobs, sizeof(struct job));
+    uint32_t per, start = CLUST_FIRST;
+    int i;
+
+    if (job == NULL)
+	return FAT_ENOMEM;
+    per = (img->limit - CLUST_FIRST + jobs - 1) / jobs;
+    for (i = 0; i < jobs; i++)
+    {
+	job[i].img = img;
+	job[i].first = start;
+	job[i].end = start + per < img->limit ? start + per : img->limit;
+	start = job[i].end;
+    }
+    /* the first run is done here; any thread that will not start has
+       its run done here too */
+    for (i = 1; i < jobs; i++)
+	job[i].started = pthread_create(&job[i].thread, NULL, hash_run, &job[i]) == 0;
+    for (i = 0; i < jobs; i++)
+	if (!job[i].started)
+	    hash_run(&job[i]);
+    for (i = 1; i < jobs; i++)
+	if (job[i].started)
+	    pthread_join(job[i].thread, NULL);
+    free(job);
+    return FAT_OK;
+}
+
+
+/* ---------- files ---------- */
+
+int add_file(struct image *img, int index, const char *path, const struct fat_stat *st)
+{
+    uint16_t cluster = st->cluster;
+    uint32_t left = st->size, steps = 0;
+    uint64_t h = st->size;
+
+    /* the chain's hashes, in order; the last cluster only as far as
+       the end of the file */
+    while (left > 0)
+    {
+	if (!is_valid_cluster(cluster, img->bpb) || !img->used[cluster]
+	    || ++steps > img->limit)
+	    return FAT_ECORRUPT;
+	if (left >= img->csize)
+	    h = mix(h ^ img->hash[cluster]);
+	else
+	    h = mix(h ^ hash_bytes(cluster_to_addr(cluster, img->buf, img->bpb), left));
+	left -= left < img->csize ? left : img->csize;
+	cluster = get_fat_entry(cluster, img->buf, img->bpb);
+    }
+
+    if (nfiles == files_size)
+    {
+	int size = files_size ? files_size * 2 : 256;
+	struct file_ref *f = realloc(files, size * sizeof(struct file_ref));
+
+	if (f == NULL)
+	    return FAT_ENOMEM;
+	files = f;
+	files_size = size;
+    }
+    files[nfiles].path = strdup(path);
+    if (files[nfiles].path == NULL)
+	return FAT_ENOMEM;
+    files[nfiles].hash = h;
+    files[nfiles].size = st->size;
+    files[nfiles].alloc = steps * img->csize;
+    files[nfiles].image = index;
+    nfiles++;
+    img->files++;
+    return FAT_OK;
+}
+
+
+/* hash every file below path; a damaged file or directory is reported
+   and left out */
+int walk(struct image *img, int index, const char *path)
+{
+    struct fat_dir dir;
+    struct fat_stat st;
+    char subpath[MAXPATHLEN];
+    int rv, err = FAT_OK;
+
+    rv = fat_opendir(img->vol, path, &dir);
+    while (rv == FAT_OK && (rv = fat_readdir(&dir, &st)) > 0)
+    {
+	rv = FAT_OK;
+	if ((st.attr & ATTR_VOLUME) != 0)
+	    continue;
+	snprintf(subpath, sizeof(subpath), "%s/%s", path, st.name);
+	if (st.is_dir)
+	{
+	    if (walk(img, index, subpath) < 0)
+		err = FAT_ECORRUPT;
+	}
+	else if ((rv = add_file(img, index, subpath, &st)) == FAT_ECORRUPT)
+	{
+	    fprintf(stderr, "%s:%s: %s\n", img->name, subpath, fat_strerror(rv));
+	    err = rv;
+	    rv = FAT_OK;
+	}
+    }
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s:%s/: %s\n", img->name, path, fat_strerror(rv));
+	return rv;
+    }
+    return err;
+}
+
+
+/* ---------- the report ---------- */
+
+int cluster_cmp(const void *a, const void *b)
+{
+    const struct cluster_ref *x = a, *y = b;
+
+    if (x->csize != y->csize)
+	return x->csize < y->csize ? -1 : 1;
+    if (x->hash != y->hash)
+	return x->hash < y->hash ? -1 : 1;
+    if (x->image != y->image)
+	return x->image - y->image;
+    return x->cluster - y->cluster;
+}
+
+
+int file_cmp(const void *a, const void *b)
+{
+    const struct file_ref *x = a, *y = b;
+
+    if (x->size != y->size)
+	return x->size > y->size ? -1 : 1;
+    if (x->hash != y->hash)
+	return x->hash < y->hash ? -1 : 1;
+    if (x->image != y->image)
+	return x->image - y->image;
+    return strcmp(x->path, y->path);
+}
+
+
+static uint8_t *cluster_bytes(const struct cluster_ref *r)
+{
+    return cluster_to_addr(r->cluster, images[r->image].buf, images[r->image].bpb);
+}
+
+
+/* group the clusters with the same size and hash; those that compare
+   equal to the first of their group are duplicates */
+int report_clusters(void)
+{
+    struct cluster_ref *refs;
+    uint64_t total = 0, saved = 0;
+    uint32_t n = 0, dups = 0, groups = 0, zeros = 0, i, j, k;
+    uint16_t c;
+    int m;
+
+    for (m = 0; m < nimages; m++)
+	total += images[m].inuse;
+    refs = malloc((total + 1) * sizeof(struct cluster_ref));
+    if (refs == NULL)
+	return FAT_ENOMEM;
+    for (m = 0; m < nimages; m++)
+	for (c = CLUST_FIRST; c < images[m].limit; c++)
+	    if (images[m].used[c])
+	    {
+		refs[n].hash = images[m].hash[c];
+		refs[n].csize = images[m].csize;
+		refs[n].image = m;
+		refs[n++].cluster = c;
+	    }
+    qsort(refs, n, sizeof(struct cluster_ref), cluster_cmp);
+
+    for (i = 0; i < n; i = j)
+    {
+	uint32_t same = 0;
+
+	for (j = i + 1; j < n && refs[j].csize == refs[i].csize
+		 && refs[j].hash == refs[i].hash; j++)
+	    ;
+	for (k = i + 1; k < j; k++)
+	    if (memcmp(cluster_bytes(&refs[k]), cluster_bytes(&refs[i]), refs[i].csize) == 0)
+		same++;
+	if (same == 0)
+	    continue;
+	groups++;
+	dups += same;
+	saved += (uint64_t)same * refs[i].csize;
+	if (dos_is_zero(cluster_bytes(&refs[i]), refs[i].csize))
+	    zeros += same;
+    }
+    printf("Duplicate clusters: %u of %u in %u groups (%u of them all zeros), %llu KB\n",
+	   dups, n, groups, zeros, (unsigned long long)saved / 1024);
+    free(refs);
+    return FAT_OK;
+}
+
+
+void report_files(int verbose)
+{
+    uint64_t saved = 0;
+    int dups = 0, groups = 0, i, j, k;
+
+    qsort(files, nfiles, sizeof(struct file_ref), file_cmp);
+    for (i = 0; i < nfiles; i = j)
+    {
+	for (j = i + 1; j < nfiles && files[j].size == files[i].size
+		 && files[j].hash == files[i].hash; j++)
+	    ;
+	if (j - i < 2 || files[i].size == 0)
+	    continue;
+	groups++;
+	dups += j - i - 1;
+	for (k = i + 1; k < j; k++)
+	    saved += files[k].alloc;
+	if (verbose)
+	{
+	    printf("  %u bytes x%d:", files[i].size, j - i);
+	    for (k = i; k < j; k++)
+		printf(" %s:%s", images[files[k].image].name, files[k].path);
+	    printf("\n");
+	}
+    }
+    printf("Duplicate files: %d of %d in %d groups, %llu KB\n",
+	   dups, nfiles, groups, (unsigned long long)saved / 1024);
+}
+
+
+/* ---------- main ---------- */
+
+int open_image(struct image *img, const char *name, int jobs)
+{
+    uint16_t c, v;
+    int rv;
+
+    img->name = name;
+    rv = fat_open(name, FAT_RDONLY, &img->vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", name, rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	return rv;
+    }
+    /* nothing may change while it is read directly */
+    if (fat_lock_volume(img->vol, FALSE) < 0 || (img->buf = fat_image(img->vol)) == NULL)
+    {
+	fprintf(stderr, "Cannot read %s: %s\n", name, strerror(errno));
+	return FAT_EIO;
+    }
+    img->bpb = fat_bpb(img->vol);
+    img->csize = img->bpb->bpbBytesPerSec * img->bpb->bpbSecPerClust;
+    img->limit = cluster_limit(img->bpb);
+    img->used = calloc(img->limit, 1);
+    img->hash = calloc(img->limit, sizeof(uint64_t));
+    if (img->used == NULL || img->hash == NULL)
+    {
+	fprintf(stderr, "%s: %s\n", name, fat_strerror(FAT_ENOMEM));
+	return FAT_ENOMEM;
+    }
+    for (c = CLUST_FIRST; c < img->limit; c++)
+    {
+	v = get_fat_entry(c, img->buf, img->bpb);
+	if (v != CLUST_FREE && v != (FAT12_MASK & CLUST_BAD))
+	{
+	    img->used[c] = TRUE;
+	    img->inuse++;
+	}
+    }
+    rv = hash_clusters(img, jobs);
+    if (rv < 0)
+	fprintf(stderr, "%s: %s\n", name, fat_strerror(rv));
+    return rv;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-v] [-j jobs] <imagename>...\n", progname);
+    fprintf(stderr, "\treports clusters and whole files held more than once, in one\n");
+    fprintf(stderr, "\timage or across all of them; -v lists the duplicate files\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int verbose = FALSE, rv = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "vj:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'v':
+	    verbose = TRUE;
+	    break;
+	case 'j':
+	    jobs = atoi(optarg);
+	    if (jobs < 1)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind == argc)
+    {
+	usage(argv[0]);
+    }
+
+    nimages = argc - optind;
+    images = calloc(nimages, sizeof(struct image));
+    if (images == NULL)
+	exit(1);
+    for (i = 0; i < nimages; i++)
+    {
+	if (open_image(&images[i], argv[optind + i], jobs) < 0)
+	    exit(1);
+	if (walk(&images[i], i, "") < 0)
+	    rv = 1;
+	printf("%s: %u clusters of %u bytes in use, %d files\n", images[i].name,
+	       images[i].inuse, images[i].csize, images[i].files);
+    }
+
+    if (report_clusters() < 0)
+    {
+	fprintf(stderr, "%s\n", fat_strerror(FAT_ENOMEM));
+	exit(1);
+    }
+    report_files(verbose);
+
+    for (i = 0; i < nimages; i++)
+    {
+	fat_unlock_volume(images[i].vol);
+	fat_close(images[i].vol);
+    }
+    return rv;
+}
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "libfat.h"
+
+/* dos_defrag reports how fragmented the files in an image are and,
+   with -d, rewrites the image so that every directory and file is
+   contiguous, directories first.
+
+   Every move is copy-then-relink: the data is copied to free clusters
+   and chained there, then the single directory entry pointing at the
+   chain is switched over, and only then is the old chain freed, with
+   the image synced between the steps.  A crash at any point leaves
+   either the old or the new chain in place, plus at worst an
+   unreferenced chain that scandisk recovers. */
+
+#define CLUSTER_SIZE(bpb) (bpb->bpbSecPerClust * bpb->bpbBytesPerSec)
+#define DIRENTS_PER_CLUSTER(bpb) (CLUSTER_SIZE(bpb) / sizeof(struct direntry))
+
+/* a directory or file with a cluster chain */
+struct object
+{
+    int parent;			/* object index of its directory, -1 for root */
+    int slot;			/* index of its entry in that directory */
+    int is_dir;
+    uint16_t first;
+    uint32_t nclusters;
+    uint32_t extents;
+    char path[MAXPATHLEN];
+};
+
+struct volume
+{
+    fat_volume *vol;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    size_t size;
+    struct object *objs;
+    int nobjs, maxobjs;
+    int *owner;			/* object index + 1 for each cluster, 0 if none */
+    uint16_t *chain;		/* scratch space for one chain */
+};
+
+
+/* get_name retrieves the filename from a directory entry */
+void get_name(char *fullname, struct direntry *dirent)
+{
+    char name[9];
+    char extension[4];
+    int i;
+
+    memcpy(name, dirent->deName, 8);
+    memcpy(extension, dirent->deExtension, 3);
+    name[8] = '\0';
+    extension[3] = '\0';
+
+    /* names are space padded - remove the padding */
+    for (i = 7; i >= 0 && name[i] == ' '; i--)
+	name[i] = '\0';
+    for (i = 2; i >= 0 && extension[i] == ' '; i--)
+	extension[i] = '\0';
+
+    strcpy(fullname, name);
+    if (strlen(extension))
+    {
+	strcat(fullname, ".");
+	strcat(fullname, extension);
+    }
+}
+
+
+/* walk the chain starting at first into v->chain, returning its length,
+   or -1 if it runs off the end of the disk, into a free or bad
+   cluster, or loops */
+int read_chain(struct volume *v, uint16_t first)
+{
+    uint32_t total = cluster_limit(v->bpb);
+    uint16_t cluster = first;
+    int n = 0;
+
+    DOS_STAT(v->bpb, chains_walked, 1);
+    while (!is_end_of_file(cluster))
+    {
+	if (!is_valid_cluster(cluster, v->bpb) || n >= total)
+	    return -1;
+	v->chain[n++] = cluster;
+	cluster = get_fat_entry(cluster, v->image_buf, v->bpb);
+    }
+    return n;
+}
+
+
+/* dirent_of finds the directory entry of an object by walking its
+   parent's current chain, so it stays right as directories move */
+struct direntry *dirent_of(struct volume *v, struct object *o)
+{
+    uint16_t cluster;
+    int i;
+
+    if (o->parent < 0)
+	return (struct direntry *)root_dir_addr(v->image_buf, v->bpb) + o->slot;
+
+    cluster = v->objs[o->parent].first;
+    for (i = 0; i < o->slot / DIRENTS_PER_CLUSTER(v->bpb); i++)
+	cluster = get_fat_entry(cluster, v->image_buf, v->bpb);
+    return (struct direntry *)cluster_to_addr(cluster, v->image_buf, v->bpb)
+	+ o->slot % DIRENTS_PER_CLUSTER(v->bpb);
+}
+
+
+/* record one object and claim its clusters */
+int add_object(struct volume *v, int parent, int slot, int is_dir,
+	       uint16_t first, char *path)
+{
+    struct object *o;
+    int n, i, index;
+
+    if (v->nobjs == v->maxobjs)
+    {
+	v->maxobjs = v->maxobjs ? v->maxobjs * 2 : 64;
+	v->objs = realloc(v->objs, v->maxobjs * sizeof(struct object));
+    }
+    index = v->nobjs++;
+    o = &v->objs[index];
+    memset(o, 0, sizeof(struct object));
+    o->parent = parent;
+    o->slot = slot;
+    o->is_dir = is_dir;
+    o->first = first;
+    strncpy(o->path, path, MAXPATHLEN - 1);
+
+    if (first == 0)
+	return index;		/* an empty file */
+
+    n = read_chain(v, first);
+    if (n < 0)
+    {
+	fprintf(stderr, "%s has a broken cluster chain - run scandisk first\n", path);
+	exit(1);
+    }
+    for (i = 0; i < n; i++)
+    {
+	if (v->owner[v->chain[i]] != 0)
+	{
+	    fprintf(stderr, "%s is cross-linked with %s - run scandisk first\n",
+		    path, v->objs[v->owner[v->chain[i]] - 1].path);
+	    exit(1);
+	}
+	v->owner[v->chain[i]] = index + 1;
+	if (i == 0 || v->chain[i] != v->chain[i - 1] + 1)
+	    o->extents++;
+    }
+    o->nclusters = n;
+    return index;
+}
+
+
+/* scan_dir records every entry of a directory, recursing into
+   subdirectories.  dir is the directory's object index, -1 for root. */
+void scan_dir(struct volume *v, int dir, char *path)
+{
+    char fullname[MAXFILENAME], subpath[MAXPATHLEN];
+    uint16_t cluster = dir < 0 ? MSDOSFSROOT : v->objs[dir].first;
+    int per_cluster = dir < 0 ? v->bpb->bpbRootDirEnts : DIRENTS_PER_CLUSTER(v->bpb);
+    int slot = 0, i;
+
+    while (1)
+    {
+	struct direntry *dirent =
+	    (struct direntry *)cluster_to_addr(cluster, v->image_buf, v->bpb);
+
+	for (i = 0; i < per_cluster; i++, slot++, dirent++)
+	{
+	    DOS_STAT(v->bpb, dirents_scanned, 1);
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.')
+		continue;
+	    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    get_name(fullname, dirent);
+	    snprintf(subpath, sizeof(subpath), "%s%s", path, fullname);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	    {
+		int sub = add_object(v, dir, slot, TRUE,
+				     getushort(dirent->deStartCluster), subpath);
+		if (v->objs[sub].first != 0)
+		{
+		    strncat(subpath, "/", sizeof(subpath) - strlen(subpath) - 1);
+		    scan_dir(v, sub, subpath);
+		}
+	    }
+	    else
+	    {
+		add_object(v, dir, slot, FALSE,
+			   getushort(dirent->deStartCluster), subpath);
+	    }
+	}
+
+	if (dir < 0)
+	    return;
+	cluster = get_fat_entry(cluster, v->image_buf, v->bpb);
+	if (!is_valid_cluster(cluster, v->bpb))
+	    return;
+    }
+}
+
+
+/* print the per-file and per-volume fragmentation report */
+void report(struct volume *v)
+{
+    uint32_t total = cluster_limit(v->bpb);
+    uint32_t files = 0, dirs = 0, fragmented = 0, extents = 0;
+    uint32_t free_clusters = 0, free_runs = 0, largest_run = 0, run = 0;
+    uint16_t c;
+    int i;
+
+    for (i = 0; i < v->nobjs; i++)
+    {
+	struct object *o = &v->objs[i];
+	printf("%s%s  %u clusters, %u extent%s\n", o->path, o->is_dir ? "/" : "",
+	       o->nclusters, o->extents, o->extents == 1 ? "" : "s");
+	if (o->is_dir)
+	    dirs++;
+	else
+	    files++;
+	if (o->extents > 1)
+	    fragmented++;
+	extents += o->extents;
+    }
+
+    for (c = CLUST_FIRST; c < total; c++)
+    {
+	if (get_fat_entry(c, v->image_buf, v->bpb) == CLUST_FREE)
+	{
+	    free_clusters++;
+	    if (run++ == 0)
+		free_runs++;
+	    if (run > largest_run)
+		largest_run = run;
+	}
+	else
+	{
+	    run = 0;
+	}
+    }
+
+    printf("\n%u files, %u directories, %u fragmented (%.1f%%), %u extents\n",
+	   files, dirs, fragmented,
+	   v->nobjs ? 100.0 * fragmented / v->nobjs : 0.0, extents);
+    printf("%u free clusters in %u runs, largest free run %u clusters\n",
+	   free_clusters, free_runs, largest_run);
+}
+
+
+/* flush the image to disk so the steps of a move reach it in order */
+void sync_image(struct volume *v)
+{
+    if (fat_sync(v->vol) < 0)
+    {
+	fprintf(stderr, "sync failed: %s\n", strerror(errno));
+	exit(1);
+    }
+}
+
+
+/* move_object copies an object's chain into the free clusters in
+   targets and relinks it there */
+void move_object(struct volume *v, int index, uint16_t *targets)
+{
+    struct object *o = &v->objs[index];
+    uint32_t csize = CLUSTER_SIZE(v->bpb);
+    uint16_t eof = FAT12_MASK & CLUST_EOFS;
+    int n = o->nclusters, i;
+
+    read_chain(v, o->first);
+
+    /* copy: the new chain is complete but nothing points at it yet */
+    for (i = 0; i < n; i++)
+    {
+	memcpy(cluster_to_addr(targets[i], v->image_buf, v->bpb),
+	       cluster_to_addr(v->chain[i], v->image_buf, v->bpb), csize);
+	set_fat_entry(targets[i], i + 1 < n ? targets[i + 1] : eof,
+		      v->image_buf, v->bpb);
+    }
+    if (o->is_dir)
+    {
+	/* the copy's "." entry names the directory itself */
+	struct direntry *dot =
+	    (struct direntry *)cluster_to_addr(targets[0], v->image_buf, v->bpb);
+	if (dot->deName[0] == '.')
+	    putushort(dot->deStartCluster, targets[0]);
+    }
+    sync_image(v);
+
+    /* relink: one two-byte store switches the file over */
+    putushort(dirent_of(v, o)->deStartCluster, targets[0]);
+    o->first = targets[0];
+    sync_image(v);
+
+    if (o->is_dir)
+    {
+	/* subdirectories' ".." entries point back here */
+	for (i = 0; i < v->nobjs; i++)
+	{
+	    struct object *sub = &v->objs[i];
+	    struct direntry *dotdot;
+	    if (sub->parent != index || !sub->is_dir || sub->first == 0)
+		continue;
+	    dotdot = (struct direntry *)cluster_to_addr(sub->first, v->image_buf, v->bpb) + 1;
+	    if (dotdot->deName[0] == '.' && dotdot->deName[1] == '.')
+		putushort(dotdot->deStartCluster, targets[0]);
+	}
+	/* on disk before the clusters they used to name are freed */
+	sync_image(v);
+    }
+
+    /* release the old chain */
+    for (i = 0; i < n; i++)
+    {
+	set_fat_entry(v->chain[i], CLUST_FREE, v->image_buf, v->bpb);
+	v->owner[v->chain[i]] = 0;
+    }
+    for (i = 0; i < n; i++)
+	v->owner[targets[i]] = index + 1;
+    o->extents = 1;
+    for (i = 1; i < n; i++)
+	if (targets[i] != targets[i - 1] + 1)
+	    o->extents++;
+    sync_image(v);
+}
+
+
+/* collect n free clusters outside [lo, hi), highest first, so that
+   evicted chains stay out of the way of the front of the disk */
+int free_clusters_outside(struct volume *v, uint16_t lo, uint16_t hi,
+			  uint16_t *targets, int n)
+{
+    uint16_t c;
+    int found = 0;
+
+    for (c = cluster_limit(v->bpb) - 1; c >= CLUST_FIRST && found < n; c--)
+    {
+	if (c >= lo && c < hi)
+	    continue;
+	if (get_fat_entry(c, v->image_buf, v->bpb) == CLUST_FREE)
+	    targets[found++] = c;
+    }
+    if (found < n)
+	return -1;
+
+    /* hand them out in ascending order, so the chain reads forwards */
+    for (int i = 0; i < n / 2; i++)
+    {
+	uint16_t t = targets[i];
+	targets[i] = targets[n - 1 - i];
+	targets[n - 1 - i] = t;
+    }
+    return 0;
+}
+
+
+/* is the object's chain exactly start, start+1, ... ? */
+int placed_at(struct volume *v, struct object *o, uint16_t start)
+{
+    return o->first == start && o->extents == 1;
+}
+
+
+/* defrag lays out directories and then files, in tree order, one after
+   another from the start of the data area.  Anything in the way is
+   evicted to free space at the end of the disk first.  Clusters that
+   belong to no object (bad or lost clusters) are stepped over. */
+int defrag(struct volume *v)
+{
+    uint32_t total = cluster_limit(v->bpb);
+    uint16_t *targets = malloc(total * sizeof(uint16_t));
+    uint16_t cursor = CLUST_FIRST;
+    int moved = 0, pass, i, k;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+	for (i = 0; i < v->nobjs; i++)
+	{
+	    struct object *o = &v->objs[i];
+	    uint32_t n = o->nclusters;
+	    uint16_t c, end;
+
+	    if (o->is_dir != (pass == 0) || n == 0)
+		continue;
+
+	retry:
+	    end = cursor + n;
+	    if (end > total)
+	    {
+		fprintf(stderr, "Ran out of room placing %s\n", o->path);
+		free(targets);
+		return -1;
+	    }
+	    if (placed_at(v, o, cursor))
+	    {
+		cursor = end;
+		continue;
+	    }
+
+	    /* step over clusters nothing can be moved out of */
+	    for (c = cursor; c < end; c++)
+	    {
+		if (v->owner[c] == 0
+		    && get_fat_entry(c, v->image_buf, v->bpb) != CLUST_FREE)
+		{
+		    cursor = c + 1;
+		    goto retry;
+		}
+	    }
+
+	    /* evict whatever is in the way, this object included */
+	    for (c = cursor; c < end; c++)
+	    {
+		int e = v->owner[c] - 1;
+		if (e < 0)
+		    continue;
+		if (free_clusters_outside(v, cursor, end, targets,
+					  v->objs[e].nclusters) < 0)
+		{
+		    fprintf(stderr, "Not enough free space to move %s out of the way\n",
+			    v->objs[e].path);
+		    free(targets);
+		    return -1;
+		}
+		move_object(v, e, targets);
+		moved++;
+	    }
+
+	    for (k = 0; k < n; k++)
+		targets[k] = cursor + k;
+	    move_object(v, i, targets);
+	    moved++;
+	    cursor = end;
+	}
+    }
+
+    free(targets);
+    return moved;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [--punch] [-d] <imagename>\n", progname);
+    fprintf(stderr, "\treports fragmentation; -d also makes every file contiguous\n");
+    fprintf(stderr, "\t--punch with -d leaves the image sparse over its free clusters\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct volume v;
+    int do_defrag = FALSE, rv = 0;
+    int stats = dos_stats_option(&argc, argv);
+    int punch = dos_option(&argc, argv, "--punch");
+
+    if (argc == 3 && strcmp(argv[1], "-d") == 0)
+    {
+	do_defrag = TRUE;
+	argv++;
+	argc--;
+    }
+    if (argc != 2)
+    {
+	usage(argv[0]);
+    }
+
+    memset(&v, 0, sizeof(v));
+    rv = fat_open(argv[1], do_defrag ? FAT_RDWR | (punch ? FAT_PUNCH : 0) : FAT_RDONLY,
+		  &v.vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[1], fat_strerror(rv));
+	exit(1);
+    }
+    /* the report must not see a half-made copy-in; defragmenting
+       moves anything */
+    rv = fat_lock_volume(v.vol, do_defrag);
+    if (rv < 0)
+    {
+	fprintf(stderr, "Cannot lock %s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+    rv = 0;
+    v.image_buf = fat_image(v.vol);
+    if (v.image_buf == NULL)
+    {
+	fprintf(stderr, "Cannot read %s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+    v.bpb = fat_bpb(v.vol);
+    v.size = fat_image_size(v.vol);
+    v.owner = calloc(cluster_limit(v.bpb), sizeof(int));
+    v.chain = malloc(cluster_limit(v.bpb) * sizeof(uint16_t));
+
+    scan_dir(&v, -1, "/");
+
+    if (do_defrag)
+    {
+	int moved = defrag(&v);
+	if (moved < 0)
+	{
+	    fprintf(stderr, "Defragmentation stopped early; the image is consistent\n");
+	    rv = 1;
+	}
+	else
+	    printf("Moved %d chains\n\n", moved);
+    }
+    report(&v);
+
+    free(v.objs);
+    free(v.owner);
+    free(v.chain);
+
+    if (stats)
+	dos_print_stats(stderr, fat_stats(v.vol));
+    if (fat_close(v.vol) < 0)
+    {
+	fprintf(stderr, "Cannot finish %s: %s\n", argv[1], strerror(errno));
+	rv = 1;
+    }
+    return rv;
+}
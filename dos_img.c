@@ -0,0 +1,233 @@
+#define _GNU_SOURCE		/* SEEK_DATA, SEEK_HOLE */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "libfat.h"
+
+/* dos_img works on whole image files and only reads what holds data,
+   so an image archive costs I/O in proportion to the space used:
+
+       dos_img copy <src> <dst>		copy, keeping the holes as holes
+       dos_img verify <a> <b>		compare, skipping holes in both
+       dos_img sparsify <image>		punch out the free clusters
+
+   Where the file system cannot say where the holes are, everything is
+   treated as data. */
+
+#define IMG_CHUNK (1024 * 1024)
+
+static uint8_t buf_a[IMG_CHUNK], buf_b[IMG_CHUNK];
+
+
+/* the start of the next data at or after pos, or size if none */
+off_t next_data(int fd, off_t pos, off_t size)
+{
+    off_t data = lseek(fd, pos, SEEK_DATA);
+
+    if (data < 0)
+	return errno == ENXIO ? size : pos;
+    return data < size ? data : size;
+}
+
+
+/* the end of the data starting at pos */
+off_t next_hole(int fd, off_t pos, off_t size)
+{
+    off_t hole = lseek(fd, pos, SEEK_HOLE);
+
+    return hole < 0 || hole > size ? size : hole;
+}
+
+
+int open_image(const char *path, off_t *size)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+	fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+	exit(2);
+    }
+    *size = st.st_size;
+    return fd;
+}
+
+
+int read_full(int fd, uint8_t *buf, size_t len, off_t off)
+{
+    while (len > 0)
+    {
+	ssize_t n = pread(fd, buf, len, off);
+
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return -1;
+	if (n == 0)
+	{
+	    memset(buf, 0, len);	/* past the end reads as zeros */
+	    break;
+	}
+	buf += n;
+	len -= n;
+	off += n;
+    }
+    return 0;
+}
+
+
+int do_copy(const char *src, const char *dst)
+{
+    off_t size, pos, end, copied = 0;
+    struct stat st;
+    int in = open_image(src, &size), out;
+
+    fstat(in, &st);
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out < 0 || ftruncate(out, size) < 0)
+    {
+	fprintf(stderr, "Cannot create %s: %s\n", dst, strerror(errno));
+	return 1;
+    }
+
+    for (pos = next_data(in, 0, size); pos < size; pos = next_data(in, end, size))
+    {
+	end = next_hole(in, pos, size);
+	while (pos < end)
+	{
+	    size_t n = end - pos < IMG_CHUNK ? end - pos : IMG_CHUNK;
+
+	    if (read_full(in, buf_a, n, pos) < 0 || pwrite(out, buf_a, n, pos) != n)
+	    {
+		fprintf(stderr, "Copying %s to %s failed at byte %lld: %s\n",
+			src, dst, (long long)pos, strerror(errno));
+		return 1;
+	    }
+	    pos += n;
+	    copied += n;
+	}
+    }
+    if (close(out) < 0)
+    {
+	fprintf(stderr, "Cannot write %s: %s\n", dst, strerror(errno));
+	return 1;
+    }
+    printf("Copied %lld of %lld bytes\n", (long long)copied, (long long)size);
+    return 0;
+}
+
+
+int do_verify(const char *path_a, const char *path_b)
+{
+    off_t size_a, size_b, pos = 0, end, eb, compared = 0;
+    int a = open_image(path_a, &size_a), b = open_image(path_b, &size_b);
+
+    if (size_a != size_b)
+    {
+	printf("%s and %s differ in size (%lld and %lld bytes)\n",
+	       path_a, path_b, (long long)size_a, (long long)size_b);
+	return 1;
+    }
+
+    /* step from boundary to boundary of either file's data; a hole
+       reads as zeros, so data in one against a hole in the other is
+       still compared */
+    while (pos < size_a)
+    {
+	off_t da = next_data(a, pos, size_a), db = next_data(b, pos, size_a);
+
+	pos = da < db ? da : db;
+	if (pos >= size_a)
+	    break;
+	end = da > pos ? da : next_hole(a, pos, size_a);
+	eb = db > pos ? db : next_hole(b, pos, size_a);
+	if (eb < end)
+	    end = eb;
+
+	while (pos < end)
+	{
+	    size_t n = end - pos < IMG_CHUNK ? end - pos : IMG_CHUNK, i;
+
+	    if (read_full(a, buf_a, n, pos) < 0 || read_full(b, buf_b, n, pos) < 0)
+	    {
+		fprintf(stderr, "Cannot read at byte %lld: %s\n", (long long)pos, strerror(errno));
+		return 2;
+	    }
+	    if (memcmp(buf_a, buf_b, n) != 0)
+	    {
+		for (i = 0; buf_a[i] == buf_b[i]; i++)
+		    ;
+		printf("%s and %s differ at byte %lld\n", path_a, path_b, (long long)pos + i);
+		return 1;
+	    }
+	    pos += n;
+	    compared += n;
+	}
+    }
+    printf("Identical; compared %lld of %lld bytes\n", (long long)compared, (long long)size_a);
+    return 0;
+}
+
+
+int do_sparsify(const char *path)
+{
+    struct stat before, after;
+    fat_volume *vol;
+    int rv;
+
+    if (stat(path, &before) < 0)
+    {
+	fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+	return 1;
+    }
+    rv = fat_open(path, FAT_RDWR | FAT_PUNCH, &vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", path, rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	return 1;
+    }
+    rv = fat_close(vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "Cannot punch holes in %s: %s\n", path,
+		rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	return 1;
+    }
+    stat(path, &after);
+    printf("%s: %lld KB allocated, was %lld KB, of %lld KB\n", path,
+	   (long long)after.st_blocks / 2, (long long)before.st_blocks / 2,
+	   (long long)after.st_size / 1024);
+    return 0;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s copy <src> <dst>\n", progname);
+    fprintf(stderr, "       %s verify <image1> <image2>\n", progname);
+    fprintf(stderr, "       %s sparsify <imagename>\n", progname);
+    fprintf(stderr, "\tcopies and compares images reading only their data, or punches\n");
+    fprintf(stderr, "\tholes over an image's free clusters\n");
+    exit(2);
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc == 4 && strcmp(argv[1], "copy") == 0)
+	return do_copy(argv[2], argv[3]);
+    if (argc == 4 && strcmp(argv[1], "verify") == 0)
+	return do_verify(argv[2], argv[3]);
+    if (argc == 3 && strcmp(argv[1], "sparsify") == 0)
+	return do_sparsify(argv[2]);
+    usage(argv[0]);
+    return 2;
+}
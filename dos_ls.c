@@ -1,18 +1,11 @@
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
-#include <sys/mman.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <string.h>
 
-#include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
-#include "dos.h"
+#include "libfat.h"
 
 
 void print_indent(int indent)
@@ -23,75 +16,22 @@ void print_indent(int indent)
 }
 
 
-uint16_t print_dirent(struct direntry *dirent, int indent)
+/* print one entry; returns TRUE if it is a directory to descend into */
+int print_entry(struct fat_stat *st, int indent)
 {
-    uint16_t followclust = 0;
-
-    int i;
-    char name[9];
-    char extension[4];
-    uint32_t size;
-    uint16_t file_cluster;
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-    if (name[0] == SLOT_EMPTY)
-    {
-	return followclust;
-    }
-
-    /* skip over deleted entries */
-    if (((uint8_t)name[0]) == SLOT_DELETED)
-    {
-	return followclust;
-    }
-
-    if (((uint8_t)name[0]) == 0x2E)
+    if ((st->attr & ATTR_VOLUME) != 0) 
     {
-	// dot entry ("." or "..")
-	// skip it
-        return followclust;
-    }
-
-    /* names are space padded - remove the spaces */
-    for (i = 8; i > 0; i--) 
-    {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
-
-    /* remove the spaces from extensions */
-    for (i = 3; i > 0; i--) 
-    {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
-    }
-
-    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
-    {
-	// ignore any long file name extension entries
-	//
-	// printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
-    }
-    else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-    {
-	printf("Volume: %s\n", name);
+	printf("Volume: %s\n", st->base);
     } 
-    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    else if (st->is_dir) 
     {
         // don't deal with hidden directories; MacOS makes these
         // for trash directories and such; just ignore them.
-	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
+	if ((st->attr & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
 	    print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
-            file_cluster = getushort(dirent->deStartCluster);
-            followclust = file_cluster;
+    	    printf("%s/ (directory)\n", st->base);
+	    return TRUE;
         }
     }
     else 
@@ -100,88 +40,109 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
          * a "regular" file entry
          * print attributes, size, starting cluster, etc.
          */
-	int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
-	int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
-	int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
-	int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
+	int ro = (st->attr & ATTR_READONLY) == ATTR_READONLY;
+	int hidden = (st->attr & ATTR_HIDDEN) == ATTR_HIDDEN;
+	int sys = (st->attr & ATTR_SYSTEM) == ATTR_SYSTEM;
+	int arch = (st->attr & ATTR_ARCHIVE) == ATTR_ARCHIVE;
 
-	size = getulong(dirent->deFileSize);
 	print_indent(indent);
 	printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	       name, extension, size, getushort(dirent->deStartCluster),
+	       st->base, st->ext, st->size, st->cluster,
 	       ro?'r':' ', 
                hidden?'h':' ', 
                sys?'s':' ', 
                arch?'a':' ');
     }
-
-    return followclust;
+    return FALSE;
 }
 
 
-void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb)
+/* list the directory at path, and everything below it; a damaged
+   directory is reported and the listing carries on without it */
+int list_dir(fat_volume *vol, char *path, int indent)
 {
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    struct fat_dir dir;
+    struct fat_stat st;
+    char subpath[MAXPATHLEN];
+    int rv, err = FAT_OK;
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
+    rv = fat_opendir(vol, path, &dir);
+    while (rv == FAT_OK && (rv = fat_readdir(&dir, &st)) > 0)
+    {
+	rv = FAT_OK;
+        if (print_entry(&st, indent))
 	{
-            
-            uint16_t followclust = print_dirent(dirent, indent);
-            if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb);
-            dirent++;
+	    snprintf(subpath, sizeof(subpath), "%s/%s", path, st.name);
+	    if (list_dir(vol, subpath, indent+1) < 0)
+		err = FAT_ECORRUPT;
 	}
-
-	cluster = get_fat_entry(cluster, image_buf, bpb);
     }
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s/: %s\n", path, fat_strerror(rv));
+	err = rv;
+    }
+    return err;
 }
 
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
+/* the free space, and a histogram of the runs it makes */
+int print_free(fat_volume *vol)
 {
-    uint16_t cluster = 0;
-
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    struct bpb33 *bpb = fat_bpb(vol);
+    uint32_t csize = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct dos_free space;
+    int i, rv;
 
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    rv = fat_free_space(vol, &space);
+    if (rv < 0)
     {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb);
-
-        dirent++;
+	fprintf(stderr, "Cannot read the FAT: %s\n", fat_strerror(rv));
+	return rv;
     }
+    printf("Free: %u of %u clusters (%u KB) in %u runs, the largest %u clusters (%u KB)\n",
+	   space.clusters, cluster_limit(bpb) - CLUST_FIRST,
+	   space.clusters * (csize / 512) / 2, space.runs,
+	   space.largest, space.largest * (csize / 512) / 2);
+    for (i = 0; i < DOS_FREE_BUCKETS; i++)
+	if (space.histogram[i] > 0)
+	    printf("    %5u-%-5u clusters: %u runs\n", 1u << i, (2u << i) - 1,
+		   space.histogram[i]);
+    return FAT_OK;
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] [--free] <imagename>\n", progname);
+    fprintf(stderr, "\t--free prints the free space and the runs it makes after the listing\n");
     exit(1);
 }
 
 
 int main(int argc, char** argv)
 {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
+    fat_volume *vol;
+    int rv;
+    int stats = dos_stats_option(&argc, argv);
+    int free_space = dos_option(&argc, argv, "--free");
     if (argc != 2)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    traverse_root(image_buf, bpb);
-
-    unmmap_file(image_buf, &fd);
-
-    return 0;
+    rv = fat_open(argv[1], FAT_RDONLY, &vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[1], fat_strerror(rv));
+	exit(1);
+    }
+    rv = list_dir(vol, "", 0);
+    if (free_space && print_free(vol) < 0)
+	rv = FAT_EIO;
+
+    if (stats)
+	dos_print_stats(stderr, fat_stats(vol));
+    fat_close(vol);
+    return rv < 0;
 }
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libfat.h"
+
+/* dos_mv renames a file or directory inside an image, or moves it to
+   another directory there, by rewriting directory entries only:
+
+       dos_mv <imagename> <from> <to>
+
+   If to is a directory, from goes into it under its own name. */
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [--sync none|ordered|full] <imagename> <from> <to>\n", progname);
+    fprintf(stderr, "\trenames from to to, or moves it into to if that is a directory\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    fat_volume *vol;
+    struct fat_stat st;
+    int rv;
+    int stats = dos_stats_option(&argc, argv);
+    const char *sync = dos_option_arg(&argc, argv, "--sync");
+    int policy = sync != NULL ? fat_sync_mode(sync) : 0;
+    if (argc != 4 || policy < 0)
+    {
+	usage(argv[0]);
+    }
+
+    rv = fat_open(argv[1], FAT_RDWR | policy, &vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[1], rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	exit(1);
+    }
+
+    rv = fat_rename(vol, argv[2], argv[3], &st);
+    if (rv == FAT_EEXIST)
+	fprintf(stderr, "%s already exists\n", argv[3]);
+    else if (rv == FAT_EINVAL)
+	fprintf(stderr, "Cannot move %s to %s\n", argv[2], argv[3]);
+    else if (rv < 0)
+	fprintf(stderr, "%s: %s\n", argv[2], fat_strerror(rv));
+
+    if (stats)
+	dos_print_stats(stderr, fat_stats(vol));
+    if (rv == FAT_OK)
+    {
+	rv = fat_close(vol);
+	if (rv < 0)
+	    fprintf(stderr, "%s: %s\n", argv[1], rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+    }
+    else
+	fat_close(vol);
+    return rv < 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libfat.h"
+
+/* dos_rm deletes files and directories in an image, or cuts files
+   down to a size:
+
+       dos_rm [-r] <imagename> <path>...
+       dos_rm -s <size> <imagename> <path>...
+
+   -r removes directories and everything below them.  The clusters
+   freed by all the paths go back to the FAT in one sweep, and with --punch
+   the image gives the space under them back to the host. */
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [--punch] [--sync none|ordered|full] [-r] <imagename> <path>...\n", progname);
+    fprintf(stderr, "       %s [--stats] [--punch] [--sync none|ordered|full] -s <size> <imagename> <path>...\n", progname);
+    fprintf(stderr, "\tremoves files, and with -r directories and all below them, or\n");
+    fprintf(stderr, "\ttruncates files to size bytes\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    fat_volume *vol;
+    long long size = -1;
+    char *end;
+    int recursive = FALSE, failed = 0;
+    int *results;
+    int opt, rv, i;
+    int stats = dos_stats_option(&argc, argv);
+    int punch = dos_option(&argc, argv, "--punch");
+    const char *sync = dos_option_arg(&argc, argv, "--sync");
+    int policy = sync != NULL ? fat_sync_mode(sync) : 0;
+
+    while ((opt = getopt(argc, argv, "rs:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'r':
+	    recursive = TRUE;
+	    break;
+	case 's':
+	    size = strtoll(optarg, &end, 0);
+	    if (*optarg == '\0' || *end != '\0' || size < 0 || size > UINT32_MAX)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind < 2 || policy < 0 || (recursive && size >= 0))
+    {
+	usage(argv[0]);
+    }
+
+    rv = fat_open(argv[optind], FAT_RDWR | policy | (punch ? FAT_PUNCH : 0), &vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[optind], rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	exit(1);
+    }
+
+    results = malloc((argc - optind - 1) * sizeof(int));
+    if (results == NULL)
+    {
+	perror("malloc");
+	exit(1);
+    }
+    if (size < 0)
+    {
+	rv = fat_remove_paths(vol, argv + optind + 1, argc - optind - 1,
+			      recursive, results);
+    }
+    else
+    {
+	rv = FAT_OK;
+	for (i = optind + 1; i < argc; i++)
+	    results[i - optind - 1] = fat_truncate(vol, argv[i], size, NULL);
+    }
+
+    for (i = optind + 1; i < argc; i++)
+    {
+	int err = results[i - optind - 1];
+
+	if (err == FAT_EINVAL && size >= 0)
+	    fprintf(stderr, "%s: is shorter than %lld bytes\n", argv[i], size);
+	else if (err == FAT_EINVAL)
+	    fprintf(stderr, "Cannot remove the root directory\n");
+	else if (err < 0)
+	    fprintf(stderr, "%s: %s\n", argv[i], err == FAT_EIO ? strerror(errno) : fat_strerror(err));
+	if (err < 0)
+	    failed++;
+	if (err == rv)
+	    rv = FAT_OK;
+    }
+    if (rv < 0)
+    {
+	/* the flush after the sweep */
+	fprintf(stderr, "%s: %s\n", argv[optind], rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	failed++;
+    }
+    free(results);
+
+    if (stats)
+	dos_print_stats(stderr, fat_stats(vol));
+    rv = fat_close(vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[optind], rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	failed++;
+    }
+    return failed > 0;
+}
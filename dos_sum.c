@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "direntry.h"
+#include "dos.h"
+#include "libfat.h"
+
+/* dos_sum writes a manifest of every file in an image, or checks an
+   image against one:
+
+       dos_sum [-j jobs] <imagename> > manifest
+       dos_sum [-j jobs] -c <manifest> <imagename>
+
+   Each file is checksummed with CRC32C where it lies in the image,
+   following its cluster chain, and the files are shared out among the
+   threads, biggest first.  A manifest line is the checksum, the size
+   and the path: "%08x %u %s".  Checking exits 0 if everything matches,
+   1 if anything differs and 2 on an error. */
+
+struct entry
+{
+    char *path;
+    struct fat_stat st;
+    uint32_t crc;
+    int err;			/* from fat_scan */
+    int listed;			/* the manifest has it */
+};
+
+struct tree
+{
+    struct entry *e;
+    int n, size;
+};
+
+struct job
+{
+    fat_volume *vol;
+    struct tree *tree;
+    int *order;			/* indexes into tree, biggest file first */
+    int next;			/* the next of them to take */
+};
+
+
+/* ---------- finding the files ---------- */
+
+int add_entry(struct tree *tree, const char *path, const struct fat_stat *st)
+{
+    if (tree->n == tree->size)
+    {
+	int size = tree->size ? tree->size * 2 : 256;
+	struct entry *e = realloc(tree->e, size * sizeof(struct entry));
+
+	if (e == NULL)
+	    return FAT_ENOMEM;
+	tree->e = e;
+	tree->size = size;
+    }
+    tree->e[tree->n].path = strdup(path);
+    if (tree->e[tree->n].path == NULL)
+	return FAT_ENOMEM;
+    tree->e[tree->n].st = *st;
+    tree->e[tree->n].crc = 0;
+    tree->e[tree->n].err = FAT_OK;
+    tree->e[tree->n].listed = FALSE;
+    tree->n++;
+    return FAT_OK;
+}
+
+
+/* gather every file below path; a damaged directory is reported and
+   the walk carries on without it */
+int walk(fat_volume *vol, const char *path, struct tree *tree)
+{
+    struct fat_dir dir;
+    struct fat_stat st;
+    char subpath[MAXPATHLEN];
+    int rv, err = FAT_OK;
+
+    rv = fat_opendir(vol, path, &dir);
+    while (rv == FAT_OK && (rv = fat_readdir(&dir, &st)) > 0)
+    {
+	rv = FAT_OK;
+	if ((st.attr & ATTR_VOLUME) != 0)
+	    continue;
+	snprintf(subpath, sizeof(subpath), "%s/%s", path, st.name);
+	if (st.is_dir)
+	{
+	    if (walk(vol, subpath, tree) < 0)
+		err = FAT_ECORRUPT;
+	}
+	else
+	    rv = add_entry(tree, subpath, &st);
+    }
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s/: %s\n", path, fat_strerror(rv));
+	return rv;
+    }
+    return err;
+}
+
+
+/* ---------- checksumming ---------- */
+
+int add_crc(void *arg, const void *data, size_t len)
+{
+    uint32_t *crc = arg;
+
+    *crc = dos_crc32c(*crc, data, len);
+    return 0;
+}
+
+
+void *worker(void *arg)
+{
+    struct job *job = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->tree->n)
+    {
+	struct entry *e = &job->tree->e[job->order[i]];
+
+	e->err = fat_scan(job->vol, &e->st, add_crc, &e->crc);
+    }
+    return NULL;
+}
+
+
+static struct tree *sort_tree;
+
+int by_size(const void *a, const void *b)
+{
+    uint32_t x = sort_tree->e[*(const int *)a].st.size;
+    uint32_t y = sort_tree->e[*(const int *)b].st.size;
+
+    return x > y ? -1 : x < y;
+}
+
+
+/* checksum every file, jobs at a time */
+int checksum_all(fat_volume *vol, struct tree *tree, int jobs)
+{
+    pthread_t *threads;
+    struct job job;
+    int i, started;
+
+    job.vol = vol;
+    job.tree = tree;
+    job.next = 0;
+    job.order = malloc((tree->n + 1) * sizeof(int));
+    threads = malloc(jobs * sizeof(pthread_t));
+    if (job.order == NULL || threads == NULL)
+    {
+	free(job.order);
+	free(threads);
+	return FAT_ENOMEM;
+    }
+    for (i = 0; i < tree->n; i++)
+	job.order[i] = i;
+    sort_tree = tree;
+    qsort(job.order, tree->n, sizeof(int), by_size);
+
+    if (jobs > tree->n)
+	jobs = tree->n;
+    for (started = 0; started < jobs; started++)
+	if (pthread_create(&threads[started], NULL, worker, &job) != 0)
+	    break;
+    if (started == 0)
+	worker(&job);
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+
+    free(job.order);
+    free(threads);
+    return FAT_OK;
+}
+
+
+/* ---------- the two modes ---------- */
+
+int do_manifest(struct tree *tree)
+{
+    int i, rv = 0;
+
+    for (i = 0; i < tree->n; i++)
+    {
+	struct entry *e = &tree->e[i];
+
+	if (e->err < 0)
+	{
+	    fprintf(stderr, "%s: %s\n", e->path, fat_strerror(e->err));
+	    rv = 2;
+	    continue;
+	}
+	printf("%08x %u %s\n", e->crc, e->st.size, e->path);
+    }
+    return rv;
+}
+
+
+int by_path(const void *a, const void *b)
+{
+    return strcmp(((const struct entry *)a)->path, ((const struct entry *)b)->path);
+}
+
+
+int do_verify(struct tree *tree, const char *manifest)
+{
+    FILE *in = fopen(manifest, "r");
+    char line[MAXPATHLEN + 32], *path;
+    struct entry key, *e;
+    unsigned int crc, size;
+    int checked = 0, differ = 0, lineno = 0, rv = 0, i;
+
+    if (in == NULL)
+    {
+	fprintf(stderr, "Cannot open %s: %s\n", manifest, strerror(errno));
+	return 2;
+    }
+    qsort(tree->e, tree->n, sizeof(struct entry), by_path);
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+	int n;
+
+	lineno++;
+	line[strcspn(line, "\n")] = '\0';
+	if (sscanf(line, "%x %u %n", &crc, &size, &n) != 2 || line[n] != '/')
+	{
+	    fprintf(stderr, "%s:%d: not a manifest line\n", manifest, lineno);
+	    rv = 2;
+	    continue;
+	}
+	path = line + n;
+	checked++;
+
+	key.path = path;
+	e = bsearch(&key, tree->e, tree->n, sizeof(struct entry), by_path);
+	if (e == NULL)
+	{
+	    printf("MISSING %s\n", path);
+	    differ++;
+	    continue;
+	}
+	e->listed = TRUE;
+	if (e->err < 0)
+	{
+	    fprintf(stderr, "%s: %s\n", path, fat_strerror(e->err));
+	    rv = 2;
+	}
+	else if (e->st.size != size)
+	{
+	    printf("CHANGED %s (%u bytes, was %u)\n", path, e->st.size, size);
+	    differ++;
+	}
+	else if (e->crc != crc)
+	{
+	    printf("CHANGED %s (checksum %08x, was %08x)\n", path, e->crc, crc);
+	    differ++;
+	}
+    }
+    fclose(in);
+
+    for (i = 0; i < tree->n; i++)
+    {
+	if (!tree->e[i].listed)
+	{
+	    printf("NEW %s\n", tree->e[i].path);
+	    differ++;
+	}
+    }
+    printf("%d files checked, %d differences\n", checked, differ);
+    if (rv == 0 && differ > 0)
+	rv = 1;
+    return rv;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-j jobs] <imagename>\n", progname);
+    fprintf(stderr, "       %s [--stats] [-j jobs] -c <manifest> <imagename>\n", progname);
+    fprintf(stderr, "\tprints the CRC32C, size and path of every file, or checks the\n");
+    fprintf(stderr, "\timage against a manifest printed before\n");
+    exit(2);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct tree tree;
+    fat_volume *vol;
+    const char *manifest = NULL;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int stats = dos_stats_option(&argc, argv);
+    int opt, rv, walked, i;
+
+    while ((opt = getopt(argc, argv, "j:c:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'j':
+	    jobs = atoi(optarg);
+	    if (jobs < 1)
+		usage(argv[0]);
+	    break;
+	case 'c':
+	    manifest = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+    {
+	usage(argv[0]);
+    }
+
+    rv = fat_open(argv[optind], FAT_RDONLY, &vol);
+    if (rv < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[optind],
+		rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	exit(2);
+    }
+
+    memset(&tree, 0, sizeof(tree));
+    walked = walk(vol, "", &tree);
+    if (checksum_all(vol, &tree, jobs) < 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[optind], fat_strerror(FAT_ENOMEM));
+	exit(2);
+    }
+    rv = manifest != NULL ? do_verify(&tree, manifest) : do_manifest(&tree);
+    if (walked < 0)
+	rv = 2;
+
+    if (stats)
+	dos_print_stats(stderr, fat_stats(vol));
+    for (i = 0; i < tree.n; i++)
+	free(tree.e[i].path);
+    free(tree.e);
+    fat_close(vol);
+    return rv;
+}
@@ -0,0 +1,837 @@
+/* fat_check: the scandisk checker, as a library call.  It walks the
+   tree from the root, marking every cluster reached, repairs chains that
+   disagree with their directory entries, then gathers the clusters in
+   use but unreached into /FOUND.000.  Everything it finds is recorded in
+   a fat_check_result; commentary goes through the caller's log hook. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "libfat.h"
+
+#define CLUSTER_SIZE(bpb) (bpb->bpbSecPerClust * bpb->bpbBytesPerSec)
+
+/* one check in progress */
+typedef struct {
+    uint8_t *img_buf;
+    struct bpb33 *bpb;
+    char *ref;          //clusters referenced by some dirent, indexed by cluster
+    struct fat_check_result *result;
+    fat_log_fn log;
+    void *log_arg;
+} checker;
+
+static void check_log(checker *ck, int level, const char *fmt, ...){
+    va_list ap;
+
+    if (ck->log == NULL)
+        return;
+    va_start(ap, fmt);
+    ck->log(ck->log_arg, level, fmt, ap);
+    va_end(ap);
+}
+
+#define say(ck, ...) check_log(ck, FAT_LOG_INFO, __VA_ARGS__)
+#define check_error(ck, ...) check_log(ck, FAT_LOG_ERROR, __VA_ARGS__)
+
+static void add_finding(checker *ck, const char *type, const char *path, int nclusters,
+                        const uint16_t *clusters, const char *action_fmt, ...){
+    struct fat_check_result *result = ck->result;
+
+    if (result->nfindings == result->findings_size){
+        result->findings_size = result->findings_size ? result->findings_size * 2 : 16;
+        result->findings = (struct fat_finding *) realloc(result->findings,
+                               sizeof(struct fat_finding) * result->findings_size);
+    }
+    struct fat_finding *f = &result->findings[result->nfindings++];
+
+    f->type = type;
+    f->path = strdup(path);
+    f->nclusters = nclusters;
+    f->clusters = (uint16_t *) malloc(sizeof(uint16_t) * (nclusters ? nclusters : 1));
+    memcpy(f->clusters, clusters, sizeof(uint16_t) * nclusters);
+    f->action = NULL;
+    if (action_fmt != NULL){
+        char action[128];
+        va_list ap;
+        va_start(ap, action_fmt);
+        vsnprintf(action, sizeof(action), action_fmt, ap);
+        va_end(ap);
+        f->action = strdup(action);
+        if (strcmp(type, "orphan") != 0)    //counted in result->orphans
+            result->repairs++;
+    }
+}
+
+void fat_check_free(struct fat_check_result *result){
+    for (int i = 0; i < result->nfindings; i++){
+        free(result->findings[i].path);
+        free(result->findings[i].clusters);
+        free(result->findings[i].action);
+    }
+    free(result->findings);
+    result->findings = NULL;
+    result->nfindings = result->findings_size = 0;
+}
+
+/* phase timing; CPU time is per thread so volumes checked side by side
+   in one process do not charge each other */
+typedef struct {
+    struct timespec wall, cpu;
+} phase_mark;
+
+static void phase_begin(phase_mark *m){
+    clock_gettime(CLOCK_MONOTONIC, &m->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &m->cpu);
+}
+
+static double seconds_between(struct timespec *a, struct timespec *b){
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void phase_end(checker *ck, phase_mark *m, int phase){
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    ck->result->wall[phase] += seconds_between(&m->wall, &wall);
+    ck->result->cpu[phase] += seconds_between(&m->cpu, &cpu);
+}
+
+/* helper functions related to managing orphans */
+typedef struct {
+    uint16_t *cluster_p;
+    int list_size;  //actual size of the array
+    int orphan_size; //how many cluster currently in this orphan
+    int nclusters;   //chain length without the EOF marker, set by fix_orphan_EOF
+} orphan;
+
+typedef struct orphans_node{
+    orphan *one_orphan;
+    struct orphans_node *next;
+} orphans_node;
+
+static void orphan_init(orphan *orp){
+    orp->list_size = 5; //default size 5
+    orp->orphan_size = 0;
+    orp->nclusters = 0;
+    orp->cluster_p = (uint16_t *) malloc(sizeof(uint16_t) * orp->list_size);
+}
+
+static int orphan_add(orphan *orp, uint16_t first, uint16_t second){
+    if (orp->orphan_size == orp->list_size){ //need to resize
+        orp->list_size = orp->list_size * 2;
+        orp->cluster_p = (uint16_t *) realloc(orp->cluster_p, sizeof(uint16_t) * orp->list_size);
+    }
+
+    //add here
+    if (orp->orphan_size == 0){ // orphan list is empty initially
+        orp->cluster_p[0] = first;
+        orp->cluster_p[1] = second;
+        orp->orphan_size = 2;
+    } else if (first == orp->cluster_p[orp->orphan_size - 1]){ //new orphan tail
+        orp->cluster_p[orp->orphan_size] = second;
+        orp->orphan_size++;
+    } else if (second == orp->cluster_p[0]){   //new orphan head
+        uint16_t *chain = orp->cluster_p;
+        orp->cluster_p = (uint16_t *) malloc(sizeof(uint16_t) * orp->list_size);
+        orp->cluster_p[0] = first;
+        memcpy(&(orp->cluster_p[1]), chain, sizeof(uint16_t) * (orp->orphan_size));
+        orp->orphan_size++;
+        free(chain); 
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static void fix_orphan_EOF(orphan *orp){
+    uint16_t last = orp->cluster_p[orp->orphan_size - 1];
+    if (!is_end_of_file(last)){
+        orphan_add(orp, last, FAT12_MASK & CLUST_EOFS);
+    }
+    orp->nclusters = orp->orphan_size - 1;
+}
+
+static void orphan_print(checker *ck, orphan *orp){
+    say(ck, "printing an orphan chain: ");
+    for (int i = 0; i < orp->orphan_size; i++){
+        say(ck, "%d ", orp->cluster_p[i]);
+    }
+    say(ck, "\n");
+}
+
+static void orphan_destroy(orphan *orp){
+    free(orp->cluster_p);
+    free(orp);
+}
+
+static void orphans_list_add(orphans_node **list, uint16_t first, uint16_t second){
+    if (*list == NULL){ //first orphan encountered
+        orphan *add = (orphan *) malloc(sizeof(orphan));
+        orphan_init(add);
+        orphan_add(add, first, second);
+
+        orphans_node *new_orphan = (orphans_node *) malloc(sizeof(orphans_node));
+        new_orphan->one_orphan = add;
+        new_orphan->next = NULL;
+
+        *list = new_orphan;
+    } else { //need to iterate through the orphans list
+        orphans_node *temp = *list;
+        orphans_node *tail = temp;
+
+        for (; temp != NULL; temp = temp->next){
+            if (orphan_add(temp->one_orphan, first, second)){ //part of existing orphan
+                return;
+            }
+            if (temp->next == NULL){ //update tail
+                tail = temp;
+            }
+        }
+
+        //new orphan
+        orphan *add = (orphan *) malloc(sizeof(orphan));
+        orphan_init(add);
+        orphan_add(add, first, second);
+
+        orphans_node *new_orphan = (orphans_node *) malloc(sizeof(orphans_node));
+        new_orphan->one_orphan = add;
+        new_orphan->next = NULL;
+
+        tail->next = new_orphan;
+    }
+}
+
+static void orphans_list_clear(orphans_node *list){
+    orphans_node *temp = list;
+    while (list != NULL){
+        orphan_destroy(list->one_orphan);
+        list = list->next;
+        free(temp);
+        temp = list;
+    }
+}
+/* --------end of orphan management helpers-------------- */
+
+/* --------FOUND.000 directory helpers-------------- */
+
+/* Recovered chains go into a FOUND.000 subdirectory of the root rather
+ * than into the root itself, so recovery is not limited by the fixed
+ * number of root entries.  The directory grows a cluster at a time;
+ * slot and next_free are cursors so each placement is O(1) (amortized
+ * for the free cluster search). */
+typedef struct {
+    uint16_t first_cluster; //first cluster of FOUND.000
+    uint16_t cluster;       //cluster currently being filled
+    int slot;               //next unused dirent in that cluster
+    uint16_t next_free;     //where to resume looking for a free cluster
+    int next_id;            //number for the next FILEnnnn.CHK
+} found_dir;
+
+#define DIRENTS_PER_CLUSTER(bpb) (CLUSTER_SIZE(bpb) / sizeof(struct direntry))
+
+static void set_dirent_name(struct direntry *dirent, char *name, char *extension){
+    memset(dirent->deName, ' ', 8);
+    memcpy(dirent->deName, name, strlen(name));
+    memset(dirent->deExtension, ' ', 3);
+    memcpy(dirent->deExtension, extension, strlen(extension));
+}
+
+/* find a free cluster from the cursor onwards, mark it EOF and zero it.
+ * Returns 0 if the disk is full */
+static uint16_t found_alloc_cluster(found_dir *found, uint8_t *img_buf, struct bpb33 *bpb){
+    for (; found->next_free < cluster_limit(bpb); found->next_free++){
+        if (get_fat_entry(found->next_free, img_buf, bpb) == (CLUST_FREE & FAT12_MASK)){
+            uint16_t cluster = found->next_free++;
+            set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS, img_buf, bpb);
+            memset(cluster_to_addr(cluster, img_buf, bpb), 0, CLUSTER_SIZE(bpb));
+            return cluster;
+        }
+    }
+    return 0;
+}
+
+/* look for an existing FOUND.000 in the root directory; returns its dirent
+ * or NULL, and leaves the first reusable root slot in *free_slot */
+static struct direntry *find_found_dir(uint8_t *img_buf, struct bpb33 *bpb, struct direntry **free_slot){
+    struct direntry *dirent = (struct direntry *) cluster_to_addr(0, img_buf, bpb);
+
+    *free_slot = NULL;
+    for (int i = 0; i < bpb->bpbRootDirEnts; i++, dirent++){
+        if (dirent->deName[0] == SLOT_EMPTY){
+            if (*free_slot == NULL)
+                *free_slot = dirent;
+            break;  //nothing after an empty slot
+        }
+        if (dirent->deName[0] == SLOT_DELETED){
+            if (*free_slot == NULL)
+                *free_slot = dirent;
+            continue;
+        }
+        if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 &&
+            memcmp(dirent->deName, "FOUND   000", 11) == 0){
+            return dirent;
+        }
+    }
+    return NULL;
+}
+
+/* the number in a FILEnnnn.CHK (or nnnnnnnn.CHK) name, else 0 */
+static int found_name_id(struct direntry *dirent){
+    const char *digits = (const char *) dirent->deName;
+    int n = 8, id = 0;
+
+    if (memcmp(dirent->deExtension, "CHK", 3) != 0)
+        return 0;
+    if (memcmp(digits, "FILE", 4) == 0){
+        digits += 4;
+        n = 4;
+    }
+    for (int i = 0; i < n; i++){
+        if (digits[i] < '0' || digits[i] > '9')
+            return 0;
+        id = id * 10 + (digits[i] - '0');
+    }
+    return id;
+}
+
+/* Set up the cursors for FOUND.000, creating the directory if needed.
+ * Returns 0 if there is no root slot or no free cluster for it. */
+static int found_dir_open(checker *ck, found_dir *found){
+    uint8_t *img_buf = ck->img_buf;
+    struct bpb33 *bpb = ck->bpb;
+    struct direntry *free_slot;
+    struct direntry *dirent = find_found_dir(img_buf, bpb, &free_slot);
+
+    found->next_free = CLUST_FIRST;
+    found->next_id = 0;
+
+    if (dirent != NULL && !is_valid_cluster(getushort(dirent->deStartCluster), bpb)){
+        /* its entry points nowhere (0 would be the root); make a new one
+           in the same slot */
+        uint16_t bad = getushort(dirent->deStartCluster);
+        say(ck, "FOUND.000 has a bad starting cluster, recreating it...\n");
+        add_finding(ck, "bad_start_cluster", "/FOUND.000/", 1, &bad, "recreated directory");
+        free_slot = dirent;
+        dirent = NULL;
+    }
+
+    if (dirent != NULL){
+        /* reuse it: move the cursor past the entries already there, and
+           number new files after the highest one, since a deleted file
+           may have left a gap */
+        found->first_cluster = getushort(dirent->deStartCluster);
+        found->cluster = found->first_cluster;
+        while (1){
+            struct direntry *d = (struct direntry *) cluster_to_addr(found->cluster, img_buf, bpb);
+            for (found->slot = 0; found->slot < DIRENTS_PER_CLUSTER(bpb); found->slot++, d++){
+                if (d->deName[0] == SLOT_EMPTY)
+                    return 1;
+                if (d->deName[0] != SLOT_DELETED && d->deName[0] != '.'){
+                    int id = found_name_id(d);
+                    if (id > found->next_id)
+                        found->next_id = id;
+                }
+            }
+            uint16_t next = get_fat_entry(found->cluster, img_buf, bpb);
+            if (!is_valid_cluster(next, bpb))
+                return 1;   //full; found_dir_add grows it
+            found->cluster = next;
+        }
+    }
+
+    if (free_slot == NULL){
+        check_error(ck, "No more available entry in root directory for FOUND.000!\n");
+        return 0;
+    }
+
+    found->first_cluster = found_alloc_cluster(found, img_buf, bpb);
+    if (found->first_cluster == 0){
+        check_error(ck, "No free cluster left for FOUND.000!\n");
+        return 0;
+    }
+    found->cluster = found->first_cluster;
+
+    /* "." and ".." entries */
+    struct direntry *d = (struct direntry *) cluster_to_addr(found->cluster, img_buf, bpb);
+    set_dirent_name(&d[0], ".", "");
+    d[0].deAttributes = ATTR_DIRECTORY;
+    putushort(d[0].deStartCluster, found->first_cluster);
+    set_dirent_name(&d[1], "..", "");
+    d[1].deAttributes = ATTR_DIRECTORY;
+    putushort(d[1].deStartCluster, MSDOSFSROOT);
+    found->slot = 2;
+
+    int was_empty = (free_slot->deName[0] == SLOT_EMPTY);
+    memset(free_slot, 0, sizeof(struct direntry));
+    set_dirent_name(free_slot, "FOUND", "000");
+    free_slot->deAttributes = ATTR_DIRECTORY;
+    putushort(free_slot->deStartCluster, found->first_cluster);
+
+    /* make sure the next dirent is set to be empty, just in case it
+       wasn't before */
+    struct direntry *root_end = (struct direntry *) cluster_to_addr(0, img_buf, bpb) + bpb->bpbRootDirEnts;
+    if (was_empty && free_slot + 1 < root_end){
+        memset(free_slot + 1, 0, sizeof(struct direntry));
+    }
+    return 1;
+}
+
+/* Write a dirent for the orphan at the cursor, growing the directory by
+ * a cluster when the current one is full.  Returns 0 on a full disk. */
+static int found_dir_add(checker *ck, found_dir *found, orphan *orp){
+    uint8_t *img_buf = ck->img_buf;
+    struct bpb33 *bpb = ck->bpb;
+
+    if (found->slot == DIRENTS_PER_CLUSTER(bpb)){
+        uint16_t cluster = found_alloc_cluster(found, img_buf, bpb);
+        if (cluster == 0){
+            check_error(ck, "No free cluster left to grow FOUND.000!\n");
+            return 0;
+        }
+        set_fat_entry(found->cluster, cluster, img_buf, bpb);
+        found->cluster = cluster;
+        found->slot = 0;
+    }
+
+    char name[9];
+    uint16_t starting_cluster = orp->cluster_p[0];
+    uint16_t last_cluster = orp->cluster_p[orp->nclusters - 1];
+    uint32_t size = orp->nclusters * CLUSTER_SIZE(bpb);
+    int id = ++found->next_id;
+
+    char path[32];
+
+    snprintf(name, sizeof(name), id < 10000 ? "FILE%04d" : "%08d", id);
+    snprintf(path, sizeof(path), "/FOUND.000/%s.CHK", name);
+    say(ck, "Getting orphan%d (starting from: %d, size: %d) home as FOUND.000/%s.CHK\n", id, starting_cluster, size, name);
+    add_finding(ck, "orphan", path, orp->nclusters, orp->cluster_p, "recovered, size %u", size);
+
+    /* the chain may have ended on a bad, free or cross-linked cluster */
+    if (!is_end_of_file(get_fat_entry(last_cluster, img_buf, bpb))){
+        set_fat_entry(last_cluster, FAT12_MASK & CLUST_EOFS, img_buf, bpb);
+    }
+
+    struct direntry *dirent = (struct direntry *) cluster_to_addr(found->cluster, img_buf, bpb) + found->slot;
+    memset(dirent, 0, sizeof(struct direntry));
+    set_dirent_name(dirent, name, "CHK");
+    dirent->deAttributes = ATTR_NORMAL;
+    putushort(dirent->deStartCluster, starting_cluster);
+    putulong(dirent->deFileSize, size);
+    found->slot++;
+    ck->result->orphans++;
+
+    /* make sure the next dirent is set to be empty, just in case it
+       wasn't before */
+    if (found->slot < DIRENTS_PER_CLUSTER(bpb)){
+        memset(dirent + 1, 0, sizeof(struct direntry));
+    }
+    return 1;
+}
+/* --------end of FOUND.000 directory helpers-------------- */
+
+/* a cluster number the FAT can hold but the disk has no room for */
+static int past_data_area(uint16_t cluster, struct bpb33 *bpb){
+    return cluster >= cluster_limit(bpb) && cluster < (CLUST_RSRVDS & FAT12_MASK);
+}
+
+/* Mark the given cluster as referenced
+ * 0 - unreferenced
+ * 1 - referenced
+ * ref should have been initialized to all 0's */
+static int update_ref(uint16_t cluster, char *ref){
+    if (ref[cluster]){
+        return 1;
+    }
+    ref[cluster] = 1;
+    return 0;
+}
+
+static int is_chained(uint16_t cluster){
+    if (cluster >= (CLUST_RSRVDS & FAT12_MASK) && cluster <= (CLUST_RSRVDE & FAT12_MASK))
+        return 0;
+    else if (cluster == (CLUST_BAD & FAT12_MASK))
+        return 0;
+    else if (cluster == (CLUST_FREE & FAT12_MASK))
+        return 0;
+    else
+        return 1;
+}
+
+/* find chains of clusters that are in use in the FAT but not reachable
+   from any directory entry */
+static orphans_node *find_orphans(char *ref, uint8_t *img_buf, struct bpb33 *bpb){
+    uint16_t fat_value;
+    orphans_node *orphans_list = NULL;
+
+    for(int i = 2; i < cluster_limit(bpb); i++){
+        if (ref[i] == 0){
+            fat_value = get_fat_entry(i, img_buf, bpb);
+            if (is_chained(fat_value)){
+                if (fat_value == (CLUST_BAD & FAT12_MASK) || fat_value == (CLUST_FREE & FAT12_MASK) || (is_valid_cluster(fat_value, bpb) && ref[fat_value])){
+                    orphans_list_add(&orphans_list, i, (CLUST_EOFS & FAT12_MASK));
+                } else {
+                    orphans_list_add(&orphans_list, i, fat_value);
+                }             
+            }
+        }
+    }
+
+    for (orphans_node *node = orphans_list; node != NULL; node = node->next){
+        fix_orphan_EOF(node->one_orphan);
+    }
+    return orphans_list;
+}
+
+/* give every orphan a home in FOUND.000 */
+static void recover_orphans(checker *ck, orphans_node *orphans_list){
+    found_dir found;
+
+    if (orphans_list != NULL && !found_dir_open(ck, &found)){
+        check_error(ck, "Orphans left unrecovered\n");
+        ck->result->unrecovered = 1;
+    } else {
+        for (; orphans_list != NULL; orphans_list = orphans_list->next){
+            orphan_print(ck, orphans_list->one_orphan);
+            if (!found_dir_add(ck, &found, orphans_list->one_orphan)){
+                check_error(ck, "Orphans left unrecovered\n");
+                ck->result->unrecovered = 1;
+                break;
+            }
+        }
+    }
+
+    /* whatever is left is reported but not recovered */
+    for (; orphans_list != NULL; orphans_list = orphans_list->next){
+        orphan *orp = orphans_list->one_orphan;
+        add_finding(ck, "orphan", "", orp->nclusters, orp->cluster_p, NULL);
+    }
+}
+
+/* Free all clusters starting from the given cluster, returns how many */
+static int free_clusters(uint16_t cluster, uint8_t *img_buf, struct bpb33 *bpb){
+    uint16_t next_cluster;
+    int count = 0;
+
+    while (is_valid_cluster(cluster, bpb)){
+        next_cluster = get_fat_entry(cluster, img_buf, bpb);
+        set_fat_entry(cluster, FAT12_MASK&CLUST_FREE, img_buf, bpb);
+        cluster = next_cluster;
+        count++;
+    }
+    return count;
+}
+
+/* Returns the chain size if needed to update dirent size, 0 otherwise */
+static uint32_t follow_file(checker *ck, uint16_t cluster, uint32_t size, char *path){
+    uint8_t *img_buf = ck->img_buf;
+    struct bpb33 *bpb = ck->bpb;
+    char *ref = ck->ref;
+    uint32_t size_from_dirent = size;
+    uint16_t last_fat_entry = 0;
+    uint32_t chain_size = 0;
+    int has_bad_sector = 0;
+    int has_free_sector = 0;
+    //printf("before size: %d\n", size);
+    
+    //assert(cluster != 0);
+    DOS_STAT(bpb, chains_walked, 1);
+    while (is_valid_cluster(cluster, bpb)){
+        /* !!! mark this cluster referenced here !!!
+            if overlap, change EOF */
+        if (update_ref(cluster, ref)){
+            uint16_t clusters[2] = {last_fat_entry, cluster};
+            say(ck, "Chain overlap found, truncating FAT chain...\n");
+            add_finding(ck, "cross_link", path, 2, clusters, "truncated chain");
+            set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+            cluster = (CLUST_FREE & FAT12_MASK);
+            break;
+        }
+
+        chain_size += CLUSTER_SIZE(bpb);
+
+        if (size < CLUSTER_SIZE(bpb)){ //should be the last cluster according to dirent size
+            last_fat_entry = cluster;
+            cluster = get_fat_entry(cluster, img_buf, bpb);
+            has_bad_sector = (cluster == (CLUST_BAD & FAT12_MASK));
+            has_free_sector = (cluster == (CLUST_FREE & FAT12_MASK));
+            break;
+        }
+        size -= CLUSTER_SIZE(bpb);
+
+        last_fat_entry = cluster;
+        cluster = get_fat_entry(cluster, img_buf, bpb);
+        has_bad_sector = (cluster == (CLUST_BAD & FAT12_MASK));
+        has_free_sector = (cluster == (CLUST_FREE & FAT12_MASK));
+    }
+
+    /* Fix any possible in-chain bad cluster */
+    if (has_bad_sector){ 
+        say(ck, "Bad sector found in %s, truncating FAT chain...\n", path);
+        add_finding(ck, "bad_cluster", path, 1, &last_fat_entry, "truncated chain");
+        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    }
+
+    /* Fix any possible in-chain free cluster */
+    if (has_free_sector){
+        say(ck, "Free sector found in %s, truncating FAT chain...\n", path);
+        add_finding(ck, "free_cluster", path, 1, &last_fat_entry, "truncated chain");
+        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    }
+
+    // printf("cluster number: %d\n", cluster);
+    //printf("chain size: %d\n", chain_size);
+    if (is_valid_cluster(cluster, bpb)){    //still in the middle of a chain, free following clusters
+        say(ck, "%s: chain size (>%d) greater than dirent size (%d)\n", path, chain_size, size_from_dirent);
+         
+        /* !!! fix chain > dirent size issue - truncate and free clusters !!! */
+        say(ck, "Truncating the file and releasing extra clusters...\n");
+        uint16_t clusters[2] = {last_fat_entry, cluster};
+        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+        int freed = free_clusters(cluster, img_buf, bpb);
+        add_finding(ck, "chain_too_long", path, 2, clusters, "truncated chain, freed %d clusters", freed);
+
+    } else if (size_from_dirent > chain_size){  //reached the end of chain, but dirent size is still too big
+        say(ck, "%s: chain size (%d) less than dirent size (%d)\n", path, chain_size, size_from_dirent);
+        return chain_size;
+    } else {
+        say(ck, "%s: normal file!\n", path);
+    }
+
+    return 0;
+}
+
+/* parse a given dirent, returns the starting cluster if the given
+dirent indicates a directory and 0 otherwise */
+static uint16_t parse_dirent(checker *ck, struct direntry *dirent, char *path){
+    struct bpb33 *bpb = ck->bpb;
+    char *ref = ck->ref;
+    uint16_t subdir_cluster = 0;  //initialize to an invalid cluster
+
+    char name[9];
+    char extension[4];
+    DOS_STAT(bpb, dirents_scanned, 1);
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
+
+    //char *fullname = (char *) malloc(MAXPATHLEN * sizeof(char)); //holds the name of this file or dir
+    //strcpy(fullname, buffer); //buffer holds the parent path
+
+    int i;
+
+    if (((uint8_t)name[0]) == SLOT_EMPTY){ //no more stuff in this dir
+        return subdir_cluster;
+    }
+
+    if (((uint8_t)name[0]) == SLOT_DELETED){ //skip deleted entry  
+        return subdir_cluster;
+    }
+
+    if (((uint8_t)name[0]) == 0x2E){    //skip "." or ".."
+        return subdir_cluster;
+    }
+
+    for (i = 8; i > 0; i--){    //remove padded spaces in name
+        if (name[i] == ' ') 
+            name[i] = '\0';
+        else 
+            break;
+    }
+
+    for (i = 3; i > 0; i--){    //remove padded spaces in extension
+    if (extension[i] == ' ') 
+        extension[i] = '\0';
+    else 
+        break;
+    }
+
+    strcat(path, name); //append name first, append extension later if needed
+
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN){
+        /* skip long file name */
+    } else if ((dirent->deAttributes & ATTR_VOLUME) != 0){
+        /* skip volume */
+    } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0){
+        /* skip hidden dir */
+        if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN){
+            // a normal dir
+            strcat(path, "/");
+            subdir_cluster = getushort(dirent->deStartCluster);
+            ck->result->dirs++;
+
+            //delete entry if the starting cluster is bad
+            if (subdir_cluster == (CLUST_BAD & FAT12_MASK) || ref[subdir_cluster] || subdir_cluster == (CLUST_FREE & FAT12_MASK)
+                || past_data_area(subdir_cluster, bpb)){
+                say(ck, "Deleting %s because of bad starting cluster(or duplicate references or free cluster)...\n", path);
+                add_finding(ck, "bad_start_cluster", path, 1, &subdir_cluster, "deleted entry");
+                dirent->deName[0] = SLOT_DELETED;
+                return 0;
+            }
+        }
+    } else {
+        // a normal file
+        strcat(path, ".");
+        strcat(path, extension); //append the extension since it's a file
+        ck->result->files++;
+
+        uint32_t size_from_dirent = getulong(dirent->deFileSize);
+        uint16_t starting_cluster = getushort(dirent->deStartCluster);
+
+        //an empty file owns no clusters; only its size can be wrong
+        if (starting_cluster == (CLUST_FREE & FAT12_MASK)){
+            if (size_from_dirent){
+                say(ck, "Changing directory entry size metadata of empty file %s to 0...\n", path);
+                add_finding(ck, "empty_file_size", path, 1, &starting_cluster, "set size to 0");
+                putulong(dirent->deFileSize, 0);
+            }
+            return 0;
+        }
+
+        //delete entry if the starting cluster is bad
+        if (starting_cluster == (CLUST_BAD & FAT12_MASK) || ref[starting_cluster]
+            || past_data_area(starting_cluster, bpb)){
+            say(ck, "Deleting %s entry because of bad starting cluster(or duplicate references)...\n", path);
+            add_finding(ck, "bad_start_cluster", path, 1, &starting_cluster, "deleted entry");
+            dirent->deName[0] = SLOT_DELETED;
+            return 0;
+        }
+
+        uint32_t chain_size = follow_file(ck, starting_cluster, size_from_dirent, path);
+
+        if (chain_size){
+            /* !!! fix dirent size > chain issue - adjust dirent size !!! */
+            say(ck, "Changing directory entry size metadata to %d...\n", chain_size);
+            add_finding(ck, "chain_too_short", path, 1, &starting_cluster, "set size to %u", chain_size);
+            putulong(dirent->deFileSize, chain_size);
+        }
+    }
+
+    return subdir_cluster;
+}
+
+static void follow_dir(checker *ck, uint16_t cluster, char *path){
+    uint8_t *img_buf = ck->img_buf;
+    struct bpb33 *bpb = ck->bpb;
+    uint16_t last_fat_entry;
+    int has_bad_sector = 0;
+    int has_free_sector = 0;
+
+    char pathcopy[MAXPATHLEN];
+
+    DOS_STAT(bpb, chains_walked, 1);
+    while (is_valid_cluster(cluster, bpb)){
+        /* !!! mark this cluster referenced here !!! */
+        update_ref(cluster, ck->ref);
+
+        struct direntry *dirent = (struct direntry *) cluster_to_addr(cluster, img_buf, bpb);
+
+        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+        for (int i = 0; i < numDirEntries; i++){    //parse every direntry and follow subdir if any
+            strcpy(pathcopy, path); //intilizes pathcopy to this dir's path for every entry
+
+            uint16_t subdir_cluster = parse_dirent(ck, dirent, pathcopy);
+            if (is_valid_cluster(subdir_cluster, bpb)){
+                follow_dir(ck, subdir_cluster, pathcopy);
+            }
+            dirent++;
+        }
+        last_fat_entry = cluster;
+        cluster = get_fat_entry(cluster, img_buf, bpb);
+        has_bad_sector = (cluster == (CLUST_BAD & FAT12_MASK));
+        has_free_sector = (cluster == (CLUST_FREE & FAT12_MASK));
+    }
+
+    /* Fix any possible in-chain bad cluster */
+    if (has_bad_sector){ 
+        say(ck, "Bad sector found in %s, truncating FAT chain...\n", path);
+        add_finding(ck, "bad_cluster", path, 1, &last_fat_entry, "truncated chain");
+        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    }
+
+    /* Fix any possible in-chain free cluster */
+    if (has_free_sector){ 
+        say(ck, "Free sector found in %s, truncating FAT chain...\n", path);
+        add_finding(ck, "free_cluster", path, 1, &last_fat_entry, "truncated chain");
+        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    }
+}
+
+/* walk the tree from the root, filling in ck->ref */
+static void traverse_root(checker *ck){
+    uint16_t cluster = 0;   //indicates root directory
+    struct direntry *dirent = (struct direntry *) cluster_to_addr(cluster, ck->img_buf, ck->bpb);
+
+    char path[MAXPATHLEN];
+
+    for (int i = 0; i < ck->bpb->bpbRootDirEnts ;i++){   //go through every entry in root dir
+        strcpy(path, "/"); //reinitialize path back to "/" for the next root dir entry
+
+        uint16_t subdir_cluster = parse_dirent(ck, dirent, path);
+        if (is_valid_cluster(subdir_cluster, ck->bpb)){
+            follow_dir(ck, subdir_cluster, path);
+        }
+        dirent++;   //still in root dir, just increment to get next dir entry
+    }
+}
+
+int fat_check(fat_volume *vol, fat_log_fn log, void *arg, struct fat_check_result *result){
+    checker ck;
+    phase_mark mark;
+    orphans_node *orphans_list;
+
+    memset(result, 0, sizeof(*result));
+    if (!fat_writable(vol))
+        return FAT_EROFS;
+
+    ck.bpb = fat_bpb(vol);
+    ck.result = result;
+    ck.log = log;
+    ck.log_arg = arg;
+    //any 12-bit value may turn up in a corrupt dirent, so cover them all
+    ck.ref = (char *) calloc(FAT12_MASK + 1, sizeof(char));
+    if (ck.ref == NULL)
+        return FAT_ENOMEM;
+
+    //repairs can touch any chain or directory, so shut everyone out
+    int err = fat_lock_volume(vol, TRUE);
+    if (err < 0){
+        free(ck.ref);
+        return err;
+    }
+    //loaded under the lock, so it is what everyone else sees
+    ck.img_buf = fat_image(vol);
+    if (ck.img_buf == NULL){
+        fat_unlock_volume(vol);
+        free(ck.ref);
+        return FAT_EIO;
+    }
+
+    phase_begin(&mark);
+    traverse_root(&ck);
+    phase_end(&ck, &mark, FAT_PHASE_TREE);
+
+    say(&ck, "\nStart checking for orphans...\n");
+    phase_begin(&mark);
+    orphans_list = find_orphans(ck.ref, ck.img_buf, ck.bpb);
+    phase_end(&ck, &mark, FAT_PHASE_ORPHAN_SCAN);
+
+    phase_begin(&mark);
+    recover_orphans(&ck, orphans_list);
+    orphans_list_clear(orphans_list);
+    phase_end(&ck, &mark, FAT_PHASE_REPAIR);
+    say(&ck, "Finished checking for orphans...\n");
+
+    fat_unlock_volume(vol);
+    free(ck.ref);
+    return FAT_OK;
+}
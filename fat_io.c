@@ -0,0 +1,980 @@
+#define _GNU_SOURCE		/* MAP_NORESERVE, SEEK_DATA, fallocate */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "dos.h"
+#include "libfat.h"
+#include "fat_io.h"
+
+
+#define PAGE_LOADED	1
+#define PAGE_DIRTY	2	/* to be written back */
+#define PAGE_PINNED	4	/* never dropped */
+#define PAGE_QUEUED	8	/* on the fifo */
+
+/* unpinned pages kept loaded, unless $FAT_IO_CACHE gives kilobytes */
+#define IO_CACHE	(8 * 1024 * 1024)
+
+/* requests queued at once, and the io_uring's size */
+#define BATCH_MAX	64
+
+/* dirty ranges first noted per class */
+#define DIRTY_MIN	64
+
+/* what a write is rounded out to */
+#define IO_SECTOR	512
+
+struct io_req
+{
+    uint8_t *buf;
+    size_t len;
+    off_t off;
+};
+
+struct batch
+{
+    struct io_req req[BATCH_MAX];
+    int n;
+    int write;
+};
+
+
+/* ---------- plain reads and writes ---------- */
+
+/* a read past the end of the file finds zeros */
+static int sync_rw(struct fat_io *io, uint8_t *buf, size_t len, off_t off, int write)
+{
+    while (len > 0)
+    {
+	ssize_t n = write ? pwrite(io->fd, buf, len, off) : pread(io->fd, buf, len, off);
+
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 || (n == 0 && write))
+	    return FAT_EIO;
+	if (n == 0)
+	{
+	    memset(buf, 0, len);
+	    break;
+	}
+	buf += n;
+	len -= n;
+	off += n;
+    }
+    return FAT_OK;
+}
+
+
+/* ---------- io_uring ---------- */
+
+/* The ring is driven with the raw system calls: fill submission queue
+   entries, publish the new tail, then io_uring_enter both submits them
+   and waits for the completions. */
+
+#ifdef __NR_io_uring_setup
+
+struct io_ring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+
+static void ring_free(struct io_ring *r)
+{
+    if (r->sqes != NULL)
+	munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr)
+	munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != NULL)
+	munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    free(r);
+}
+
+
+static struct io_ring *ring_setup(void)
+{
+    struct io_uring_params p;
+    struct io_ring *r = calloc(1, sizeof(struct io_ring));
+
+    if (r == NULL)
+	return NULL;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, BATCH_MAX, &p);
+    if (r->fd < 0)
+    {
+	free(r);
+	return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len)
+	r->sq_len = r->cq_len;
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+    {
+	r->sq_ptr = NULL;
+	ring_free(r);
+	return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	r->cq_ptr = r->sq_ptr;
+    else
+    {
+	r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_ptr == MAP_FAILED)
+	{
+	    r->cq_ptr = NULL;
+	    ring_free(r);
+	    return NULL;
+	}
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+	r->sqes = NULL;
+	ring_free(r);
+	return NULL;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+    return r;
+}
+
+
+/* Run up to BATCH_MAX requests on the ring.  Whatever a completion
+   leaves undone - a short transfer, or an opcode the kernel lacks - is
+   finished with a plain call.  If the ring itself fails the volume
+   drops back to IO_PREAD. */
+static int ring_run(struct fat_io *io, struct batch *b)
+{
+    struct io_ring *r = io->ring;
+    unsigned tail = *r->sq_tail, head;
+    int i, done = 0, rv = FAT_OK;
+
+    for (i = 0; i < b->n; i++)
+    {
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = b->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = io->fd;
+	sqe->addr = (uintptr_t)b->req[i].buf;
+	sqe->len = b->req[i].len;
+	sqe->off = b->req[i].off;
+	sqe->user_data = i;
+	r->sq_array[idx] = idx;
+	tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (done < b->n)
+    {
+	unsigned pending = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	if (syscall(__NR_io_uring_enter, r->fd, pending, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+	{
+	    /* completions may still arrive for this batch; leave the
+	       ring alone from now on */
+	    io->backend = IO_PREAD;
+	    for (i = 0; i < b->n; i++)
+		if (sync_rw(io, b->req[i].buf, b->req[i].len, b->req[i].off, b->write) < 0)
+		    rv = FAT_EIO;
+	    return rv;
+	}
+
+	head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+	    struct io_req *req = &b->req[cqe->user_data];
+	    int res = cqe->res;
+
+	    if (res == -EINVAL || res == -EOPNOTSUPP || res == -EINTR || res == -EAGAIN)
+		res = 0;	/* do it all by hand */
+	    if (res < 0)
+	    {
+		errno = -res;
+		rv = FAT_EIO;
+	    }
+	    else if (res < req->len
+		     && sync_rw(io, req->buf + res, req->len - res,
+				req->off + res, b->write) < 0)
+		rv = FAT_EIO;
+	    head++;
+	    done++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rv;
+}
+
+#else
+
+struct io_ring
+{
+    int fd;
+};
+
+static struct io_ring *ring_setup(void)
+{
+    return NULL;
+}
+
+static void ring_free(struct io_ring *r)
+{
+}
+
+static int ring_run(struct fat_io *io, struct batch *b)
+{
+    return FAT_EIO;
+}
+
+#endif
+
+
+/* ---------- batches ---------- */
+
+static int batch_run(struct fat_io *io, struct batch *b)
+{
+    int i, rv = FAT_OK;
+
+    if (b->n == 0)
+	return FAT_OK;
+    if (io->backend == IO_URING)
+	rv = ring_run(io, b);
+    else
+    {
+	for (i = 0; i < b->n; i++)
+	    if (sync_rw(io, b->req[i].buf, b->req[i].len, b->req[i].off, b->write) < 0)
+		rv = FAT_EIO;
+    }
+    b->n = 0;
+    return rv;
+}
+
+
+/* queue len bytes at off, joining them to the request before when
+   they touch */
+static int batch_range(struct fat_io *io, struct batch *b, off_t off, size_t len)
+{
+    int rv = FAT_OK;
+
+    if (b->n > 0 && b->req[b->n - 1].off + b->req[b->n - 1].len == off)
+    {
+	b->req[b->n - 1].len += len;
+	return FAT_OK;
+    }
+    if (b->n == BATCH_MAX)
+	rv = batch_run(io, b);
+    b->req[b->n].buf = io->buf + off;
+    b->req[b->n].len = len;
+    b->req[b->n].off = off;
+    b->n++;
+    return rv;
+}
+
+
+static int batch_add(struct fat_io *io, struct batch *b, size_t p)
+{
+    off_t off = (off_t)p * io->pagesize;
+
+    return batch_range(io, b, off,
+		       io->size - off < io->pagesize ? io->size - off : io->pagesize);
+}
+
+
+/* ---------- the page cache ---------- */
+
+static uint64_t page_hash(struct fat_io *io, size_t p)
+{
+    const uint64_t *w = (const uint64_t *)(io->buf + p * io->pagesize);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    /* each step is a bijection of h, so changing one word always
+       changes the result */
+    for (i = 0; i < io->pagesize / sizeof(uint64_t); i++)
+	h = (h ^ w[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+
+static int page_dirty(struct fat_io *io, size_t p)
+{
+    return (io->page[p] & PAGE_DIRTY)
+	|| (io->hash != NULL && io->hash[p] != page_hash(io, p));
+}
+
+
+static void fifo_push(struct fat_io *io, size_t p)
+{
+    io->fifo[(io->fifo_head + io->fifo_len++) % io->npages] = p;
+    io->page[p] |= PAGE_QUEUED;
+}
+
+
+static size_t fifo_pop(struct fat_io *io)
+{
+    size_t p = io->fifo[io->fifo_head];
+
+    io->fifo_head = (io->fifo_head + 1) % io->npages;
+    io->fifo_len--;
+    io->page[p] &= ~PAGE_QUEUED;
+    return p;
+}
+
+
+static void mark_loaded(struct fat_io *io, size_t p)
+{
+    io->page[p] |= PAGE_LOADED;
+    if (io->hash != NULL)
+	io->hash[p] = page_hash(io, p);
+    if (!(io->page[p] & PAGE_PINNED))
+    {
+	io->resident++;
+	if (!(io->page[p] & PAGE_QUEUED))
+	    fifo_push(io, p);
+    }
+}
+
+
+static void drop_page(struct fat_io *io, size_t p)
+{
+    madvise(io->buf + p * io->pagesize, io->pagesize, MADV_DONTNEED);
+    io->page[p] &= ~(PAGE_LOADED | PAGE_DIRTY);
+    io->resident--;
+}
+
+
+/* Drop the oldest clean pages until the budget is met.  Pages the
+   running operation has asked for are kept, and nothing is dropped
+   while two operations overlap, since neither knows what the other is
+   looking at. */
+static void evict(struct fat_io *io)
+{
+    size_t tries = io->fifo_len;
+
+    if (io->active > 1 || io->raw)
+	return;
+    while (io->resident > io->budget && tries-- > 0)
+    {
+	size_t p = fifo_pop(io);
+
+	if (!(io->page[p] & PAGE_LOADED) || (io->page[p] & PAGE_PINNED))
+	    continue;
+	if ((io->page[p] & PAGE_DIRTY) || (io->active && io->touched[p] == io->gen))
+	    fifo_push(io, p);
+	else
+	    drop_page(io, p);
+    }
+}
+
+
+static int get_locked(struct fat_io *io, size_t off, size_t len, int how)
+{
+    size_t first = off / io->pagesize, last = (off + len - 1) / io->pagesize, p;
+    struct batch b;
+    int rv = FAT_OK;
+
+    b.n = 0;
+    b.write = FALSE;
+    for (p = first; p <= last && rv == FAT_OK; p++)
+    {
+	io->touched[p] = io->gen;
+	if (io->page[p] & PAGE_LOADED)
+	    continue;
+	/* a page wholly overwritten is not worth reading */
+	if (how == IO_OVERWRITE && p * io->pagesize >= off
+	    && (p + 1) * io->pagesize <= off + len)
+	    continue;
+	rv = batch_add(io, &b, p);
+    }
+    if (rv == FAT_OK)
+	rv = batch_run(io, &b);
+    if (rv < 0)
+	return rv;
+
+    for (p = first; p <= last; p++)
+    {
+	if (!(io->page[p] & PAGE_LOADED))
+	    mark_loaded(io, p);
+	if (how != IO_READ)
+	    io->page[p] |= PAGE_DIRTY;
+    }
+    evict(io);
+    return FAT_OK;
+}
+
+
+/* ---------- dirty ranges ---------- */
+
+/* note a write in its class, joining it to the last one when they
+   overlap or touch, as successive FAT entries and clusters do.  If the
+   list cannot grow the last range is widened to cover this one too. */
+static void dirty_add(struct fat_io *io, size_t off, size_t len, int how)
+{
+    struct io_dirty *d = &io->dirty[IO_CLASS(how)];
+    struct io_extent *last = d->n > 0 ? &d->range[d->n - 1] : NULL;
+
+    if (last != NULL && off <= last->off + last->len && off + len >= last->off)
+    {
+	size_t end = off + len > last->off + last->len ? off + len : last->off + last->len;
+
+	if (off < last->off)
+	    last->off = off;
+	last->len = end - last->off;
+	return;
+    }
+    if (d->n == d->size)
+    {
+	struct io_extent *r = realloc(d->range, 2 * d->size * sizeof(struct io_extent));
+
+	if (r == NULL)
+	{
+	    size_t end = off + len > last->off + last->len ? off + len : last->off + last->len;
+
+	    if (off < last->off)
+		last->off = off;
+	    last->len = end - last->off;
+	    return;
+	}
+	d->range = r;
+	d->size *= 2;
+    }
+    d->range[d->n].off = off;
+    d->range[d->n].len = len;
+    d->n++;
+}
+
+
+static int extent_cmp(const void *a, const void *b)
+{
+    const struct io_extent *x = a, *y = b;
+
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+
+/* Sort a class's ranges and merge those that overlap or touch.  They
+   are widened first to whole pages for msync, or to sectors, so that
+   scattered FAT entries go out as a few writes rather than many. */
+static void dirty_merge(struct fat_io *io, struct io_dirty *d)
+{
+    size_t unit = io->backend == IO_MMAP ? io->pagesize : IO_SECTOR;
+    int i, n = 0;
+
+    for (i = 0; i < d->n; i++)
+    {
+	size_t start = d->range[i].off / unit * unit;
+	size_t end = (d->range[i].off + d->range[i].len + unit - 1) / unit * unit;
+
+	if (io->backend != IO_MMAP && end > io->size)
+	    end = io->size;
+	d->range[i].off = start;
+	d->range[i].len = end - start;
+    }
+    qsort(d->range, d->n, sizeof(struct io_extent), extent_cmp);
+    for (i = 0; i < d->n; i++)
+    {
+	size_t end = d->range[i].off + d->range[i].len;
+
+	if (n > 0 && d->range[i].off <= d->range[n - 1].off + d->range[n - 1].len)
+	{
+	    if (end > d->range[n - 1].off + d->range[n - 1].len)
+		d->range[n - 1].len = end - d->range[n - 1].off;
+	}
+	else
+	    d->range[n++] = d->range[i];
+    }
+    d->n = n;
+}
+
+
+/* write back one class, and unless the policy is IO_SYNC_NONE wait for
+   it to reach the disk before the next is started */
+static int flush_class(struct fat_io *io, struct io_dirty *d)
+{
+    struct batch b;
+    int i, rv = FAT_OK;
+
+    if (d->n == 0)
+	return FAT_OK;
+    dirty_merge(io, d);
+    if (io->backend == IO_MMAP)
+    {
+	for (i = 0; i < d->n && rv == FAT_OK; i++)
+	    if (msync(io->buf + d->range[i].off, d->range[i].len, MS_SYNC) < 0)
+		rv = FAT_EIO;
+    }
+    else
+    {
+	b.n = 0;
+	b.write = TRUE;
+	for (i = 0; i < d->n && rv == FAT_OK; i++)
+	    rv = batch_range(io, &b, d->range[i].off, d->range[i].len);
+	if (rv == FAT_OK)
+	    rv = batch_run(io, &b);
+	if (rv == FAT_OK && io->policy != IO_SYNC_NONE && fdatasync(io->fd) < 0)
+	    rv = FAT_EIO;
+    }
+    if (rv == FAT_OK)
+	d->n = 0;
+    return rv;
+}
+
+
+/* Changes made through io_raw are not noted as they happen, so they are
+   found by page: the data area first, then the pinned FAT and root
+   directory that refer to it. */
+static int flush_raw(struct fat_io *io)
+{
+    static const int passes[] = { 0, PAGE_PINNED };
+    struct batch b;
+    size_t p;
+    int i, rv = FAT_OK;
+
+    if (io->backend == IO_MMAP)
+    {
+	if (io->policy != IO_SYNC_NONE && msync(io->buf, io->size, MS_SYNC) < 0)
+	    return FAT_EIO;
+	return FAT_OK;
+    }
+    b.write = TRUE;
+    for (i = 0; i < 2 && rv == FAT_OK; i++)
+    {
+	b.n = 0;
+	for (p = 0; p < io->npages && rv == FAT_OK; p++)
+	    if ((io->page[p] & (PAGE_PINNED | PAGE_LOADED)) == (passes[i] | PAGE_LOADED)
+		&& io->hash[p] != page_hash(io, p))
+		rv = batch_add(io, &b, p);
+	if (rv == FAT_OK)
+	    rv = batch_run(io, &b);
+    }
+    if (rv == FAT_OK && io->policy != IO_SYNC_NONE && fdatasync(io->fd) < 0)
+	rv = FAT_EIO;
+    return rv;
+}
+
+
+static int flush_locked(struct fat_io *io)
+{
+    int i, changed = io->raw, rv = FAT_OK;
+    size_t p;
+
+    for (i = 0; i < IO_NCLASSES && rv == FAT_OK; i++)
+    {
+	changed |= io->dirty[i].n > 0;
+	rv = flush_class(io, &io->dirty[i]);
+    }
+    if (rv == FAT_OK && io->raw)
+	rv = flush_raw(io);
+    if (rv == FAT_OK && changed && io->policy == IO_SYNC_FULL)
+    {
+	/* the file's own metadata too */
+	if (fsync(io->fd) < 0)
+	    rv = FAT_EIO;
+    }
+    if (rv == FAT_OK && io->backend != IO_MMAP)
+    {
+	for (p = 0; p < io->npages; p++)
+	{
+	    io->page[p] &= ~PAGE_DIRTY;
+	    if (io->hash != NULL && (io->page[p] & PAGE_LOADED))
+		io->hash[p] = page_hash(io, p);
+	}
+    }
+    return rv;
+}
+
+
+/* ---------- the interface ---------- */
+
+int io_open(struct fat_io *io, int fd, size_t size, int writable, int backend,
+	    int policy)
+{
+    const char *cache = getenv("FAT_IO_CACHE");
+    int i;
+
+    memset(io, 0, sizeof(struct fat_io));
+    io->fd = fd;
+    io->size = size;
+    io->writable = writable;
+    io->backend = backend;
+    io->policy = policy;
+    io->pagesize = sysconf(_SC_PAGESIZE);
+    pthread_mutex_init(&io->mutex, NULL);
+    for (i = 0; i < IO_NCLASSES; i++)
+    {
+	/* allocated now, so a full list always has a range to widen */
+	io->dirty[i].size = DIRTY_MIN;
+	io->dirty[i].range = malloc(DIRTY_MIN * sizeof(struct io_extent));
+	if (io->dirty[i].range == NULL)
+	{
+	    io_close(io);
+	    return FAT_ENOMEM;
+	}
+    }
+
+    if (backend == IO_MMAP)
+    {
+	io->buf = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		       MAP_SHARED, fd, 0);
+	if (io->buf == MAP_FAILED)
+	{
+	    io->buf = NULL;
+	    io_close(io);
+	    return FAT_EIO;
+	}
+	return FAT_OK;
+    }
+
+    if (backend == IO_URING && (io->ring = ring_setup()) == NULL)
+	io->backend = IO_PREAD;	/* no io_uring here */
+
+    io->npages = (size + io->pagesize - 1) / io->pagesize;
+    io->budget = (cache != NULL ? strtoul(cache, NULL, 10) * 1024 : IO_CACHE)
+	/ io->pagesize;
+    if (io->budget == 0)
+	io->budget = 1;
+    io->buf = mmap(NULL, io->npages * io->pagesize, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    io->page = calloc(io->npages, 1);
+    io->touched = calloc(io->npages, sizeof(uint32_t));
+    io->fifo = calloc(io->npages, sizeof(size_t));
+    if (io->buf == MAP_FAILED || io->page == NULL || io->touched == NULL
+	|| io->fifo == NULL)
+    {
+	if (io->buf == MAP_FAILED)
+	    io->buf = NULL;
+	io_close(io);
+	return FAT_ENOMEM;
+    }
+    return FAT_OK;
+}
+
+
+/* io_close does not write anything back; io_flush first */
+int io_close(struct fat_io *io)
+{
+    size_t len = io->backend == IO_MMAP ? io->size : io->npages * io->pagesize;
+    int i, err = FAT_OK;
+
+    if (io->buf != NULL && munmap(io->buf, len) < 0)
+	err = FAT_EIO;
+    if (io->ring != NULL)
+	ring_free(io->ring);
+    pthread_mutex_destroy(&io->mutex);
+    for (i = 0; i < IO_NCLASSES; i++)
+	free(io->dirty[i].range);
+    free(io->page);
+    free(io->touched);
+    free(io->fifo);
+    free(io->hash);
+    return err;
+}
+
+
+void io_begin(struct fat_io *io)
+{
+    if (io->backend == IO_MMAP)
+	return;
+    pthread_mutex_lock(&io->mutex);
+    if (io->active++ == 0)
+	io->gen++;
+    pthread_mutex_unlock(&io->mutex);
+}
+
+
+void io_end(struct fat_io *io)
+{
+    if (io->backend == IO_MMAP)
+	return;
+    pthread_mutex_lock(&io->mutex);
+    io->active--;
+    pthread_mutex_unlock(&io->mutex);
+}
+
+
+/* io_get makes len bytes at off safe to look at, or with IO_WRITE and
+   IO_OVERWRITE to change; a change is noted under the class or'ed into
+   how, for io_flush */
+int io_get(struct fat_io *io, size_t off, size_t len, int how)
+{
+    int mode = IO_MODE(how), rv = FAT_OK;
+
+    /* a mapping left to the kernel has nothing to note */
+    if (len == 0 || (io->backend == IO_MMAP
+		     && (mode == IO_READ || io->policy == IO_SYNC_NONE)))
+	return FAT_OK;
+    pthread_mutex_lock(&io->mutex);
+    if (io->backend != IO_MMAP)
+	rv = get_locked(io, off, len, mode);
+    if (rv == FAT_OK && mode != IO_READ)
+	dirty_add(io, off, len, how);
+    pthread_mutex_unlock(&io->mutex);
+    return rv;
+}
+
+
+/* io_pin loads the first len bytes and keeps them */
+int io_pin(struct fat_io *io, size_t len)
+{
+    size_t p, last;
+    int rv;
+
+    if (io->backend == IO_MMAP || len == 0)
+	return FAT_OK;
+    pthread_mutex_lock(&io->mutex);
+    last = (len - 1) / io->pagesize;
+    for (p = 0; p <= last; p++)
+    {
+	if ((io->page[p] & (PAGE_LOADED | PAGE_PINNED)) == PAGE_LOADED)
+	    io->resident--;
+	io->page[p] |= PAGE_PINNED;
+    }
+    rv = get_locked(io, 0, len, IO_READ);
+    pthread_mutex_unlock(&io->mutex);
+    return rv;
+}
+
+
+/* io_raw loads the whole image for a caller that will work on it
+   directly.  Changes it makes are found by comparing each page with
+   how it was loaded. */
+int io_raw(struct fat_io *io)
+{
+    size_t p;
+    int rv;
+
+    if (io->backend == IO_MMAP || io->raw)
+	return FAT_OK;
+    if (io->writable)
+    {
+	pthread_mutex_lock(&io->mutex);
+	io->hash = calloc(io->npages, sizeof(uint64_t));
+	for (p = 0; io->hash != NULL && p < io->npages; p++)
+	    if (io->page[p] & PAGE_LOADED)
+		io->hash[p] = page_hash(io, p);
+	pthread_mutex_unlock(&io->mutex);
+	if (io->hash == NULL)
+	    return FAT_ENOMEM;
+    }
+    rv = io_pin(io, io->size);
+    if (rv == FAT_OK)
+	io->raw = TRUE;
+    return rv;
+}
+
+
+/* io_prefetch starts the extents on their way in: with IO_URING they
+   are read in one batch, up to half the budget; otherwise the kernel
+   is asked to read them ahead */
+void io_prefetch(struct fat_io *io, const struct io_extent *ext, int n)
+{
+    static uintptr_t pagemask;
+    struct batch b;
+    size_t p, pages = 0;
+    int i;
+
+    if (io->backend == IO_MMAP)
+    {
+	/* widened to whole pages for madvise */
+	if (pagemask == 0)
+	    pagemask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+	for (i = 0; i < n; i++)
+	{
+	    uint8_t *start = io->buf + ext[i].off;
+	    uint8_t *aligned = (uint8_t *)((uintptr_t)start & pagemask);
+
+	    madvise(aligned, ext[i].len + (start - aligned), MADV_WILLNEED);
+	}
+	return;
+    }
+    if (io->backend == IO_PREAD)
+    {
+	for (i = 0; i < n; i++)
+	    posix_fadvise(io->fd, ext[i].off, ext[i].len, POSIX_FADV_WILLNEED);
+	return;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    b.n = 0;
+    b.write = FALSE;
+    for (i = 0; i < n; i++)
+    {
+	for (p = ext[i].off / io->pagesize;
+	     p <= (ext[i].off + ext[i].len - 1) / io->pagesize && pages < io->budget / 2;
+	     p++)
+	{
+	    if (io->page[p] & PAGE_LOADED)
+		continue;
+	    io->touched[p] = io->gen;
+	    pages++;
+	    if (batch_add(io, &b, p) < 0)
+		goto out;
+	}
+    }
+    if (batch_run(io, &b) < 0)
+	goto out;
+    /* everything queued made it in */
+    for (i = 0; i < n; i++)
+	for (p = ext[i].off / io->pagesize;
+	     p <= (ext[i].off + ext[i].len - 1) / io->pagesize && pages > 0; p++)
+	    if (!(io->page[p] & PAGE_LOADED))
+	    {
+		mark_loaded(io, p);
+		pages--;
+	    }
+    evict(io);
+out:
+    pthread_mutex_unlock(&io->mutex);
+}
+
+
+/* io_revalidate is called when a lock is newly taken, since another
+   process may have changed the image while it was not held.  Pages
+   still in use are read again in place; the rest are dropped.  Pages
+   this volume has changed are kept. */
+int io_revalidate(struct fat_io *io)
+{
+    struct batch b;
+    size_t p;
+    int rv = FAT_OK;
+
+    if (io->backend == IO_MMAP)
+	return FAT_OK;
+    pthread_mutex_lock(&io->mutex);
+    b.n = 0;
+    b.write = FALSE;
+    for (p = 0; p < io->npages && rv == FAT_OK; p++)
+    {
+	if (!(io->page[p] & PAGE_LOADED) || page_dirty(io, p))
+	    continue;
+	if ((io->page[p] & PAGE_PINNED) || io->active > 1
+	    || (io->active && io->touched[p] == io->gen))
+	    rv = batch_add(io, &b, p);
+	else
+	    drop_page(io, p);
+    }
+    if (rv == FAT_OK)
+	rv = batch_run(io, &b);
+    for (p = 0; io->hash != NULL && p < io->npages; p++)
+	if ((io->page[p] & PAGE_LOADED) && !(io->page[p] & PAGE_DIRTY))
+	    io->hash[p] = page_hash(io, p);
+    pthread_mutex_unlock(&io->mutex);
+    return rv;
+}
+
+
+/* io_punch frees the host blocks under len bytes at off, which read as
+   zeros from then on.  A range that is already a hole is left alone,
+   and a cached copy is cleared to match. */
+int io_punch(struct fat_io *io, size_t off, size_t len)
+{
+    off_t data = lseek(io->fd, off, SEEK_DATA);
+    size_t p;
+
+    if ((data < 0 && errno == ENXIO) || (data >= 0 && data >= off + len))
+	return FAT_OK;
+    if (fallocate(io->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) < 0)
+	return FAT_EIO;
+    if (io->backend == IO_MMAP)
+	return FAT_OK;		/* the kernel clears the mapping */
+
+    pthread_mutex_lock(&io->mutex);
+    for (p = off / io->pagesize; p <= (off + len - 1) / io->pagesize; p++)
+    {
+	size_t start = p * io->pagesize < off ? off : p * io->pagesize;
+	size_t end = (p + 1) * io->pagesize > off + len ? off + len : (p + 1) * io->pagesize;
+	int clean;
+
+	if (!(io->page[p] & PAGE_LOADED))
+	    continue;
+	clean = !page_dirty(io, p);
+	memset(io->buf + start, 0, end - start);
+	if (clean && io->hash != NULL)
+	    io->hash[p] = page_hash(io, p);
+    }
+    pthread_mutex_unlock(&io->mutex);
+    return FAT_OK;
+}
+
+
+/* io_flush writes back what has changed, class by class - the data,
+   then the FAT that points at it, then the directory entries that point
+   at the chains - as the policy says.  With IO_MMAP and IO_SYNC_NONE
+   the kernel writes the mapping back in its own time. */
+int io_flush(struct fat_io *io)
+{
+    int rv;
+
+    if (!io->writable)
+	return FAT_OK;
+    pthread_mutex_lock(&io->mutex);
+    if (io->backend == IO_MMAP && io->policy == IO_SYNC_NONE)
+    {
+	/* left to the kernel; drop anything noted while io_sync had the
+	   policy raised, so the lists cannot grow between syncs */
+	int i;
+
+	for (i = 0; i < IO_NCLASSES; i++)
+	    io->dirty[i].n = 0;
+	pthread_mutex_unlock(&io->mutex);
+	return FAT_OK;
+    }
+    rv = flush_locked(io);
+    pthread_mutex_unlock(&io->mutex);
+    return rv;
+}
+
+
+/* io_sync writes back the changes and waits for all of them to reach
+   the disk, whatever the policy */
+int io_sync(struct fat_io *io)
+{
+    int policy, rv;
+
+    if (!io->writable)
+	return FAT_OK;
+    if (io->backend == IO_MMAP && msync(io->buf, io->size, MS_SYNC) < 0)
+	return FAT_EIO;
+    pthread_mutex_lock(&io->mutex);
+    policy = io->policy;
+    io->policy = IO_SYNC_FULL;
+    rv = flush_locked(io);
+    io->policy = policy;
+    pthread_mutex_unlock(&io->mutex);
+    return rv;
+}
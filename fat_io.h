@@ -0,0 +1,108 @@
+#ifndef __FAT_IO_H__
+#define __FAT_IO_H__
+
+/* How libfat gets at the bytes of an image.  Every backend presents
+   the image as one flat buffer, so the code that walks it is the same
+   for all of them:
+
+   IO_MMAP   maps the file shared.  The kernel pages it in and out, and
+	     an I/O error arrives as SIGBUS.
+   IO_PREAD  reserves anonymous memory the size of the image and reads
+	     pages into it with pread the first time they are asked for.
+	     Changed pages go back with pwrite.  The FAT region stays
+	     resident; past a small budget other pages are dropped,
+	     oldest first.
+   IO_URING  as IO_PREAD, but the reads and writes of a batch are all
+	     queued on an io_uring and waited for together, so readahead
+	     keeps many of them in flight.
+
+   With the last two nothing is there until io_get has loaded it, and
+   an I/O error comes back as FAT_EIO.  This is private to libfat. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define IO_MMAP		1
+#define IO_PREAD	2
+#define IO_URING	3
+
+/* io_get modes */
+#define IO_READ		0
+#define IO_WRITE	1	/* the caller will change part of the range */
+#define IO_OVERWRITE	2	/* ... all of it, so it need not be read */
+#define IO_MODE(how)	((how) & 3)
+
+/* what a write changes, or'ed into the mode; flushes go in this order */
+#define IO_DATA		0x00
+#define IO_FAT		0x04
+#define IO_DIR		0x08
+#define IO_CLASS(how)	((how) >> 2)
+#define IO_NCLASSES	3
+
+/* flush policies: whether each class is synced before the next, and
+   whether the whole image is synced at the end */
+#define IO_SYNC_NONE	0
+#define IO_SYNC_ORDERED	1
+#define IO_SYNC_FULL	2
+
+struct io_ring;
+
+struct io_extent
+{
+    size_t off, len;
+};
+
+/* the ranges written since the last flush, in one class */
+struct io_dirty
+{
+    struct io_extent *range;
+    int n, size;
+};
+
+struct fat_io
+{
+    int backend;
+    int fd;
+    int writable;
+    uint8_t *buf;
+    size_t size;
+    size_t pagesize;
+    pthread_mutex_t mutex;
+    int policy;			/* IO_SYNC_* */
+    struct io_dirty dirty[IO_NCLASSES];
+
+    /* the rest is for IO_PREAD and IO_URING */
+    size_t npages;
+    uint8_t *page;		/* PAGE_* bits */
+    uint32_t *touched;		/* the generation that last asked for it */
+    uint64_t *hash;		/* page contents as loaded, in raw mode */
+    size_t *fifo;		/* loaded unpinned pages, oldest first */
+    size_t fifo_head, fifo_len;
+    size_t resident;		/* loaded unpinned pages */
+    size_t budget;
+    uint32_t gen;		/* bumped when an operation starts alone */
+    int active;			/* operations under way */
+    int raw;			/* a caller has the whole buffer */
+    struct io_ring *ring;
+};
+
+int io_open(struct fat_io *io, int fd, size_t size, int writable, int backend,
+	    int policy);
+int io_close(struct fat_io *io);
+
+/* operations bracket their use of the buffer, so that nothing they are
+   still looking at is dropped */
+void io_begin(struct fat_io *io);
+void io_end(struct fat_io *io);
+
+int io_get(struct fat_io *io, size_t off, size_t len, int how);
+int io_pin(struct fat_io *io, size_t len);
+int io_raw(struct fat_io *io);
+void io_prefetch(struct fat_io *io, const struct io_extent *ext, int n);
+int io_revalidate(struct fat_io *io);
+int io_punch(struct fat_io *io, size_t off, size_t len);
+int io_flush(struct fat_io *io);
+int io_sync(struct fat_io *io);
+
+#endif // __FAT_IO_H__
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <time.h>
+
+#include "dos.h"
+
+/* fatbench runs dos_ls, dos_cat, dos_cp (both ways) and scandisk
+   against a corpus of images of different sizes, fill levels and
+   fragmentation made by mkfatimg, plus damaged images (generated and
+   the shipped samples), and reports one JSON object per (tool, image)
+   on stdout.  The -s seed makes the corpus reproducible. */
+
+#define DEFAULT_ITERATIONS 20
+#define MAX_ARGS 8
+#define MAX_GEN_ARGS 20
+
+
+/* ---------- a tiny deterministic PRNG (xorshift64*) ---------- */
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+/* ---------- generating the corpus ---------- */
+
+/* a corpus image is whatever mkfatimg makes of these options; the
+   seed and the image and manifest names are added when it is run */
+struct corpus_image
+{
+    char *name;
+    char *args[MAX_GEN_ARGS];
+};
+
+static struct corpus_image corpus[] = {
+    { "floppy-fill25",  { "-s", "1440K", "-f", "25" } },
+    { "floppy-fill90",  { "-s", "1440K", "-f", "90" } },
+    { "floppy-frag",    { "-s", "1440K", "-f", "90", "-r", "50" } },
+    { "8m-fill50",      { "-s", "8M", "-F", "12", "-c", "8", "-f", "50", "-D", "2" } },
+    { "8m-frag",        { "-s", "8M", "-F", "12", "-c", "8", "-f", "50", "-D", "2", "-r", "30" } },
+    { "32m-fill75",     { "-s", "32760K", "-F", "12", "-c", "32", "-f", "75", "-d", "exp:96K" } },
+    { "32m-frag",       { "-s", "32760K", "-F", "12", "-c", "32", "-f", "75", "-d", "exp:96K", "-r", "20" } },
+};
+#define NCORPUS (sizeof(corpus) / sizeof(corpus[0]))
+
+/* generated images with every kind of damage scandisk repairs */
+static struct corpus_image corrupt_corpus[] = {
+    { "floppy-damaged", { "-s", "1440K", "-f", "60", "-r", "20", "-x", "bad:4",
+			  "-x", "long:4", "-x", "short:4", "-x", "crosslink:4" } },
+    { "8m-damaged",     { "-s", "8M", "-F", "12", "-c", "8", "-f", "60", "-r", "20",
+			  "-x", "bad:16", "-x", "long:16", "-x", "crosslink:16" } },
+};
+#define NCORRUPT_CORPUS (sizeof(corrupt_corpus) / sizeof(corrupt_corpus[0]))
+
+/* the corrupted images shipped with the tools */
+static char *corrupt_images[] = {
+    "badimage1.img", "badimage2.img", "badimage3.img",
+    "badimage4.img", "badimage5.img"
+};
+#define NCORRUPT (sizeof(corrupt_images) / sizeof(corrupt_images[0]))
+
+/* what the benchmarks need to know about an image */
+struct image_info
+{
+    char path[MAXPATHLEN];
+    char label[32];
+    off_t size;
+    uint32_t files;
+    uint64_t file_bytes;	/* total size of all files */
+    char big_file[MAXPATHLEN];	/* path of the largest file, for cat/cp out */
+    uint32_t big_size;
+    uint32_t free_bytes;
+};
+
+/* fill in info from an mkfatimg manifest */
+int read_manifest(char *path, struct image_info *info)
+{
+    char line[MAXPATHLEN + 128], name[MAXPATHLEN];
+    unsigned long long size;
+    unsigned long cluster_size = 0, free_clusters;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	char *p = strstr(line, " cluster_size ");
+	if (strncmp(line, "image ", 6) == 0 && p != NULL)
+	    cluster_size = strtoul(p + 14, NULL, 10);
+	else if (sscanf(line, "file %s size %llu", name, &size) == 2)
+	{
+	    info->files++;
+	    info->file_bytes += size;
+	    if (size >= info->big_size)
+	    {
+		info->big_size = size;
+		strncpy(info->big_file, name, sizeof(info->big_file) - 1);
+	    }
+	}
+	else if ((p = strstr(line, " free_clusters ")) != NULL
+		 && strncmp(line, "summary ", 8) == 0)
+	{
+	    free_clusters = strtoul(p + 15, NULL, 10);
+	    info->free_bytes = free_clusters * cluster_size;
+	}
+    }
+    fclose(f);
+    return info->files > 0 ? 0 : -1;
+}
+
+/* run mkfatimg from bindir to create info->path */
+void generate_image(char *bindir, struct corpus_image *ci,
+		    struct image_info *info)
+{
+    char tool[MAXPATHLEN], manifest[MAXPATHLEN + 16], seed[32];
+    char *argv[MAX_GEN_ARGS + 8];
+    struct stat st;
+    int status, argc = 0;
+    pid_t pid;
+
+    snprintf(tool, sizeof(tool), "%s/mkfatimg", bindir);
+    snprintf(manifest, sizeof(manifest), "%s.manifest", info->path);
+    snprintf(seed, sizeof(seed), "%llu", (unsigned long long)rng_next());
+
+    argv[argc++] = tool;
+    for (int i = 0; i < MAX_GEN_ARGS && ci->args[i] != NULL; i++)
+	argv[argc++] = ci->args[i];
+    argv[argc++] = "-S";
+    argv[argc++] = seed;
+    argv[argc++] = "-m";
+    argv[argc++] = manifest;
+    argv[argc++] = info->path;
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid == 0)
+    {
+	execv(argv[0], argv);
+	_exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+	|| WEXITSTATUS(status) != 0)
+    {
+	fprintf(stderr, "Cannot generate %s with %s\n", info->path, tool);
+	exit(1);
+    }
+    if (read_manifest(manifest, info) < 0)
+    {
+	fprintf(stderr, "Cannot read manifest %s\n", manifest);
+	exit(1);
+    }
+    unlink(manifest);
+    if (stat(info->path, &st) == 0)
+	info->size = st.st_size;
+}
+
+/* work out file counts for one of the sample images by walking it */
+void describe_sample(char *path, char *label, struct image_info *info)
+{
+    struct stat st;
+
+    memset(info, 0, sizeof(*info));
+    strncpy(info->path, path, MAXPATHLEN - 1);
+    strncpy(info->label, label, sizeof(info->label) - 1);
+    if (stat(path, &st) == 0)
+	info->size = st.st_size;
+}
+
+
+/* ---------- running and measuring ---------- */
+
+struct sample
+{
+    double ms;
+    long maxrss_kb;
+};
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, int n, double pct)
+{
+    int idx = (int)(pct / 100.0 * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+int copy_file(char *from, char *to)
+{
+    char buf[65536];
+    ssize_t n;
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (in < 0 || out < 0)
+	return -1;
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+    {
+	if (write(out, buf, n) != n)
+	    return -1;
+    }
+    close(in);
+    close(out);
+    return 0;
+}
+
+/* run argv once with stdout and stderr discarded; returns wall time */
+int run_once(char **argv, struct sample *s)
+{
+    struct timespec t0, t1;
+    struct rusage ru;
+    int status;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = fork();
+    if (pid == 0)
+    {
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+	dup2(devnull, STDERR_FILENO);
+	execv(argv[0], argv);
+	_exit(127);
+    }
+    if (pid < 0 || wait4(pid, &status, 0, &ru) < 0)
+	return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    s->ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    s->maxrss_kb = ru.ru_maxrss;
+    if (WIFSIGNALED(status) || WEXITSTATUS(status) == 127)
+	return -1;
+    return WEXITSTATUS(status);
+}
+
+/* Run a benchmark for `iterations` rounds.  If pristine is set the
+   image is restored from it before every round (outside the timed
+   region), for tools that modify the image.  bytes and files are the
+   work done by one round. */
+void bench(char *tool, struct image_info *info, char **argv, char *pristine,
+	   int iterations, uint64_t bytes, uint32_t files)
+{
+    double *ms = malloc(sizeof(double) * iterations);
+    double total = 0;
+    long maxrss = 0;
+    int failures = 0;
+    struct sample s;
+
+    for (int i = 0; i < iterations; i++)
+    {
+	if (pristine != NULL && copy_file(pristine, info->path) < 0)
+	{
+	    fprintf(stderr, "Cannot restore %s\n", info->path);
+	    exit(1);
+	}
+	/* scandisk exits non-zero when it repairs something */
+	if (run_once(argv, &s) < 0)
+	    failures++;
+	ms[i] = s.ms;
+	total += s.ms;
+	if (s.maxrss_kb > maxrss)
+	    maxrss = s.maxrss_kb;
+    }
+    qsort(ms, iterations, sizeof(double), compare_doubles);
+
+    double mean_s = total / iterations / 1e3;
+    printf("{\"tool\": \"%s\", \"image\": \"%s\", \"image_bytes\": %lld, "
+	   "\"iterations\": %d, \"failures\": %d, "
+	   "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+	   "\"p99_ms\": %.3f, \"max_ms\": %.3f, "
+	   "\"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"peak_rss_kb\": %ld}\n",
+	   tool, info->label, (long long)info->size, iterations, failures,
+	   total / iterations, percentile(ms, iterations, 50),
+	   percentile(ms, iterations, 90), percentile(ms, iterations, 99),
+	   ms[iterations - 1],
+	   bytes / mean_s / (1024 * 1024), files / mean_s, maxrss);
+    fflush(stdout);
+    free(ms);
+}
+
+/* all benchmarks for one image */
+void bench_image(char *bindir, char *workdir, struct image_info *info,
+		 int iterations, int read_only_tools)
+{
+    char tool[MAXPATHLEN], pristine[MAXPATHLEN], hostfile[MAXPATHLEN];
+    char target[MAXPATHLEN + 2], outfile[MAXPATHLEN];
+    char *argv[MAX_ARGS];
+
+    snprintf(pristine, sizeof(pristine), "%s/%s.pristine", workdir, info->label);
+    if (copy_file(info->path, pristine) < 0)
+    {
+	fprintf(stderr, "Cannot copy %s\n", info->path);
+	exit(1);
+    }
+
+    if (read_only_tools)
+    {
+	snprintf(tool, sizeof(tool), "%s/dos_ls", bindir);
+	argv[0] = tool; argv[1] = info->path; argv[2] = NULL;
+	bench("dos_ls", info, argv, NULL, iterations, 0, info->files);
+
+	snprintf(tool, sizeof(tool), "%s/dos_cat", bindir);
+	argv[0] = tool; argv[1] = info->path; argv[2] = info->big_file; argv[3] = NULL;
+	bench("dos_cat", info, argv, NULL, iterations, info->big_size, 1);
+
+	snprintf(tool, sizeof(tool), "%s/dos_cp", bindir);
+	snprintf(target, sizeof(target), "a:%s", info->big_file);
+	snprintf(outfile, sizeof(outfile), "%s/copyout.tmp", workdir);
+	argv[0] = tool; argv[1] = info->path; argv[2] = target;
+	argv[3] = outfile; argv[4] = NULL;
+	bench("dos_cp_out", info, argv, NULL, iterations, info->big_size, 1);
+
+	/* copy in a file of up to 256 KB, leaving room to spare */
+	uint32_t in_size = info->free_bytes / 2;
+	if (in_size > 256 * 1024)
+	    in_size = 256 * 1024;
+	snprintf(hostfile, sizeof(hostfile), "%s/copyin.tmp", workdir);
+	FILE *f = fopen(hostfile, "w");
+	for (uint32_t b = 0; b < in_size; b += 8)
+	{
+	    uint64_t r = rng_next();
+	    fwrite(&r, 1, in_size - b < 8 ? in_size - b : 8, f);
+	}
+	fclose(f);
+	argv[0] = tool; argv[1] = info->path; argv[2] = hostfile;
+	argv[3] = "a:/BENCHIN.DAT"; argv[4] = NULL;
+	bench("dos_cp_in", info, argv, pristine, iterations, in_size, 1);
+	unlink(hostfile);
+	unlink(outfile);
+    }
+
+    snprintf(tool, sizeof(tool), "%s/scandisk", bindir);
+    argv[0] = tool; argv[1] = info->path; argv[2] = NULL;
+    bench("scandisk", info, argv, pristine, iterations, info->size, info->files);
+
+    /* leave the image as generated */
+    copy_file(pristine, info->path);
+    unlink(pristine);
+}
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-n iterations] [-b bindir] [-d workdir] [-s seed]\n", progname);
+    fprintf(stderr, "\tbenchmarks the tools in bindir (default .) on images generated in workdir\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *bindir = ".", *workdir = "bench_images";
+    int iterations = DEFAULT_ITERATIONS;
+    struct image_info info;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:d:s:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'n':
+	    iterations = atoi(optarg);
+	    if (iterations < 1)
+		usage(argv[0]);
+	    break;
+	case 'b':
+	    bindir = optarg;
+	    break;
+	case 'd':
+	    workdir = optarg;
+	    break;
+	case 's':
+	    rng_state = strtoull(optarg, NULL, 0) | 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (mkdir(workdir, 0755) < 0 && errno != EEXIST)
+    {
+	fprintf(stderr, "Cannot create %s: %s\n", workdir, strerror(errno));
+	exit(1);
+    }
+
+    for (int i = 0; i < NCORPUS; i++)
+    {
+	memset(&info, 0, sizeof(info));
+	snprintf(info.path, sizeof(info.path), "%s/%s.img", workdir, corpus[i].name);
+	strncpy(info.label, corpus[i].name, sizeof(info.label) - 1);
+	generate_image(bindir, &corpus[i], &info);
+	bench_image(bindir, workdir, &info, iterations, 1);
+	unlink(info.path);
+    }
+
+    /* damaged images, generated and shipped, only make sense for scandisk */
+    for (int i = 0; i < NCORRUPT_CORPUS; i++)
+    {
+	memset(&info, 0, sizeof(info));
+	snprintf(info.path, sizeof(info.path), "%s/%s.img", workdir, corrupt_corpus[i].name);
+	strncpy(info.label, corrupt_corpus[i].name, sizeof(info.label) - 1);
+	generate_image(bindir, &corrupt_corpus[i], &info);
+	bench_image(bindir, workdir, &info, iterations, 0);
+	unlink(info.path);
+    }
+
+    for (int i = 0; i < NCORRUPT; i++)
+    {
+	char path[MAXPATHLEN], label[32];
+	snprintf(path, sizeof(path), "%s/%s", workdir, corrupt_images[i]);
+	snprintf(label, sizeof(label), "corrupt-%d", i + 1);
+	if (copy_file(corrupt_images[i], path) < 0)
+	    continue;
+	describe_sample(path, label, &info);
+	bench_image(bindir, workdir, &info, iterations, 0);
+	unlink(path);
+    }
+    return 0;
+}
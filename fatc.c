@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libfat.h"
+#include "fatproto.h"
+
+/* fatc sends one request to a running fatd and prints the answer the
+   way the matching dos_* tool would:
+
+       fatc ls <image>
+       fatc stat <image> <path>
+       fatc cat <image> <path>
+       fatc cp <image> a:<path> <file>	copy out
+       fatc cp <image> <file> a:<path>	copy in
+
+   <image> is the image path fatd was started with, or its basename. */
+
+static const char *sockpath;
+
+
+int connect_fatd(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+	fprintf(stderr, "Cannot connect to fatd on %s: %s\n", sockpath, strerror(errno));
+	exit(1);
+    }
+    return fd;
+}
+
+
+/* send the request frame: op, then image and path NUL terminated */
+int send_request(int op, const char *image, const char *path)
+{
+    char buf[2 * MAXPATHLEN + 2];
+    size_t ilen = strlen(image) + 1, plen = strlen(path) + 1;
+    int fd;
+
+    if (ilen + plen > sizeof(buf))
+    {
+	fprintf(stderr, "Name too long\n");
+	exit(1);
+    }
+    memcpy(buf, image, ilen);
+    memcpy(buf + ilen, path, plen);
+
+    fd = connect_fatd();
+    if (fatp_send(fd, op, buf, ilen + plen) < 0)
+    {
+	fprintf(stderr, "Lost the connection to fatd\n");
+	exit(1);
+    }
+    return fd;
+}
+
+
+/* copy the reply's data frames to out; returns FAT_OK or the error
+   fatd sent, after printing it */
+int read_reply(int fd, FILE *out, const char *what)
+{
+    static uint8_t buf[FATP_MAX_FRAME + 1];
+    size_t len;
+    int type;
+
+    while (fatp_recv(fd, &type, buf, &len) == 0)
+    {
+	if (type == FATP_DATA)
+	{
+	    fwrite(buf, 1, len, out);
+	}
+	else if (type == FATP_END)
+	{
+	    return FAT_OK;
+	}
+	else if (type == FATP_ERROR && len > 4)
+	{
+	    uint32_t nerr;
+
+	    memcpy(&nerr, buf, 4);
+	    buf[len] = '\0';
+	    fprintf(stderr, "%s: %s\n", what, (char *)buf + 4);
+	    return (int32_t)ntohl(nerr);
+	}
+	else
+	    break;
+    }
+    fprintf(stderr, "Lost the connection to fatd\n");
+    return FAT_EIO;
+}
+
+
+int copyin(char *image, char *infilename, char *outfilename)
+{
+    static uint8_t buf[FATP_MAX_FRAME];
+    char path[MAXPATHLEN];
+    const char *base;
+    FILE *in;
+    size_t n;
+    int fd;
+
+    /* files always get an extension, as with dos_cp */
+    base = strrchr(outfilename, '/');
+    if (strrchr(outfilename, '\\') > base)
+	base = strrchr(outfilename, '\\');
+    base = base ? base + 1 : outfilename;
+    strncpy(path, outfilename, MAXPATHLEN - 5);
+    path[MAXPATHLEN - 5] = '\0';
+    if (strchr(base, '.') == NULL)
+    {
+	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+	strcat(path, ".___");
+    }
+
+    in = fopen(infilename, "r");
+    if (in == NULL)
+    {
+	fprintf(stderr, "Can't open file %s to copy data in\n", infilename);
+	exit(1);
+    }
+
+    fd = send_request(FATP_PUT, image, path);
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+	if (fatp_send(fd, FATP_DATA, buf, n) < 0)
+	    break;
+    }
+    fclose(in);
+    fatp_send(fd, FATP_END, NULL, 0);
+    return read_reply(fd, stdout, outfilename);
+}
+
+
+int copyout(char *image, char *infilename, char *outfilename)
+{
+    FILE *out = fopen(outfilename, "w");
+    int rv;
+
+    if (out == NULL)
+    {
+	fprintf(stderr, "Can't open file %s to copy data out\n", outfilename);
+	exit(1);
+    }
+    rv = read_reply(send_request(FATP_CAT, image, infilename), out, infilename);
+    fclose(out);
+    return rv;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-s socket] ls <image>\n", progname);
+    fprintf(stderr, "       %s [-s socket] stat|cat <image> <path>\n", progname);
+    fprintf(stderr, "       %s [-s socket] cp <image> a:<path> <file>\n", progname);
+    fprintf(stderr, "       %s [-s socket] cp <image> <file> a:<path>\n", progname);
+    fprintf(stderr, "\tasks a running fatd (default $FATD_SOCKET or %s)\n", FATD_SOCKET);
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    char *progname = argv[0];
+    char *cmd;
+    int opt, rv;
+
+    sockpath = fatp_socket_path();
+    while ((opt = getopt(argc, argv, "+s:")) != -1)
+    {
+	if (opt != 's')
+	    usage(progname);
+	sockpath = optarg;
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+    if (argc < 3)
+    {
+	usage(progname);
+    }
+    cmd = argv[1];
+
+    if (strcmp(cmd, "ls") == 0 && argc == 3)
+	rv = read_reply(send_request(FATP_LS, argv[2], ""), stdout, argv[2]);
+    else if (strcmp(cmd, "stat") == 0 && argc == 4)
+	rv = read_reply(send_request(FATP_STAT, argv[2], argv[3]), stdout, argv[3]);
+    else if (strcmp(cmd, "cat") == 0 && argc == 4)
+	rv = read_reply(send_request(FATP_CAT, argv[2], argv[3]), stdout, argv[3]);
+    else if (strcmp(cmd, "cp") == 0 && argc == 5 && strncmp(argv[3], "a:", 2) == 0)
+	rv = copyout(argv[2], argv[3] + 2, argv[4]);
+    else if (strcmp(cmd, "cp") == 0 && argc == 5 && strncmp(argv[4], "a:", 2) == 0)
+	rv = copyin(argv[2], argv[3], argv[4] + 2);
+    else
+	usage(progname);
+
+    return rv < 0;
+}
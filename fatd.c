@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "direntry.h"
+#include "libfat.h"
+#include "fatproto.h"
+
+/* fatd keeps a set of images open and serves ls, stat, cat and cp
+   requests for them over a Unix socket (see fatproto.h), so a request
+   costs a round trip instead of a process start, an mmap and a boot
+   sector check.  The mappings stay resident between requests, so the
+   FAT and directory clusters are warm after the first walk.
+
+   Each connection gets a thread.  Readers of an image share its lock;
+   a write holds it exclusively, so a reader never sees a half-made
+   file.  The counters in fat_stats are not locked and are approximate
+   under concurrent reads. */
+
+struct served_image
+{
+    char *name;			/* as given on the command line */
+    fat_volume *vol;
+    pthread_rwlock_t lock;
+};
+
+static struct served_image *images;
+static int nimages;
+
+static volatile sig_atomic_t stopping = FALSE;
+
+
+/* find_image accepts the image path as fatd was given it, or its
+   basename */
+struct served_image *find_image(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nimages; i++)
+    {
+	const char *base = strrchr(images[i].name, '/');
+
+	if (strcmp(images[i].name, name) == 0
+	    || (base != NULL && strcmp(base + 1, name) == 0))
+	    return &images[i];
+    }
+    return NULL;
+}
+
+
+/* ---------- ls ---------- */
+
+/* the same listing dos_ls prints */
+int list_dir(fat_volume *vol, FILE *out, char *path, int indent)
+{
+    struct fat_dir dir;
+    struct fat_stat st;
+    char subpath[MAXPATHLEN];
+    int rv;
+
+    rv = fat_opendir(vol, path, &dir);
+    while (rv == FAT_OK && (rv = fat_readdir(&dir, &st)) > 0)
+    {
+	rv = FAT_OK;
+	if ((st.attr & ATTR_VOLUME) != 0)
+	{
+	    fprintf(out, "Volume: %s\n", st.base);
+	}
+	else if (st.is_dir)
+	{
+	    if ((st.attr & ATTR_HIDDEN) != ATTR_HIDDEN)
+	    {
+		fprintf(out, "%*s%s/ (directory)\n", indent*4, "", st.base);
+		snprintf(subpath, sizeof(subpath), "%s/%s", path, st.name);
+		list_dir(vol, out, subpath, indent+1);
+	    }
+	}
+	else
+	{
+	    fprintf(out, "%*s%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n",
+		    indent*4, "", st.base, st.ext, st.size, st.cluster,
+		    (st.attr & ATTR_READONLY) ? 'r' : ' ',
+		    (st.attr & ATTR_HIDDEN) ? 'h' : ' ',
+		    (st.attr & ATTR_SYSTEM) ? 's' : ' ',
+		    (st.attr & ATTR_ARCHIVE) ? 'a' : ' ');
+	}
+    }
+    return rv;
+}
+
+
+/* send a memory buffer as data frames */
+int send_buffer(int fd, const char *buf, size_t len)
+{
+    size_t done, n;
+
+    for (done = 0; done < len; done += n)
+    {
+	n = len - done < FATP_MAX_FRAME ? len - done : FATP_MAX_FRAME;
+	if (fatp_send(fd, FATP_DATA, buf + done, n) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+int do_ls(int fd, struct served_image *img, char *path)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    int rv;
+
+    if (out == NULL)
+	return FAT_ENOMEM;
+    pthread_rwlock_rdlock(&img->lock);
+    rv = list_dir(img->vol, out, path, 0);
+    pthread_rwlock_unlock(&img->lock);
+    fclose(out);
+
+    if (rv == FAT_OK && send_buffer(fd, text, len) < 0)
+	rv = FAT_EIO;
+    free(text);
+    return rv;
+}
+
+
+/* ---------- stat and cat ---------- */
+
+int do_stat(int fd, struct served_image *img, char *path)
+{
+    struct fat_stat st;
+    char line[MAXPATHLEN + 128];
+    int rv;
+
+    pthread_rwlock_rdlock(&img->lock);
+    rv = fat_lookup(img->vol, path, &st);
+    pthread_rwlock_unlock(&img->lock);
+    if (rv < 0)
+	return rv;
+
+    snprintf(line, sizeof(line),
+	     "%s: %s, %u bytes, starting cluster %d, attributes %c%c%c%c\n",
+	     path, st.is_dir ? "directory" : "file", st.size, st.cluster,
+	     (st.attr & ATTR_READONLY) ? 'r' : ' ',
+	     (st.attr & ATTR_HIDDEN) ? 'h' : ' ',
+	     (st.attr & ATTR_SYSTEM) ? 's' : ' ',
+	     (st.attr & ATTR_ARCHIVE) ? 'a' : ' ');
+    if (fatp_send(fd, FATP_DATA, line, strlen(line)) < 0)
+	return FAT_EIO;
+    return FAT_OK;
+}
+
+
+/* cat streams the file a frame at a time; the read lock is held for
+   the whole file so it cannot change underneath the reader */
+int do_cat(int fd, struct served_image *img, char *path, uint8_t *buf)
+{
+    struct fat_stat st;
+    struct fat_readahead ra;
+    struct fat_skip skip;
+    uint32_t offset = 0;
+    ssize_t n;
+    int rv;
+
+    pthread_rwlock_rdlock(&img->lock);
+    rv = fat_lookup(img->vol, path, &st);
+    if (rv == FAT_OK && st.is_dir)
+	rv = FAT_EISDIR;
+    if (rv == FAT_OK)
+	rv = fat_hold_file(img->vol, &st);
+    if (rv < 0)
+    {
+	pthread_rwlock_unlock(&img->lock);
+	return rv;
+    }
+
+    fat_skip_init(&skip, &st);
+    fat_readahead_init(&ra, &st);
+    while (fat_readahead(img->vol, &st, &ra, offset),
+	   (n = fat_read_at(img->vol, &st, &skip, offset, buf, FATP_MAX_FRAME)) != 0)
+    {
+	if (n < 0)
+	    rv = n;
+	else if (fatp_send(fd, FATP_DATA, buf, n) < 0)
+	    rv = FAT_EIO;
+	if (rv < 0)
+	    break;
+	offset += n;
+    }
+    fat_release_file(img->vol, &st);
+    pthread_rwlock_unlock(&img->lock);
+    return rv;
+}
+
+
+/* ---------- put ---------- */
+
+/* the data is gathered before the write lock is taken, so a slow
+   client holds up nobody else */
+int do_put(int fd, struct served_image *img, char *path, uint8_t *frame)
+{
+    uint8_t *data = NULL;
+    size_t len = 0, alloc = 0, n;
+    int type, rv;
+
+    while (1)
+    {
+	if (fatp_recv(fd, &type, frame, &n) < 0)
+	{
+	    free(data);
+	    return FAT_EIO;
+	}
+	if (type == FATP_END)
+	    break;
+	if (type != FATP_DATA || len + n > UINT32_MAX)
+	{
+	    free(data);
+	    return FAT_EINVAL;
+	}
+	if (len + n > alloc)
+	{
+	    uint8_t *p;
+
+	    alloc = alloc ? alloc * 2 : FATP_MAX_FRAME;
+	    if (alloc < len + n)
+		alloc = len + n;
+	    p = realloc(data, alloc);
+	    if (p == NULL)
+	    {
+		free(data);
+		return FAT_ENOMEM;
+	    }
+	    data = p;
+	}
+	memcpy(data + len, frame, n);
+	len += n;
+    }
+
+    pthread_rwlock_wrlock(&img->lock);
+    rv = fat_write(img->vol, path, data, len, NULL);
+    pthread_rwlock_unlock(&img->lock);
+    free(data);
+    return rv;
+}
+
+
+/* ---------- connections ---------- */
+
+void *serve(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    uint8_t *buf = malloc(FATP_MAX_FRAME + 1);
+    struct served_image *img = NULL;
+    char *name, *path;
+    size_t len;
+    int type, rv;
+
+    if (buf == NULL || fatp_recv(fd, &type, buf, &len) < 0)
+	goto done;
+
+    /* payload: image name and path, both NUL terminated */
+    buf[len] = '\0';
+    name = (char *)buf;
+    path = memchr(buf, '\0', len);
+    if (path == NULL || path + 1 >= (char *)buf + len)
+    {
+	fatp_send_error(fd, FAT_EINVAL, "malformed request");
+	goto done;
+    }
+    path++;
+    name = strdup(name);
+    path = strdup(path);
+    if (name == NULL || path == NULL)
+	rv = FAT_ENOMEM;
+    else if ((img = find_image(name)) == NULL)
+	rv = FAT_ENOENT;
+    else if (type == FATP_LS)
+	rv = do_ls(fd, img, path);
+    else if (type == FATP_STAT)
+	rv = do_stat(fd, img, path);
+    else if (type == FATP_CAT)
+	rv = do_cat(fd, img, path, buf);
+    else if (type == FATP_PUT)
+	rv = do_put(fd, img, path, buf);
+    else
+	rv = FAT_EINVAL;
+
+    if (rv == FAT_OK)
+	fatp_send(fd, FATP_END, NULL, 0);
+    else if (img == NULL && name != NULL)
+	fatp_send_error(fd, rv, "no such image");
+    else
+	fatp_send_error(fd, rv, fat_strerror(rv));
+    free(name);
+    free(path);
+
+done:
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+
+void stop(int sig)
+{
+    stopping = TRUE;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-w] [-s socket] <imagename>...\n", progname);
+    fprintf(stderr, "\tserves the images on a Unix socket (default $FATD_SOCKET or %s)\n",
+	    FATD_SOCKET);
+    fprintf(stderr, "\t-w opens them read-write, so files can be copied in\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    const char *sockpath = fatp_socket_path();
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    int writable = FALSE;
+    int listen_fd, opt, i, rv;
+
+    while ((opt = getopt(argc, argv, "ws:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'w':
+	    writable = TRUE;
+	    break;
+	case 's':
+	    sockpath = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind == argc)
+    {
+	usage(argv[0]);
+    }
+
+    nimages = argc - optind;
+    images = calloc(nimages, sizeof(struct served_image));
+    for (i = 0; i < nimages; i++)
+    {
+	images[i].name = argv[optind + i];
+	rv = fat_open(images[i].name, writable ? FAT_RDWR : FAT_RDONLY, &images[i].vol);
+	if (rv < 0)
+	{
+	    fprintf(stderr, "%s: %s\n", images[i].name,
+		    rv == FAT_EIO ? strerror(errno) : fat_strerror(rv));
+	    exit(1);
+	}
+	pthread_rwlock_init(&images[i].lock, NULL);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, "Socket path %s is too long\n", sockpath);
+	exit(1);
+    }
+    strcpy(addr.sun_path, sockpath);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+	perror("socket");
+	exit(1);
+    }
+    unlink(sockpath);		/* left over from a previous run */
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	|| listen(listen_fd, 64) < 0)
+    {
+	fprintf(stderr, "Cannot listen on %s: %s\n", sockpath, strerror(errno));
+	exit(1);
+    }
+
+    /* no SA_RESTART, so a signal breaks accept() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stopping)
+    {
+	pthread_t thread;
+	int fd = accept(listen_fd, NULL, NULL);
+
+	if (fd < 0)
+	{
+	    if (errno != EINTR)
+		perror("accept");
+	    continue;
+	}
+	if (pthread_create(&thread, NULL, serve, (void *)(intptr_t)fd) != 0)
+	{
+	    close(fd);
+	    continue;
+	}
+	pthread_detach(thread);
+    }
+
+    /* in-flight requests are cut short, but every finished write has
+       already reached the image */
+    close(listen_fd);
+    unlink(sockpath);
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "fatproto.h"
+
+
+const char *fatp_socket_path(void)
+{
+    const char *path = getenv("FATD_SOCKET");
+
+    return path != NULL && path[0] != '\0' ? path : FATD_SOCKET;
+}
+
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0)
+    {
+	ssize_t n = write(fd, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0)
+    {
+	ssize_t n = read(fd, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+
+/* fatp_send writes one frame */
+int fatp_send(int fd, int type, const void *buf, size_t len)
+{
+    uint8_t header[8];
+    uint32_t nlen = htonl(len);
+
+    if (len > FATP_MAX_FRAME)
+	return -1;
+    memset(header, 0, sizeof(header));
+    header[0] = type;
+    memcpy(header + 4, &nlen, 4);
+    if (write_full(fd, header, sizeof(header)) < 0)
+	return -1;
+    return write_full(fd, buf, len);
+}
+
+
+/* fatp_send_error writes a FATP_ERROR frame carrying err and msg */
+int fatp_send_error(int fd, int err, const char *msg)
+{
+    uint8_t buf[4 + 256];
+    uint32_t nerr = htonl((uint32_t)err);
+    size_t len = strlen(msg);
+
+    if (len > sizeof(buf) - 5)
+	len = sizeof(buf) - 5;
+    memcpy(buf, &nerr, 4);
+    memcpy(buf + 4, msg, len);
+    buf[4 + len] = '\0';
+    return fatp_send(fd, FATP_ERROR, buf, 4 + len + 1);
+}
+
+
+/* fatp_recv reads one frame into buf, which must hold FATP_MAX_FRAME
+   bytes; *len is set to the payload length */
+int fatp_recv(int fd, int *type, void *buf, size_t *len)
+{
+    uint8_t header[8];
+    uint32_t nlen;
+
+    if (read_full(fd, header, sizeof(header)) < 0)
+	return -1;
+    memcpy(&nlen, header + 4, 4);
+    nlen = ntohl(nlen);
+    if (nlen > FATP_MAX_FRAME)
+	return -1;
+    *type = header[0];
+    *len = nlen;
+    return read_full(fd, buf, nlen);
+}
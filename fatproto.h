@@ -0,0 +1,42 @@
+#ifndef __FATPROTO_H__
+#define __FATPROTO_H__
+
+/* The fatd wire protocol.  Everything travels in frames: a one byte
+   type, three bytes of padding and a payload length in network order,
+   then the payload.
+
+   A request is one frame whose type is the operation and whose payload
+   is the image name and the path, each NUL terminated.  FATP_PUT is
+   followed by FATP_DATA frames holding the file and an empty FATP_END.
+
+   The reply is any number of FATP_DATA frames, then FATP_END, or a
+   FATP_ERROR whose payload is a 4 byte FAT_E* code in network order
+   and a NUL terminated message.  One request per connection. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* requests */
+#define FATP_LS		'l'	/* the listing dos_ls would print */
+#define FATP_STAT	's'	/* one line describing the path */
+#define FATP_CAT	'c'	/* the file's contents */
+#define FATP_PUT	'p'	/* create the file from the data frames */
+
+/* replies */
+#define FATP_DATA	'D'
+#define FATP_END	'O'
+#define FATP_ERROR	'E'
+
+#define FATP_MAX_FRAME	(64 * 1024)
+
+#define FATD_SOCKET	"/tmp/fatd.sock"
+
+/* fatp_socket_path returns $FATD_SOCKET, or FATD_SOCKET if unset */
+const char *fatp_socket_path(void);
+
+/* these return 0 on success, -1 on error or a short read */
+int fatp_send(int fd, int type, const void *buf, size_t len);
+int fatp_send_error(int fd, int err, const char *msg);
+int fatp_recv(int fd, int *type, void *buf, size_t *len);
+
+#endif // __FATPROTO_H__
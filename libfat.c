@@ -0,0 +1,2494 @@
+#define _GNU_SOURCE		/* F_OFD_SETLKW */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "libfat.h"
+#include "fat_io.h"
+
+
+#define CLUSTER_SIZE(bpb) (bpb->bpbSecPerClust * bpb->bpbBytesPerSec)
+#define DIRENTS_PER_CLUSTER(bpb) (CLUSTER_SIZE(bpb) / sizeof(struct direntry))
+
+/* a byte range of the image this volume holds an advisory lock on */
+struct held_range
+{
+    off_t start, len;
+    short type;			/* F_RDLCK or F_WRLCK */
+    int count;			/* holders within this volume */
+    struct held_range *next;
+};
+
+struct fat_volume
+{
+    int fd;
+    int writable;
+    struct fat_io io;
+    uint8_t *image_buf;		/* io.buf */
+    size_t size;
+    struct bpb33 *bpb;
+    uint16_t limit;		/* one past the last usable cluster */
+    pthread_mutex_t lock_mutex;	/* guards held and whole */
+    struct held_range *held;
+    short whole;		/* fat_lock_volume's lock, F_UNLCK if none */
+    int punch;			/* FAT_PUNCH */
+};
+
+
+static const char *fat_errors[] = {
+    "Success",
+    "I/O error",
+    "Not a FAT-12 image",
+    "No such file or directory",
+    "File exists",
+    "Not a directory",
+    "Is a directory",
+    "No space left in the image",
+    "Invalid argument",
+    "Out of memory",
+    "Image is read-only",
+    "Image is corrupt",
+    "Directory not empty",
+};
+
+/* fat_strerror describes a FAT_E* code */
+const char *fat_strerror(int err)
+{
+    if (err > 0 || -err >= sizeof(fat_errors) / sizeof(fat_errors[0]))
+	return "Unknown error";
+    return fat_errors[-err];
+}
+
+
+/* sanity check the geometry, so nothing computed from it can point
+   outside the mapped image */
+static int check_geometry(struct bpb33 *bpb, size_t size)
+{
+    uint16_t bps = bpb->bpbBytesPerSec;
+    uint8_t spc = bpb->bpbSecPerClust;
+
+    if (bps != 512 && bps != 1024 && bps != 2048 && bps != 4096)
+	return FAT_EBADFS;
+    if (spc == 0 || (spc & (spc - 1)) != 0)
+	return FAT_EBADFS;
+    if (bpb->bpbFATs == 0 || bpb->bpbFATsecs == 0 || bpb->bpbRootDirEnts == 0)
+	return FAT_EBADFS;
+    if ((size_t)bpb->bpbSectors * bps > size)
+	return FAT_EBADFS;
+    if (cluster_limit(bpb) == 0)
+	return FAT_EBADFS;
+    return FAT_OK;
+}
+
+
+/* the backend asked for in flags, else by $FAT_IO */
+static int pick_backend(int flags)
+{
+    const char *name = getenv("FAT_IO");
+
+    switch (flags & FAT_IO_MASK)
+    {
+    case FAT_IO_MMAP:
+	return IO_MMAP;
+    case FAT_IO_PREAD:
+	return IO_PREAD;
+    case FAT_IO_URING:
+	return IO_URING;
+    }
+    if (name == NULL || name[0] == '\0' || strcmp(name, "mmap") == 0)
+	return IO_MMAP;
+    if (strcmp(name, "pread") == 0)
+	return IO_PREAD;
+    if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+	return IO_URING;
+    return FAT_EINVAL;
+}
+
+
+int fat_sync_mode(const char *name)
+{
+    if (strcmp(name, "none") == 0)
+	return FAT_SYNC_NONE;
+    if (strcmp(name, "ordered") == 0)
+	return FAT_SYNC_ORDERED;
+    if (strcmp(name, "full") == 0)
+	return FAT_SYNC_FULL;
+    return FAT_EINVAL;
+}
+
+
+/* the flush policy asked for in flags, else by $FAT_SYNC */
+static int pick_policy(int flags)
+{
+    const char *name = getenv("FAT_SYNC");
+
+    if ((flags & FAT_SYNC_MASK) == 0 && name != NULL && name[0] != '\0')
+	flags = fat_sync_mode(name);
+    if (flags < 0)
+	return flags;
+    switch (flags & FAT_SYNC_MASK)
+    {
+    case FAT_SYNC_ORDERED:
+	return IO_SYNC_ORDERED;
+    case FAT_SYNC_FULL:
+	return IO_SYNC_FULL;
+    }
+    return IO_SYNC_NONE;
+}
+
+
+/* fat_open opens the image at path; flags is FAT_RDONLY or FAT_RDWR,
+   with a FAT_IO_* backend and FAT_SYNC_* policy if wanted */
+int fat_open(const char *path, int flags, fat_volume **volp)
+{
+    struct stat st;
+    fat_volume *vol;
+    struct bpb33 *bpb;
+    int backend = pick_backend(flags), policy = pick_policy(flags);
+    int err;
+
+    if (backend < 0)
+	return backend;
+    if (policy < 0)
+	return policy;
+    vol = calloc(1, sizeof(fat_volume));
+    if (vol == NULL)
+	return FAT_ENOMEM;
+    pthread_mutex_init(&vol->lock_mutex, NULL);
+    vol->whole = F_UNLCK;	/* F_RDLCK is 0 */
+    vol->writable = (flags & FAT_RDWR) != 0;
+    vol->punch = vol->writable && (flags & FAT_PUNCH) != 0;
+
+    vol->fd = open(path, vol->writable ? O_RDWR : O_RDONLY);
+    if (vol->fd < 0)
+    {
+	free(vol);
+	return FAT_EIO;
+    }
+    if (fstat(vol->fd, &st) < 0)
+    {
+	err = FAT_EIO;
+	goto fail;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < sizeof(struct bootsector33))
+    {
+	err = FAT_EBADFS;
+	goto fail;
+    }
+    vol->size = st.st_size;
+
+    err = io_open(&vol->io, vol->fd, vol->size, vol->writable, backend, policy);
+    if (err < 0)
+	goto fail;
+    vol->image_buf = vol->io.buf;
+
+    /* the boot sector, then everything up to the first cluster, stays
+       loaded whatever the backend */
+    err = io_pin(&vol->io, sizeof(struct bootsector33));
+    if (err < 0)
+	goto fail_unmap;
+    vol->bpb = bpb = check_bootsector(vol->image_buf);
+    if (bpb == NULL)
+    {
+	err = FAT_ENOMEM;
+	goto fail_unmap;
+    }
+    err = check_geometry(bpb, vol->size);
+    if (err < 0)
+	goto fail_unmap;
+    vol->limit = cluster_limit(bpb);
+    err = io_pin(&vol->io, (size_t)bpb->bpbBytesPerSec
+		 * (bpb->bpbResSectors + bpb->bpbFATs * bpb->bpbFATsecs)
+		 + bpb->bpbRootDirEnts * sizeof(struct direntry));
+    if (err < 0)
+	goto fail_unmap;
+
+    *volp = vol;
+    return FAT_OK;
+
+fail_unmap:
+    free(vol->bpb);
+    io_close(&vol->io);
+fail:
+    close(vol->fd);
+    free(vol);
+    return err;
+}
+
+
+static int punch_free(fat_volume *vol);
+
+/* fat_close writes back anything still unwritten and lets the image
+   go */
+int fat_close(fat_volume *vol)
+{
+    int err = vol->punch ? punch_free(vol) : FAT_OK;
+
+    if (io_flush(&vol->io) < 0)
+	err = FAT_EIO;
+
+    /* closing the descriptor drops any locks still held */
+    if (io_close(&vol->io) < 0 || close(vol->fd) < 0)
+	err = FAT_EIO;
+    while (vol->held != NULL)
+    {
+	struct held_range *h = vol->held;
+	vol->held = h->next;
+	free(h);
+    }
+    pthread_mutex_destroy(&vol->lock_mutex);
+    free(vol->bpb);
+    free(vol);
+    return err;
+}
+
+
+/* the whole image is loaded first if the backend is not mmap */
+uint8_t *fat_image(fat_volume *vol)
+{
+    if (io_raw(&vol->io) < 0)
+	return NULL;
+    return vol->image_buf;
+}
+
+struct bpb33 *fat_bpb(fat_volume *vol)
+{
+    return vol->bpb;
+}
+
+int fat_writable(fat_volume *vol)
+{
+    return vol->writable;
+}
+
+size_t fat_image_size(fat_volume *vol)
+{
+    return vol->size;
+}
+
+struct dos_stats *fat_stats(fat_volume *vol)
+{
+    return dos_stats_of(vol->bpb);
+}
+
+int fat_sync(fat_volume *vol)
+{
+    return io_sync(&vol->io);
+}
+
+
+/* ---------- locking ---------- */
+
+/* Locks are fcntl byte-range locks on the image, owned by the open
+   file description where the system has them, so they exclude other
+   processes; threads sharing a volume must exclude each other
+   themselves.  Because a second lock on the same range by the same
+   owner replaces the first, each range is reference counted here and
+   the system only hears about the first hold and the last release.
+
+   Without mmap the volume keeps its own copy of what it has read, so
+   taking a lock from the system refreshes that copy, and giving up an
+   exclusive one first writes back what was changed under it. */
+
+#ifdef F_OFD_SETLKW
+#define LOCK_CMD F_OFD_SETLKW
+#else
+#define LOCK_CMD F_SETLKW
+#endif
+
+/* the FAT copies: lookups hold them shared, allocation exclusive */
+#define META_START(bpb) ((off_t)(bpb)->bpbResSectors * (bpb)->bpbBytesPerSec)
+#define META_LEN(bpb)							\
+    ((off_t)(bpb)->bpbFATs * (bpb)->bpbFATsecs * (bpb)->bpbBytesPerSec)
+
+static int set_lock(fat_volume *vol, short type, off_t start, off_t len)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (fcntl(vol->fd, LOCK_CMD, &fl) < 0)
+    {
+	if (errno != EINTR)
+	    return FAT_EIO;
+    }
+    return FAT_OK;
+}
+
+
+static struct held_range *find_held(fat_volume *vol, short type,
+				    off_t start, off_t len)
+{
+    struct held_range *h;
+
+    for (h = vol->held; h != NULL; h = h->next)
+	if (h->start == start && h->len == len && h->type == type)
+	    return h;
+    return NULL;
+}
+
+
+/* is the range already locked at least this strongly by us? */
+static int covered(fat_volume *vol, short type, off_t start, off_t len)
+{
+    if (vol->whole == F_WRLCK || (vol->whole == F_RDLCK && type == F_RDLCK))
+	return TRUE;
+    return type == F_RDLCK && find_held(vol, F_WRLCK, start, len) != NULL;
+}
+
+
+/* A lock set over a range replaces our own locks on all of it, so one
+   held range can take away part of another that overlaps it: unlocking
+   a slot range would drop a shared hold on an entry inside it, and a
+   shared lock would turn part of an exclusive one shared.  lock_gaps
+   sets type only over the parts of start..start+len (0 for the rest of
+   the image) that no held range covers; restore_held puts back the held
+   ranges over it, shared first so an exclusive hold on the same bytes
+   wins.  Releasing restores before it unlocks, so the holds have no
+   gap another process could take. */
+static int lock_gaps(fat_volume *vol, short type, off_t start, off_t len)
+{
+    struct held_range *h;
+    off_t pos = start, next;
+    int rv = FAT_OK;
+
+    while (len == 0 || pos < start + len)
+    {
+	next = len == 0 ? -1 : start + len;	/* -1: to the end */
+	for (h = vol->held; h != NULL; h = h->next)
+	{
+	    if (h->start <= pos && pos < h->start + h->len)
+		break;
+	    if (h->start > pos && (next < 0 || h->start < next))
+		next = h->start;
+	}
+	if (h != NULL)
+	{
+	    pos = h->start + h->len;
+	    continue;
+	}
+	if (set_lock(vol, type, pos, next < 0 ? 0 : next - pos) < 0)
+	    rv = FAT_EIO;
+	if (next < 0)
+	    break;
+	pos = next;
+    }
+    return rv;
+}
+
+
+static void restore_held(fat_volume *vol, off_t start, off_t len)
+{
+    struct held_range *h;
+    short type = F_RDLCK;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++, type = F_WRLCK)
+    {
+	for (h = vol->held; h != NULL; h = h->next)
+	{
+	    off_t lo = h->start, hi = h->start + h->len;
+
+	    if (h->type != type)
+		continue;
+	    if (len != 0)
+	    {
+		if (lo < start)
+		    lo = start;
+		if (hi > start + len)
+		    hi = start + len;
+		if (lo >= hi)
+		    continue;
+	    }
+	    set_lock(vol, type, lo, hi - lo);
+	}
+    }
+}
+
+
+static int hold_range(fat_volume *vol, short type, off_t start, off_t len)
+{
+    struct held_range *h;
+    int rv = FAT_OK;
+
+    pthread_mutex_lock(&vol->lock_mutex);
+    h = find_held(vol, type, start, len);
+    if (h == NULL)
+    {
+	h = calloc(1, sizeof(struct held_range));
+	if (h == NULL)
+	    rv = FAT_ENOMEM;
+	else if (!covered(vol, type, start, len))
+	{
+	    if (type == F_RDLCK)
+		rv = lock_gaps(vol, type, start, len);
+	    else
+		rv = set_lock(vol, type, start, len);
+	    if (rv == FAT_OK)
+		io_revalidate(&vol->io);
+	}
+	if (rv == FAT_OK)
+	{
+	    h->start = start;
+	    h->len = len;
+	    h->type = type;
+	    h->next = vol->held;
+	    vol->held = h;
+	}
+	else
+	    free(h);
+    }
+    if (rv == FAT_OK)
+	h->count++;
+    pthread_mutex_unlock(&vol->lock_mutex);
+    return rv;
+}
+
+
+static void release_range(fat_volume *vol, short type, off_t start, off_t len)
+{
+    struct held_range **hp, *h;
+    short rest = F_UNLCK;
+
+    pthread_mutex_lock(&vol->lock_mutex);
+    for (hp = &vol->held; (h = *hp) != NULL; hp = &h->next)
+	if (h->start == start && h->len == len && h->type == type)
+	    break;
+    if (h != NULL && --h->count == 0)
+    {
+	if (type == F_WRLCK)
+	    io_flush(&vol->io);
+	*hp = h->next;
+	free(h);
+	if (!covered(vol, type, start, len))
+	{
+	    /* fall back to whatever else still covers the range */
+	    if (vol->whole == F_RDLCK)
+		rest = F_RDLCK;
+	    restore_held(vol, start, len);
+	    lock_gaps(vol, rest, start, len);
+	}
+    }
+    pthread_mutex_unlock(&vol->lock_mutex);
+}
+
+
+#define hold_meta(vol, type)						\
+    hold_range(vol, type, META_START((vol)->bpb), META_LEN((vol)->bpb))
+#define release_meta(vol, type)						\
+    release_range(vol, type, META_START((vol)->bpb), META_LEN((vol)->bpb))
+
+
+/* fat_hold_file keeps a file's chain from being changed by others
+   until fat_release_file, by holding its directory entry shared */
+int fat_hold_file(fat_volume *vol, const struct fat_stat *st)
+{
+    if (st->entry == 0)
+	return FAT_OK;		/* the root */
+    return hold_range(vol, F_RDLCK, st->entry, sizeof(struct direntry));
+}
+
+void fat_release_file(fat_volume *vol, const struct fat_stat *st)
+{
+    if (st->entry != 0)
+	release_range(vol, F_RDLCK, st->entry, sizeof(struct direntry));
+}
+
+
+/* fat_lock_volume locks the whole image, for tools that work on the
+   raw structures; the library's own locks nest inside it */
+int fat_lock_volume(fat_volume *vol, int exclusive)
+{
+    short type = exclusive ? F_WRLCK : F_RDLCK;
+    int rv;
+
+    pthread_mutex_lock(&vol->lock_mutex);
+    rv = set_lock(vol, type, 0, 0);
+    if (rv == FAT_OK)
+    {
+	vol->whole = type;
+	rv = io_revalidate(&vol->io);
+    }
+    pthread_mutex_unlock(&vol->lock_mutex);
+    return rv;
+}
+
+void fat_unlock_volume(fat_volume *vol)
+{
+    pthread_mutex_lock(&vol->lock_mutex);
+    if (vol->whole == F_WRLCK)
+	io_flush(&vol->io);
+    vol->whole = F_UNLCK;
+    /* back to just the ranges still held */
+    restore_held(vol, 0, 0);
+    lock_gaps(vol, F_UNLCK, 0, 0);
+    pthread_mutex_unlock(&vol->lock_mutex);
+}
+
+
+/* punch_free punches out every run of free clusters that still has
+   data under it.  The FAT that frees them reaches the disk first, so
+   a crash cannot leave a live file pointing into a hole. */
+static int punch_free(fat_volume *vol)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint16_t c, run;
+    int rv = hold_meta(vol, F_WRLCK);
+
+    if (rv < 0)
+	return rv;
+    rv = io_sync(&vol->io);
+    for (c = CLUST_FIRST; rv == FAT_OK && c < vol->limit; c += run ? run : 1)
+    {
+	for (run = 0; c + run < vol->limit
+		 && get_fat_entry(c + run, vol->image_buf, bpb) == CLUST_FREE; run++)
+	    ;
+	if (run > 0)
+	    rv = io_punch(&vol->io, cluster_to_addr(c, vol->image_buf, bpb) - vol->image_buf,
+			  (size_t)run * CLUSTER_SIZE(bpb));
+    }
+    release_meta(vol, F_WRLCK);
+    return rv;
+}
+
+
+/* ---------- directories ---------- */
+
+/* load len bytes at p through the backend; how is an IO_* mode */
+#define get_bytes(vol, p, len, how)					\
+    io_get(&(vol)->io, (uint8_t *)(p) - (vol)->image_buf, len, how)
+
+/* fill in a fat_stat from a directory entry */
+static void dirent_to_stat(fat_volume *vol, struct direntry *dirent,
+			   struct fat_stat *st)
+{
+    int i;
+
+    memcpy(st->base, dirent->deName, 8);
+    memcpy(st->ext, dirent->deExtension, 3);
+    st->base[8] = '\0';
+    st->ext[3] = '\0';
+
+    /* names are space padded - remove the padding */
+    for (i = 7; i >= 0 && st->base[i] == ' '; i--)
+	st->base[i] = '\0';
+    for (i = 2; i >= 0 && st->ext[i] == ' '; i--)
+	st->ext[i] = '\0';
+
+    strcpy(st->name, st->base);
+    if (st->ext[0] != '\0')
+    {
+	strcat(st->name, ".");
+	strcat(st->name, st->ext);
+    }
+    st->attr = dirent->deAttributes;
+    st->cluster = getushort(dirent->deStartCluster);
+    st->size = getulong(dirent->deFileSize);
+    st->entry = (uint8_t *)dirent - vol->image_buf;
+    st->is_dir = (st->attr & ATTR_DIRECTORY) != 0
+	&& (st->attr & ATTR_WIN95LFN) != ATTR_WIN95LFN;
+}
+
+
+static void dir_start(fat_volume *vol, uint16_t cluster, struct fat_dir *dir)
+{
+    dir->vol = vol;
+    dir->cluster = cluster;
+    dir->index = 0;
+    dir->steps = 0;
+}
+
+
+/* dir_next returns the next raw slot of a directory, including deleted
+   ones: 1 with *dep set, 0 at the end of the directory, or an error */
+static int dir_next(struct fat_dir *dir, struct direntry **dep)
+{
+    fat_volume *vol = dir->vol;
+    struct bpb33 *bpb = vol->bpb;
+    struct direntry *dirent;
+    int per_cluster = dir->cluster == MSDOSFSROOT
+	? bpb->bpbRootDirEnts : DIRENTS_PER_CLUSTER(bpb);
+
+    if (dir->index >= per_cluster)
+    {
+	uint16_t next;
+
+	if (dir->cluster == MSDOSFSROOT)
+	    return 0;
+	next = get_fat_entry(dir->cluster, vol->image_buf, bpb);
+	if (is_end_of_file(next))
+	    return 0;
+	if (!is_valid_cluster(next, bpb) || ++dir->steps >= vol->limit)
+	    return FAT_ECORRUPT;
+	dir->cluster = next;
+	dir->index = 0;
+    }
+
+    dirent = (struct direntry *)cluster_to_addr(dir->cluster, vol->image_buf, bpb)
+	+ dir->index;
+    if (get_bytes(vol, dirent, sizeof(struct direntry), IO_READ) < 0)
+	return FAT_EIO;
+    DOS_STAT(bpb, dirents_scanned, 1);
+    if (dirent->deName[0] == SLOT_EMPTY)
+	return 0;		/* nothing after an empty slot */
+    dir->index++;
+    *dep = dirent;
+    return 1;
+}
+
+
+/* entries that name nothing a caller can look up */
+static int skip_dirent(struct direntry *dirent)
+{
+    return dirent->deName[0] == SLOT_DELETED
+	|| dirent->deName[0] == '.'
+	|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN;
+}
+
+
+/* lookup finds the entry for path; *dep is NULL for the root.  The
+   caller holds the FAT locked. */
+static int lookup(fat_volume *vol, const char *path, struct direntry **dep)
+{
+    struct fat_dir dir;
+    struct fat_stat st;
+    struct direntry *dirent;
+    uint16_t cluster = MSDOSFSROOT;
+    size_t len;
+    int rv;
+
+    *dep = NULL;
+    while (*path == '/' || *path == '\\')
+	path++;
+
+    while (*path != '\0')
+    {
+	len = strcspn(path, "/\\");
+
+	dir_start(vol, cluster, &dir);
+	while ((rv = dir_next(&dir, &dirent)) > 0)
+	{
+	    if (skip_dirent(dirent) || (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    dirent_to_stat(vol, dirent, &st);
+	    if (strlen(st.name) == len && strncasecmp(st.name, path, len) == 0)
+		break;
+	}
+	if (rv < 0)
+	    return rv;
+	if (rv == 0)
+	    return FAT_ENOENT;
+
+	path += len;
+	while (*path == '/' || *path == '\\')
+	    path++;
+	if (*path == '\0')
+	{
+	    *dep = dirent;
+	    return FAT_OK;
+	}
+
+	if (!st.is_dir)
+	    return FAT_ENOTDIR;
+	cluster = st.cluster;
+	if (!is_valid_cluster(cluster, vol->bpb))
+	    return FAT_ECORRUPT;
+    }
+    return FAT_OK;
+}
+
+
+/* fat_lookup describes the file or directory at path */
+int fat_lookup(fat_volume *vol, const char *path, struct fat_stat *st)
+{
+    struct direntry *dirent;
+    int rv;
+
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_RDLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = lookup(vol, path, &dirent);
+    if (rv == FAT_OK && dirent == NULL)
+    {
+	/* the root has no entry of its own */
+	memset(st, 0, sizeof(struct fat_stat));
+	st->attr = ATTR_DIRECTORY;
+	st->is_dir = TRUE;
+    }
+    else if (rv == FAT_OK)
+	dirent_to_stat(vol, dirent, st);
+    release_meta(vol, F_RDLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* fat_free_space measures the free space with the FAT held steady */
+int fat_free_space(fat_volume *vol, struct dos_free *space)
+{
+    int rv;
+
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_RDLCK);
+    if (rv == FAT_OK)
+    {
+	dos_free_space(vol->image_buf, vol->bpb, space);
+	release_meta(vol, F_RDLCK);
+    }
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* fat_opendir positions dir at the start of the directory at path */
+int fat_opendir(fat_volume *vol, const char *path, struct fat_dir *dir)
+{
+    struct fat_stat st;
+    int rv = fat_lookup(vol, path, &st);
+
+    if (rv < 0)
+	return rv;
+    if (!st.is_dir)
+	return FAT_ENOTDIR;
+    /* only the root lives at cluster 0 */
+    if (st.cluster != MSDOSFSROOT || st.name[0] != '\0')
+    {
+	if (!is_valid_cluster(st.cluster, vol->bpb))
+	    return FAT_ECORRUPT;
+    }
+    dir_start(vol, st.cluster, dir);
+    DOS_STAT(vol->bpb, chains_walked, 1);
+    return FAT_OK;
+}
+
+
+int fat_readdir(struct fat_dir *dir, struct fat_stat *st)
+{
+    fat_volume *vol = dir->vol;
+    struct direntry *dirent;
+    int rv;
+
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_RDLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    while ((rv = dir_next(dir, &dirent)) > 0)
+    {
+	if (skip_dirent(dirent))
+	    continue;
+	dirent_to_stat(vol, dirent, st);
+	break;
+    }
+    release_meta(vol, F_RDLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* ---------- file data ---------- */
+
+/* the next link of a chain, noting it in skip if it is one to keep;
+   i is the position of cluster in the chain */
+static uint16_t next_link(fat_volume *vol, struct fat_skip *skip,
+			  uint16_t cluster, uint32_t i)
+{
+    cluster = get_fat_entry(cluster, vol->image_buf, vol->bpb);
+    if (skip != NULL && (i + 1) % FAT_SKIP_STRIDE == 0
+	&& (i + 1) / FAT_SKIP_STRIDE == skip->n && skip->n < FAT_SKIP_MAX)
+	skip->cluster[skip->n++] = cluster;
+    return cluster;
+}
+
+
+/* read_file starts from the nearest cluster skip knows of at or
+   before offset, or from the first without one */
+static ssize_t read_file(fat_volume *vol, const struct fat_stat *st,
+			 struct fat_skip *skip, uint32_t offset, void *buf,
+			 size_t len)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    uint16_t cluster = st->cluster;
+    size_t copied = 0;
+    uint32_t pos, i = 0;
+
+    if (st->is_dir)
+	return FAT_EISDIR;
+    if (offset >= st->size)
+	return 0;
+    if (len > st->size - offset)
+	len = st->size - offset;
+
+    DOS_STAT(bpb, chains_walked, 1);
+    if (skip != NULL)
+    {
+	if (skip->first != st->cluster || skip->n == 0)
+	    fat_skip_init(skip, st);
+	i = offset / csize / FAT_SKIP_STRIDE;
+	if (i >= skip->n)
+	    i = skip->n - 1;
+	cluster = skip->cluster[i];
+	i *= FAT_SKIP_STRIDE;
+    }
+    for (; i < offset / csize; i++)
+    {
+	if (!is_valid_cluster(cluster, bpb))
+	    return FAT_ECORRUPT;
+	cluster = next_link(vol, skip, cluster, i);
+    }
+
+    pos = offset % csize;
+    while (copied < len)
+    {
+	size_t n = csize - pos;
+	uint8_t *p;
+
+	if (!is_valid_cluster(cluster, bpb))
+	    return FAT_ECORRUPT;
+	if (n > len - copied)
+	    n = len - copied;
+	p = cluster_to_addr(cluster, vol->image_buf, bpb) + pos;
+	if (get_bytes(vol, p, n, IO_READ) < 0)
+	    return FAT_EIO;
+	memcpy((uint8_t *)buf + copied, p, n);
+	copied += n;
+	pos = 0;
+	if (copied < len)
+	    cluster = next_link(vol, skip, cluster, i++);
+    }
+    DOS_STAT(bpb, bytes_read, copied);
+    return copied;
+}
+
+
+/* fat_read holds the file for the length of the call; hold it with
+   fat_hold_file to keep it steady across calls */
+ssize_t fat_read(fat_volume *vol, const struct fat_stat *st,
+		 uint32_t offset, void *buf, size_t len)
+{
+    return fat_read_at(vol, st, NULL, offset, buf, len);
+}
+
+
+void fat_skip_init(struct fat_skip *skip, const struct fat_stat *st)
+{
+    skip->first = st->cluster;
+    skip->cluster[0] = st->cluster;
+    skip->n = 1;
+}
+
+
+ssize_t fat_read_at(fat_volume *vol, const struct fat_stat *st,
+		    struct fat_skip *skip, uint32_t offset, void *buf, size_t len)
+{
+    ssize_t n;
+    int rv;
+
+    io_begin(&vol->io);
+    rv = fat_hold_file(vol, st);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    n = read_file(vol, st, skip, offset, buf, len);
+    fat_release_file(vol, st);
+    io_end(&vol->io);
+    return n;
+}
+
+
+/* fat_scan hands out runs of up to this many bytes */
+#define SCAN_RUN	(1024 * 1024)
+
+static int scan_file(fat_volume *vol, const struct fat_stat *st,
+		     fat_scan_fn fn, void *arg)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    uint16_t cluster = st->cluster, next;
+    uint32_t left = st->size;
+    int rv;
+
+    if (st->is_dir)
+	return FAT_EISDIR;
+    DOS_STAT(bpb, chains_walked, 1);
+    while (left > 0)
+    {
+	uint8_t *start;
+	size_t n;
+
+	if (!is_valid_cluster(cluster, bpb))
+	    return FAT_ECORRUPT;
+	start = cluster_to_addr(cluster, vol->image_buf, bpb);
+	n = left < csize ? left : csize;
+	next = get_fat_entry(cluster, vol->image_buf, bpb);
+
+	/* take in the clusters that follow on in the image */
+	while (n < left && next == cluster + 1 && is_valid_cluster(next, bpb)
+	       && n + csize <= SCAN_RUN)
+	{
+	    cluster = next;
+	    n += left - n < csize ? left - n : csize;
+	    next = get_fat_entry(cluster, vol->image_buf, bpb);
+	}
+	if (get_bytes(vol, start, n, IO_READ) < 0)
+	    return FAT_EIO;
+	rv = fn(arg, start, n);
+	if (rv != 0)
+	    return rv;
+	DOS_STAT(bpb, bytes_read, n);
+	left -= n;
+	cluster = next;
+    }
+    return FAT_OK;
+}
+
+
+int fat_scan(fat_volume *vol, const struct fat_stat *st,
+	     fat_scan_fn fn, void *arg)
+{
+    int rv;
+
+    io_begin(&vol->io);
+    rv = fat_hold_file(vol, st);
+    if (rv == FAT_OK)
+    {
+	rv = scan_file(vol, st, fn, arg);
+	fat_release_file(vol, st);
+    }
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* ---------- readahead ---------- */
+
+/* the window is how much the reader gets through in RA_HORIZON
+   seconds, kept between RA_MIN and RA_MAX bytes */
+#define RA_MIN		(128 * 1024)
+#define RA_MAX		(8 * 1024 * 1024)
+#define RA_HORIZON	0.05
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void fat_readahead_init(struct fat_readahead *ra, const struct fat_stat *st)
+{
+    memset(ra, 0, sizeof(struct fat_readahead));
+    ra->cluster = st->cluster;
+    ra->window = RA_MIN;
+    ra->last_time = now();
+}
+
+
+/* extents handed to the backend at once */
+#define RA_EXTENTS	64
+
+void fat_readahead(fat_volume *vol, const struct fat_stat *st,
+		   struct fat_readahead *ra, uint32_t offset)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    struct io_extent ext[RA_EXTENTS];
+    double t = now();
+    uint32_t target;
+    int n = 0;
+
+    /* size the window from the rate since the last call */
+    if (offset > ra->last_offset && t > ra->last_time)
+    {
+	double want = (offset - ra->last_offset) / (t - ra->last_time) * RA_HORIZON;
+
+	if (want < RA_MIN)
+	    want = RA_MIN;
+	if (want > RA_MAX)
+	    want = RA_MAX;
+	ra->window = (uint32_t)want;
+    }
+    ra->last_offset = offset;
+    ra->last_time = t;
+
+    /* top up once the reader is halfway into what was requested */
+    if (ra->issued > offset + ra->window / 2)
+	return;
+    target = offset + ra->window;
+    if (target > st->size || target < offset)
+	target = st->size;
+
+    io_begin(&vol->io);
+    while (ra->issued < target && is_valid_cluster(ra->cluster, bpb))
+    {
+	size_t off = cluster_to_addr(ra->cluster, vol->image_buf, bpb) - vol->image_buf;
+
+	if (ra->issued >= offset)
+	{
+	    if (n == 0 || ext[n - 1].off + ext[n - 1].len != off)
+	    {
+		if (n == RA_EXTENTS)
+		{
+		    io_prefetch(&vol->io, ext, n);
+		    n = 0;
+		}
+		ext[n].off = off;
+		ext[n++].len = 0;
+	    }
+	    ext[n - 1].len += csize;
+	}
+	ra->issued += csize;
+	ra->cluster = get_fat_entry(ra->cluster, vol->image_buf, bpb);
+    }
+    if (n > 0)
+	io_prefetch(&vol->io, ext, n);
+    io_end(&vol->io);
+}
+
+
+/* set a FAT entry, noting the two bytes it lives in for io_flush; the
+   FAT is pinned, so this cannot fail */
+static void put_fat(fat_volume *vol, uint16_t cluster, uint16_t value)
+{
+    io_get(&vol->io, META_START(vol->bpb) + cluster + cluster / 2, 2, IO_WRITE | IO_FAT);
+    set_fat_entry(cluster, value, vol->image_buf, vol->bpb);
+}
+
+
+/* The clusters of whole chains to be freed, gathered first and then
+   cleared from the FAT in one sweep, so freeing many chains touches
+   each FAT sector once however the chains are scattered. */
+struct free_set
+{
+    uint64_t bits[4096 / 64];	/* FAT12 has < 4096 clusters */
+    uint16_t lo, hi;		/* the lowest and highest cluster in it */
+    uint32_t n;
+};
+
+static void set_init(struct free_set *set)
+{
+    memset(set->bits, 0, sizeof(set->bits));
+    set->lo = 0xFFFF;
+    set->hi = 0;
+    set->n = 0;
+}
+
+
+/* gather_chain adds the chain starting at cluster to set, walking it
+   once.  It stops at a cluster already there, so a chain that loops or
+   runs into one gathered before is not followed twice. */
+static void gather_chain(fat_volume *vol, struct free_set *set, uint16_t cluster)
+{
+    DOS_STAT(vol->bpb, chains_walked, 1);
+    while (is_valid_cluster(cluster, vol->bpb))
+    {
+	uint64_t bit = (uint64_t)1 << (cluster % 64);
+
+	if (set->bits[cluster / 64] & bit)
+	    break;
+	set->bits[cluster / 64] |= bit;
+	set->n++;
+	if (cluster < set->lo)
+	    set->lo = cluster;
+	if (cluster > set->hi)
+	    set->hi = cluster;
+	cluster = get_fat_entry(cluster, vol->image_buf, vol->bpb);
+    }
+}
+
+
+/* clear_set frees every cluster in set.  The entries are loaded for
+   writing a span at a time, a span running on until the next entry is
+   more than a sector further; then they are cleared in one sweep. */
+static void clear_set(fat_volume *vol, struct free_set *set)
+{
+    struct bpb33 *bpb = vol->bpb;
+    size_t start = 0, end = 0;
+    uint32_t w, c;
+
+    if (set->n == 0)
+	return;
+    for (w = set->lo / 64; w <= set->hi / 64; w++)
+    {
+	uint64_t bits = set->bits[w];
+
+	while (bits != 0)
+	{
+	    size_t off;
+
+	    c = w * 64 + __builtin_ctzll(bits);
+	    bits &= bits - 1;
+	    off = META_START(bpb) + c + c / 2;
+	    if (end != 0 && off > end + bpb->bpbBytesPerSec)
+	    {
+		io_get(&vol->io, start, end - start, IO_WRITE | IO_FAT);
+		end = 0;
+	    }
+	    if (end == 0)
+		start = off;
+	    end = off + 2;
+	}
+    }
+    io_get(&vol->io, start, end - start, IO_WRITE | IO_FAT);
+
+    for (w = set->lo / 64; w <= set->hi / 64; w++)
+    {
+	uint64_t bits = set->bits[w];
+
+	while (bits != 0)
+	{
+	    c = w * 64 + __builtin_ctzll(bits);
+	    bits &= bits - 1;
+	    set_fat_entry(c, CLUST_FREE, vol->image_buf, bpb);
+	}
+    }
+}
+
+
+/* free a whole chain */
+static void free_chain(fat_volume *vol, uint16_t cluster)
+{
+    struct free_set set;
+
+    set_init(&set);
+    gather_chain(vol, &set, cluster);
+    clear_set(vol, &set);
+}
+
+
+/* find a free cluster at or after *cursor, mark it as the end of a
+   chain and return it; 0 if the disk is full */
+static uint16_t alloc_cluster(fat_volume *vol, uint16_t *cursor)
+{
+    for (; *cursor < vol->limit; (*cursor)++)
+    {
+	if (get_fat_entry(*cursor, vol->image_buf, vol->bpb) == CLUST_FREE)
+	{
+	    put_fat(vol, *cursor, FAT12_MASK & CLUST_EOFS);
+	    return (*cursor)++;
+	}
+    }
+    return 0;
+}
+
+
+/* trim_chain makes tail the end of its chain, freeing what followed */
+static void trim_chain(fat_volume *vol, uint16_t tail)
+{
+    uint16_t next = get_fat_entry(tail, vol->image_buf, vol->bpb);
+
+    if (is_valid_cluster(next, vol->bpb))
+    {
+	put_fat(vol, tail, FAT12_MASK & CLUST_EOFS);
+	free_chain(vol, next);
+    }
+}
+
+
+/* a fill_fn puts the n bytes of new data from off at p; it is called
+   for each cluster in turn */
+typedef int (*fill_fn)(void *arg, uint8_t *p, uint32_t off, uint32_t n);
+
+/* fill from a buffer in memory */
+static int fill_buf(void *arg, uint8_t *p, uint32_t off, uint32_t n)
+{
+    memcpy(p, (const uint8_t *)arg + off, n);
+    return FAT_OK;
+}
+
+
+/* extend_chain writes len bytes from fill into new clusters chained on
+   after tail, or into a chain of their own if tail is 0, taking free
+   clusters from *cursor on so that they follow the tail where they can.
+   *first is the first new cluster.  If it fails the new clusters are
+   freed and tail ends its chain again. */
+static int extend_chain(fat_volume *vol, uint16_t tail, uint16_t *cursor,
+			uint32_t len, fill_fn fill, void *arg, uint16_t *first)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    uint16_t prev = tail, cluster;
+    uint32_t done;
+    int rv = FAT_OK;
+
+    *first = 0;
+    for (done = 0; done < len; done += csize)
+    {
+	uint32_t n = len - done < csize ? len - done : csize;
+	uint8_t *p;
+
+	cluster = alloc_cluster(vol, cursor);
+	if (cluster == 0 && *cursor >= vol->limit)
+	{
+	    /* nothing after the tail; look before it */
+	    *cursor = CLUST_FIRST;
+	    cluster = alloc_cluster(vol, cursor);
+	}
+	if (cluster == 0)
+	{
+	    rv = FAT_ENOSPC;
+	    break;
+	}
+	if (*first == 0)
+	    *first = cluster;
+	if (prev != 0)
+	    put_fat(vol, prev, cluster);
+	prev = cluster;
+
+	p = cluster_to_addr(cluster, vol->image_buf, bpb);
+	if (get_bytes(vol, p, csize, IO_OVERWRITE | IO_DATA) < 0)
+	{
+	    rv = FAT_EIO;
+	    break;
+	}
+	rv = fill(arg, p, done, n);
+	if (rv < 0)
+	    break;
+	memset(p + n, 0, csize - n);
+    }
+
+    if (rv < 0)
+    {
+	if (tail != 0)
+	    put_fat(vol, tail, FAT12_MASK & CLUST_EOFS);
+	free_chain(vol, *first);
+	*first = 0;
+    }
+    return rv;
+}
+
+
+/* find a free slot in a directory, growing a subdirectory by a cluster
+   if it is full.  *end is set to the end of the slot's cluster. */
+static int find_slot(fat_volume *vol, uint16_t cluster, uint16_t *cursor,
+		     struct direntry **slot, struct direntry **end)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t steps = 0;
+
+    while (1)
+    {
+	int per_cluster = cluster == MSDOSFSROOT
+	    ? bpb->bpbRootDirEnts : DIRENTS_PER_CLUSTER(bpb);
+	struct direntry *dirent =
+	    (struct direntry *)cluster_to_addr(cluster, vol->image_buf, bpb);
+	uint16_t next;
+	int i;
+
+	if (get_bytes(vol, dirent, per_cluster * sizeof(struct direntry), IO_READ) < 0)
+	    return FAT_EIO;
+	*end = dirent + per_cluster;
+	for (i = 0; i < per_cluster; i++, dirent++)
+	{
+	    DOS_STAT(bpb, dirents_scanned, 1);
+	    if (dirent->deName[0] == SLOT_EMPTY || dirent->deName[0] == SLOT_DELETED)
+	    {
+		*slot = dirent;
+		return FAT_OK;
+	    }
+	}
+
+	/* the root directory has a fixed size */
+	if (cluster == MSDOSFSROOT)
+	    return FAT_ENOSPC;
+
+	next = get_fat_entry(cluster, vol->image_buf, bpb);
+	if (is_end_of_file(next))
+	{
+	    uint8_t *p;
+
+	    next = alloc_cluster(vol, cursor);
+	    if (next == 0)
+		return FAT_ENOSPC;
+	    p = cluster_to_addr(next, vol->image_buf, bpb);
+	    if (get_bytes(vol, p, CLUSTER_SIZE(bpb), IO_OVERWRITE | IO_DIR) < 0)
+	    {
+		put_fat(vol, next, CLUST_FREE);
+		return FAT_EIO;
+	    }
+	    memset(p, 0, CLUSTER_SIZE(bpb));
+	    put_fat(vol, cluster, next);
+	}
+	else if (!is_valid_cluster(next, bpb) || ++steps >= vol->limit)
+	{
+	    return FAT_ECORRUPT;
+	}
+	cluster = next;
+    }
+}
+
+
+/* take_slot finds a free slot in the directory at cluster, holds it
+   locked and loads it for writing.  Taking the directory's end slot
+   holds the one after it too, which put_slot marks as the new end;
+   *len is the length held. */
+static int take_slot(fat_volume *vol, uint16_t cluster, uint16_t *cursor,
+		     struct direntry **slot, off_t *len)
+{
+    struct direntry *end;
+    off_t off;
+    int rv;
+
+    rv = find_slot(vol, cluster, cursor, slot, &end);
+    if (rv < 0)
+	return rv;
+    off = (uint8_t *)*slot - vol->image_buf;
+    *len = ((*slot)->deName[0] == SLOT_EMPTY && *slot + 1 < end ? 2 : 1)
+	* sizeof(struct direntry);
+    rv = hold_range(vol, F_WRLCK, off, *len);
+    if (rv == FAT_OK)
+    {
+	rv = io_get(&vol->io, off, *len, IO_WRITE | IO_DIR);
+	if (rv < 0)
+	    release_range(vol, F_WRLCK, off, *len);
+    }
+    return rv;
+}
+
+
+/* put_slot lets go of a slot filled in after take_slot */
+static void put_slot(fat_volume *vol, struct direntry *slot, off_t len)
+{
+    /* make sure the next dirent is set to be empty, just in case it
+       wasn't before */
+    if (len > sizeof(struct direntry))
+	memset(slot + 1, 0, sizeof(struct direntry));
+    release_range(vol, F_WRLCK, (uint8_t *)slot - vol->image_buf, len);
+}
+
+
+/* make_name turns the last component of path into a space padded 8.3
+   name, upper case and truncated the way DOS does it */
+static int make_name(const char *path, char *name, char *ext,
+		     const char **basep)
+{
+    const char *base = path, *p, *dot;
+    int i;
+
+    for (p = path; *p != '\0'; p++)
+	if (*p == '/' || *p == '\\')
+	    base = p + 1;
+    *basep = base;
+
+    dot = strchr(base, '.');
+    if (*base == '\0' || dot == base)
+	return FAT_EINVAL;
+
+    memset(name, ' ', 8);
+    memset(ext, ' ', 3);
+    for (i = 0; i < 8 && base + i != dot && base[i] != '\0'; i++)
+	name[i] = toupper((unsigned char)base[i]);
+    if (dot != NULL)
+	for (i = 0; i < 3 && dot[i + 1] != '\0'; i++)
+	    ext[i] = toupper((unsigned char)dot[i + 1]);
+    return FAT_OK;
+}
+
+
+/* the directory holding the last component of path, which make_name
+   has found at base */
+static int parent_dir(fat_volume *vol, const char *path, const char *base,
+		      char *dirpath, struct fat_stat *dirst)
+{
+    int rv;
+
+    if (base - path >= MAXPATHLEN)
+	return FAT_EINVAL;
+    memcpy(dirpath, path, base - path);
+    dirpath[base - path] = '\0';
+    rv = fat_lookup(vol, dirpath, dirst);
+    if (rv == FAT_OK && !dirst->is_dir)
+	rv = FAT_ENOTDIR;
+    return rv;
+}
+
+
+/* lookup_short looks in dirpath for the space padded 8.3 name, the way
+   a name given longer was cut down to it */
+static int lookup_short(fat_volume *vol, const char *dirpath, const char *name,
+			const char *ext, struct direntry **dep)
+{
+    char base[9], suffix[4], shortpath[MAXPATHLEN];
+
+    memcpy(base, name, 8);
+    memcpy(suffix, ext, 3);
+    base[8] = suffix[3] = '\0';
+    base[strcspn(base, " ")] = '\0';
+    suffix[strcspn(suffix, " ")] = '\0';
+    if (snprintf(shortpath, sizeof(shortpath), "%s/%s%s%s", dirpath, base,
+		 suffix[0] != '\0' ? "." : "", suffix) >= sizeof(shortpath))
+	return FAT_EINVAL;
+    return lookup(vol, shortpath, dep);
+}
+
+
+/* new_name makes the 8.3 name for path, which must not name anything
+   yet; *dirst is the directory it goes in */
+static int new_name(fat_volume *vol, const char *path, char *name, char *ext,
+		    struct fat_stat *dirst)
+{
+    char dirpath[MAXPATHLEN];
+    const char *base;
+    struct direntry *dirent;
+    int rv;
+
+    rv = make_name(path, name, ext, &base);
+    if (rv == FAT_OK)
+	rv = parent_dir(vol, path, base, dirpath, dirst);
+    if (rv < 0)
+	return rv;
+
+    /* it must not exist under its 8.3 name */
+    rv = lookup_short(vol, dirpath, name, ext, &dirent);
+    if (rv == FAT_OK)
+	return FAT_EEXIST;
+    return rv == FAT_ENOENT ? FAT_OK : rv;
+}
+
+
+/* create_file creates path holding len bytes from fill, in clusters
+   taken from cursor on.  The data and its FAT chain are written before
+   the directory entry that makes them reachable, and only the slots
+   being filled are locked. */
+static int create_file(fat_volume *vol, const char *path, uint32_t len,
+		       fill_fn fill, void *arg, uint16_t cursor,
+		       struct fat_stat *st)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    char name[8], ext[3];
+    struct direntry *slot;
+    struct fat_stat dirst;
+    struct dos_free space;
+    uint16_t start;
+    off_t slot_len;
+    int rv;
+
+    rv = new_name(vol, path, name, ext, &dirst);
+    if (rv < 0)
+	return rv;
+
+    /* refuse what cannot fit before anything is allocated */
+    dos_free_space(vol->image_buf, bpb, &space);
+    if ((len + csize - 1) / csize > space.clusters)
+	return FAT_ENOSPC;
+
+    /* data first */
+    rv = extend_chain(vol, 0, &cursor, len, fill, arg, &start);
+    if (rv < 0)
+	return rv;
+
+    /* then the entry */
+    rv = take_slot(vol, dirst.cluster, &cursor, &slot, &slot_len);
+    if (rv < 0)
+    {
+	free_chain(vol, start);
+	return rv;
+    }
+    memset(slot, 0, sizeof(struct direntry));
+    memcpy(slot->deName, name, 8);
+    memcpy(slot->deExtension, ext, 3);
+    slot->deAttributes = ATTR_NORMAL;
+    putushort(slot->deStartCluster, start);
+    putulong(slot->deFileSize, len);
+    put_slot(vol, slot, slot_len);
+
+    DOS_STAT(bpb, bytes_written, len);
+    if (st != NULL)
+	dirent_to_stat(vol, slot, st);
+    return FAT_OK;
+}
+
+
+/* write_file creates path holding the len bytes at buf */
+static int write_file(fat_volume *vol, const char *path, const void *buf,
+		      uint32_t len, struct fat_stat *st)
+{
+    return create_file(vol, path, len, fill_buf, (void *)buf, CLUST_FIRST, st);
+}
+
+
+/* fat_write holds the FAT exclusive while it allocates, so two
+   writers never pick the same free cluster */
+int fat_write(fat_volume *vol, const char *path, const void *buf,
+	      uint32_t len, struct fat_stat *st)
+{
+    int rv;
+
+    if (!vol->writable)
+	return FAT_EROFS;
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_WRLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = write_file(vol, path, buf, len, st);
+    if (rv == FAT_OK)
+	rv = io_flush(&vol->io);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* append_file adds len bytes at buf to the end of the file at path,
+   creating it if there is none.  The slack in the last cluster is
+   filled first and the rest goes in clusters after the tail.  The
+   entry's size changes last, in one write, so until then the file
+   reads as it was.  Only the FAT is walked to find the tail; the data
+   already there is not read. */
+static int append_file(fat_volume *vol, const char *path, const void *buf,
+		       uint32_t len, struct fat_stat *st)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    struct direntry *dirent;
+    struct dos_free space;
+    struct fat_stat fst;
+    uint16_t tail = 0, cursor = CLUST_FIRST, first;
+    uint32_t slack = 0, n, i;
+    int rv;
+
+    rv = lookup(vol, path, &dirent);
+    if (rv == FAT_ENOENT)
+	return write_file(vol, path, buf, len, st);
+    if (rv < 0)
+	return rv;
+    if (dirent == NULL)
+	return FAT_EISDIR;
+    dirent_to_stat(vol, dirent, &fst);
+    if (fst.is_dir)
+	return FAT_EISDIR;
+    if (len > UINT32_MAX - fst.size)
+	return FAT_ENOSPC;
+
+    /* the tail, and the room left in it */
+    if (fst.cluster != 0)
+    {
+	uint32_t clusters = fst.size ? (fst.size + csize - 1) / csize : 1;
+
+	DOS_STAT(bpb, chains_walked, 1);
+	tail = fst.cluster;
+	for (i = 1; i < clusters && is_valid_cluster(tail, bpb); i++)
+	    tail = get_fat_entry(tail, vol->image_buf, bpb);
+	if (!is_valid_cluster(tail, bpb))
+	    return FAT_ECORRUPT;
+	slack = clusters * csize - fst.size;
+	cursor = tail + 1;
+    }
+    else if (fst.size != 0)
+	return FAT_ECORRUPT;
+
+    dos_free_space(vol->image_buf, bpb, &space);
+    if (len > slack && (len - slack + csize - 1) / csize > space.clusters)
+	return FAT_ENOSPC;
+
+    rv = hold_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    if (rv < 0)
+	return rv;
+
+    /* fill the slack */
+    n = len < slack ? len : slack;
+    if (n > 0)
+    {
+	uint8_t *p = cluster_to_addr(tail, vol->image_buf, bpb) + csize - slack;
+
+	rv = get_bytes(vol, p, n, IO_WRITE | IO_DATA);
+	if (rv < 0)
+	    goto out;
+	memcpy(p, buf, n);
+    }
+
+    /* then new clusters after the tail, dropping any a crash left
+       chained on past the size */
+    first = 0;
+    if (len > n)
+    {
+	if (tail != 0)
+	    trim_chain(vol, tail);
+	rv = extend_chain(vol, tail, &cursor, len - n, fill_buf,
+			  (uint8_t *)buf + n, &first);
+	if (rv < 0)
+	    goto out;
+    }
+
+    /* and last the entry */
+    rv = get_bytes(vol, dirent, sizeof(struct direntry), IO_WRITE | IO_DIR);
+    if (rv < 0)
+    {
+	if (first != 0)
+	{
+	    if (tail != 0)
+		put_fat(vol, tail, FAT12_MASK & CLUST_EOFS);
+	    free_chain(vol, first);
+	}
+	goto out;
+    }
+    if (tail == 0)
+	putushort(dirent->deStartCluster, first);
+    putulong(dirent->deFileSize, fst.size + len);
+    DOS_STAT(bpb, bytes_written, len);
+    if (st != NULL)
+	dirent_to_stat(vol, dirent, st);
+
+out:
+    release_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    return rv;
+}
+
+
+/* fat_append holds the FAT exclusive, as fat_write does, and the
+   file's entry too, so no reader sees the chain half grown */
+int fat_append(fat_volume *vol, const char *path, const void *buf,
+	       uint32_t len, struct fat_stat *st)
+{
+    int rv;
+
+    if (!vol->writable)
+	return FAT_EROFS;
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_WRLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = append_file(vol, path, buf, len, st);
+    if (rv == FAT_OK)
+	rv = io_flush(&vol->io);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* rewrite_bytes makes the n bytes at p hold src, writing only the span
+   that differs; it returns the bytes written */
+static ssize_t rewrite_bytes(fat_volume *vol, uint8_t *p, const uint8_t *src,
+			     uint32_t n)
+{
+    uint32_t lo, hi;
+
+    if (get_bytes(vol, p, n, IO_READ) < 0)
+	return FAT_EIO;
+    if (memcmp(p, src, n) == 0)
+	return 0;
+    for (lo = 0; p[lo] == src[lo]; lo++)
+	;
+    for (hi = n; p[hi - 1] == src[hi - 1]; hi--)
+	;
+    if (get_bytes(vol, p + lo, hi - lo, IO_WRITE | IO_DATA) < 0)
+	return FAT_EIO;
+    memcpy(p + lo, src + lo, hi - lo);
+    return hi - lo;
+}
+
+
+/* overwrite_file replaces the contents of the file at path with the len
+   bytes at buf, creating it if there is none.  The clusters it has are
+   reused in order and only the bytes that change are written, so a
+   small edit to a large file dirties a page or two; clusters are only
+   allocated or freed at the tail.  An empty result gives back the whole
+   chain and leaves start cluster 0, as a freshly created empty file
+   has.  A crash part way leaves a mix of old and new contents. */
+static int overwrite_file(fat_volume *vol, const char *path, const void *buf,
+			  uint32_t len, struct fat_stat *st)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    struct direntry *dirent;
+    struct dos_free space;
+    struct fat_stat fst;
+    uint16_t cluster, tail = 0, cursor = CLUST_FIRST, first = 0;
+    uint32_t have = 0, want = (len + csize - 1) / csize, done = 0, i;
+    size_t written = 0;
+    ssize_t n;
+    int rv;
+
+    rv = lookup(vol, path, &dirent);
+    if (rv == FAT_ENOENT)
+	return write_file(vol, path, buf, len, st);
+    if (rv < 0)
+	return rv;
+    if (dirent == NULL)
+	return FAT_EISDIR;
+    dirent_to_stat(vol, dirent, &fst);
+    if (fst.is_dir)
+	return FAT_EISDIR;
+    if (fst.cluster != 0)
+	have = fst.size ? (fst.size + csize - 1) / csize : 1;
+    else if (fst.size != 0)
+	return FAT_ECORRUPT;
+
+    dos_free_space(vol->image_buf, bpb, &space);
+    if (want > have && want - have > space.clusters)
+	return FAT_ENOSPC;
+
+    rv = hold_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    if (rv < 0)
+	return rv;
+
+    /* the clusters it keeps */
+    DOS_STAT(bpb, chains_walked, 1);
+    cluster = fst.cluster;
+    for (i = 0; i < have && i < want; i++, done += csize)
+    {
+	if (!is_valid_cluster(cluster, bpb))
+	{
+	    rv = FAT_ECORRUPT;
+	    goto out;
+	}
+	n = rewrite_bytes(vol, cluster_to_addr(cluster, vol->image_buf, bpb),
+			  (const uint8_t *)buf + done,
+			  len - done < csize ? len - done : csize);
+	if (n < 0)
+	{
+	    rv = n;
+	    goto out;
+	}
+	written += n;
+	tail = cluster;
+	cluster = get_fat_entry(cluster, vol->image_buf, bpb);
+    }
+
+    /* then the difference at the tail: new clusters go in before the
+       entry that reaches them, freed ones only after the smaller entry
+       is out, so a crash between leaves lost clusters either way.
+       Anything chained on past the old size is dropped first. */
+    if (want >= have && tail != 0)
+	trim_chain(vol, tail);
+    if (want > have)
+    {
+	if (tail != 0)
+	    cursor = tail + 1;
+	rv = extend_chain(vol, tail, &cursor, len - done, fill_buf,
+			  (uint8_t *)buf + done, &first);
+	if (rv < 0)
+	    goto out;
+	written += len - done;
+    }
+
+    rv = get_bytes(vol, dirent, sizeof(struct direntry), IO_WRITE | IO_DIR);
+    if (rv < 0)
+	goto out;
+    if (want == 0)
+	putushort(dirent->deStartCluster, 0);
+    else if (have == 0)
+	putushort(dirent->deStartCluster, first);
+    putulong(dirent->deFileSize, len);
+    DOS_STAT(bpb, bytes_written, written);
+    if (st != NULL)
+	dirent_to_stat(vol, dirent, st);
+
+    if (want < have)
+    {
+	rv = io_flush(&vol->io);
+	if (rv < 0)
+	    goto out;
+	if (tail != 0)
+	    trim_chain(vol, tail);
+	else
+	    free_chain(vol, fst.cluster);
+    }
+
+out:
+    release_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    return rv;
+}
+
+
+/* fat_overwrite locks as fat_append does */
+int fat_overwrite(fat_volume *vol, const char *path, const void *buf,
+		  uint32_t len, struct fat_stat *st)
+{
+    int rv;
+
+    if (!vol->writable)
+	return FAT_EROFS;
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_WRLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = overwrite_file(vol, path, buf, len, st);
+    if (rv == FAT_OK)
+	rv = io_flush(&vol->io);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* ---------- renaming ---------- */
+
+/* the ".." entry of the directory starting at cluster, or NULL if it
+   has none where it should be */
+static struct direntry *dotdot(fat_volume *vol, uint16_t cluster)
+{
+    struct direntry *dirent =
+	(struct direntry *)cluster_to_addr(cluster, vol->image_buf, vol->bpb) + 1;
+
+    if (get_bytes(vol, dirent, sizeof(struct direntry), IO_READ) < 0
+	|| dirent->deName[0] != '.' || dirent->deName[1] != '.')
+	return NULL;
+    return dirent;
+}
+
+
+/* a directory may not go inside itself: climb from where it would go
+   to the root by way of ".." */
+static int inside(fat_volume *vol, uint16_t dir, uint16_t cluster)
+{
+    uint32_t steps = 0;
+
+    while (cluster != MSDOSFSROOT)
+    {
+	struct direntry *up;
+
+	if (cluster == dir)
+	    return TRUE;
+	if (!is_valid_cluster(cluster, vol->bpb) || ++steps >= vol->limit
+	    || (up = dotdot(vol, cluster)) == NULL)
+	    return TRUE;	/* cannot tell, so refuse */
+	cluster = getushort(up->deStartCluster);
+    }
+    return FALSE;
+}
+
+
+/* rename_file gives the entry at from the name and directory of to, or
+   puts it in to under its own name if to is a directory.  No data or
+   FAT entry changes: in the same directory the name is rewritten in
+   place, otherwise the entry is copied into a slot in the new
+   directory before the old one is deleted, so a crash between the two
+   leaves it in both rather than neither.  A directory's ".." is
+   pointed at its new parent. */
+static int rename_file(fat_volume *vol, const char *from, const char *to,
+		       struct fat_stat *st)
+{
+    char name[8], ext[3], dirpath[MAXPATHLEN];
+    const char *base;
+    struct direntry *src, *dst, *slot, *up;
+    struct fat_stat sst, fromdir, todir;
+    uint16_t cursor = CLUST_FIRST;
+    off_t src_off, slot_len;
+    int rv;
+
+    /* what moves, and where from */
+    rv = lookup(vol, from, &src);
+    if (rv < 0)
+	return rv;
+    if (src == NULL)
+	return FAT_EINVAL;	/* the root */
+    dirent_to_stat(vol, src, &sst);
+    rv = make_name(from, name, ext, &base);
+    if (rv == FAT_OK)
+	rv = parent_dir(vol, from, base, dirpath, &fromdir);
+    if (rv < 0)
+	return rv;
+
+    /* where to, and as what */
+    rv = lookup(vol, to, &dst);
+    if (rv == FAT_OK && dst == src)
+	goto done;
+    if (rv == FAT_OK && dst != NULL && !(dst->deAttributes & ATTR_DIRECTORY))
+	return FAT_EEXIST;
+    if (rv == FAT_OK)
+    {
+	/* into the directory, keeping the name */
+	rv = fat_lookup(vol, to, &todir);
+	if (rv < 0)
+	    return rv;
+	memcpy(name, src->deName, 8);
+	memcpy(ext, src->deExtension, 3);
+	dirpath[0] = '\0';
+	strncat(dirpath, to, MAXPATHLEN - 1);
+    }
+    else if (rv == FAT_ENOENT)
+    {
+	rv = make_name(to, name, ext, &base);
+	if (rv == FAT_OK)
+	    rv = parent_dir(vol, to, base, dirpath, &todir);
+	if (rv < 0)
+	    return rv;
+    }
+    else
+	return rv;
+
+    /* its 8.3 name must be free there */
+    rv = lookup_short(vol, dirpath, name, ext, &dst);
+    if (rv == FAT_OK && dst == src)
+	goto done;
+    if (rv == FAT_OK)
+	return FAT_EEXIST;
+    if (rv != FAT_ENOENT)
+	return rv;
+    if (sst.is_dir && todir.cluster != fromdir.cluster
+	&& inside(vol, sst.cluster, todir.cluster))
+	return FAT_EINVAL;
+
+    src_off = (uint8_t *)src - vol->image_buf;
+    if (todir.cluster == fromdir.cluster)
+    {
+	rv = hold_range(vol, F_WRLCK, src_off, sizeof(struct direntry));
+	if (rv < 0)
+	    return rv;
+	rv = get_bytes(vol, src, sizeof(struct direntry), IO_WRITE | IO_DIR);
+	if (rv == FAT_OK)
+	{
+	    memcpy(src->deName, name, 8);
+	    memcpy(src->deExtension, ext, 3);
+	}
+	release_range(vol, F_WRLCK, src_off, sizeof(struct direntry));
+	if (rv < 0)
+	    return rv;
+	dst = src;
+	goto done;
+    }
+
+    /* the new entry first */
+    rv = take_slot(vol, todir.cluster, &cursor, &slot, &slot_len);
+    if (rv < 0)
+	return rv;
+    memcpy(slot, src, sizeof(struct direntry));
+    memcpy(slot->deName, name, 8);
+    memcpy(slot->deExtension, ext, 3);
+    put_slot(vol, slot, slot_len);
+    dst = slot;
+
+    /* then the old one goes */
+    rv = hold_range(vol, F_WRLCK, src_off, sizeof(struct direntry));
+    if (rv < 0)
+	return rv;
+    rv = get_bytes(vol, src, sizeof(struct direntry), IO_WRITE | IO_DIR);
+    if (rv == FAT_OK)
+	src->deName[0] = SLOT_DELETED;
+    release_range(vol, F_WRLCK, src_off, sizeof(struct direntry));
+    if (rv < 0)
+	return rv;
+
+    if (sst.is_dir && is_valid_cluster(sst.cluster, vol->bpb)
+	&& (up = dotdot(vol, sst.cluster)) != NULL)
+    {
+	off_t up_off = (uint8_t *)up - vol->image_buf;
+
+	rv = hold_range(vol, F_WRLCK, up_off, sizeof(struct direntry));
+	if (rv < 0)
+	    return rv;
+	rv = get_bytes(vol, up, sizeof(struct direntry), IO_WRITE | IO_DIR);
+	if (rv == FAT_OK)
+	    putushort(up->deStartCluster, todir.cluster);
+	release_range(vol, F_WRLCK, up_off, sizeof(struct direntry));
+	if (rv < 0)
+	    return rv;
+    }
+
+done:
+    if (st != NULL)
+	dirent_to_stat(vol, dst, st);
+    return FAT_OK;
+}
+
+
+/* fat_rename holds the FAT exclusive, since a full directory may need
+   another cluster for the new entry */
+int fat_rename(fat_volume *vol, const char *from, const char *to,
+	       struct fat_stat *st)
+{
+    int rv;
+
+    if (!vol->writable)
+	return FAT_EROFS;
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_WRLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = rename_file(vol, from, to, st);
+    if (rv == FAT_OK)
+	rv = io_flush(&vol->io);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* ---------- directories and copies between images ---------- */
+
+/* make_dir creates an empty directory at path, holding just "." and
+   ".." */
+static int make_dir(fat_volume *vol, const char *path, struct fat_stat *st)
+{
+    struct bpb33 *bpb = vol->bpb;
+    char name[8], ext[3];
+    struct direntry *dot, *slot;
+    struct fat_stat dirst;
+    uint16_t cursor = CLUST_FIRST, cluster;
+    off_t slot_len;
+    int rv, i;
+
+    rv = new_name(vol, path, name, ext, &dirst);
+    if (rv < 0)
+	return rv;
+
+    cluster = alloc_cluster(vol, &cursor);
+    if (cluster == 0)
+	return FAT_ENOSPC;
+    dot = (struct direntry *)cluster_to_addr(cluster, vol->image_buf, bpb);
+    if (get_bytes(vol, dot, CLUSTER_SIZE(bpb), IO_OVERWRITE | IO_DIR) < 0)
+    {
+	put_fat(vol, cluster, CLUST_FREE);
+	return FAT_EIO;
+    }
+    memset(dot, 0, CLUSTER_SIZE(bpb));
+    for (i = 0; i < 2; i++)
+    {
+	memset(dot[i].deName, ' ', 8);
+	memset(dot[i].deExtension, ' ', 3);
+	memset(dot[i].deName, '.', i + 1);
+	dot[i].deAttributes = ATTR_DIRECTORY;
+    }
+    putushort(dot[0].deStartCluster, cluster);
+    putushort(dot[1].deStartCluster, dirst.cluster);
+
+    rv = take_slot(vol, dirst.cluster, &cursor, &slot, &slot_len);
+    if (rv < 0)
+    {
+	put_fat(vol, cluster, CLUST_FREE);
+	return rv;
+    }
+    memset(slot, 0, sizeof(struct direntry));
+    memcpy(slot->deName, name, 8);
+    memcpy(slot->deExtension, ext, 3);
+    slot->deAttributes = ATTR_DIRECTORY;
+    putushort(slot->deStartCluster, cluster);
+    put_slot(vol, slot, slot_len);
+
+    if (st != NULL)
+	dirent_to_stat(vol, slot, st);
+    return FAT_OK;
+}
+
+
+int fat_mkdir(fat_volume *vol, const char *path, struct fat_stat *st)
+{
+    int rv;
+
+    if (!vol->writable)
+	return FAT_EROFS;
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_WRLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = make_dir(vol, path, st);
+    if (rv == FAT_OK)
+	rv = io_flush(&vol->io);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv;
+}
+
+
+/* the first cluster of the first free run at least n clusters long,
+   or of the longest run if none is */
+static uint16_t fit_run(fat_volume *vol, uint32_t n)
+{
+    uint16_t c, run, best = CLUST_FIRST, best_len = 0;
+
+    for (c = CLUST_FIRST; c < vol->limit; c += run ? run : 1)
+    {
+	for (run = 0; c + run < vol->limit
+		 && get_fat_entry(c + run, vol->image_buf, vol->bpb) == CLUST_FREE; run++)
+	    ;
+	if (run >= n)
+	    return c;
+	if (run > best_len)
+	{
+	    best = c;
+	    best_len = run;
+	}
+    }
+    return best;
+}
+
+
+/* where a copy has got to in the source file's chain; the other image
+   is filled cluster by cluster straight from this one's buffer */
+struct copy_src
+{
+    fat_volume *vol;
+    uint16_t cluster;		/* the cluster holding pos */
+    uint32_t pos;
+};
+
+static int fill_copy(void *arg, uint8_t *p, uint32_t off, uint32_t n)
+{
+    struct copy_src *from = arg;
+    struct bpb33 *bpb = from->vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+
+    while (n > 0)
+    {
+	uint32_t in = from->pos % csize, k = csize - in;
+	uint8_t *q;
+
+	if (k > n)
+	    k = n;
+	if (!is_valid_cluster(from->cluster, bpb))
+	    return FAT_ECORRUPT;
+	q = cluster_to_addr(from->cluster, from->vol->image_buf, bpb) + in;
+	if (get_bytes(from->vol, q, k, IO_READ) < 0)
+	    return FAT_EIO;
+	memcpy(p, q, k);
+	p += k;
+	n -= k;
+	from->pos += k;
+	if (from->pos % csize == 0)
+	    from->cluster = get_fat_entry(from->cluster, from->vol->image_buf, bpb);
+    }
+    return FAT_OK;
+}
+
+
+/* fat_copy holds the source file shared and the destination's FAT
+   exclusive, and puts the copy in the first free run it fits */
+int fat_copy(fat_volume *src, const struct fat_stat *sst, fat_volume *dst,
+	     const char *to, struct fat_stat *st)
+{
+    uint32_t csize = CLUSTER_SIZE(dst->bpb);
+    struct copy_src from;
+    int rv;
+
+    if (sst->is_dir)
+	return FAT_EISDIR;
+    if (!dst->writable)
+	return FAT_EROFS;
+    io_begin(&src->io);
+    rv = fat_hold_file(src, sst);
+    if (rv < 0)
+    {
+	io_end(&src->io);
+	return rv;
+    }
+    io_begin(&dst->io);
+    rv = hold_meta(dst, F_WRLCK);
+    if (rv == FAT_OK)
+    {
+	from.vol = src;
+	from.cluster = sst->cluster;
+	from.pos = 0;
+	DOS_STAT(src->bpb, chains_walked, 1);
+	rv = create_file(dst, to, sst->size, fill_copy, &from,
+			 fit_run(dst, (sst->size + csize - 1) / csize), st);
+	if (rv == FAT_OK)
+	{
+	    DOS_STAT(src->bpb, bytes_read, sst->size);
+	    rv = io_flush(&dst->io);
+	}
+	release_meta(dst, F_WRLCK);
+    }
+    io_end(&dst->io);
+    fat_release_file(src, sst);
+    io_end(&src->io);
+    return rv;
+}
+
+
+/* ---------- removing and truncating ---------- */
+
+/* gather_dir adds a directory's clusters to set, and with recursive
+   everything below it too; without, a directory with anything in it
+   is FAT_ENOTEMPTY.  Its own chain goes in first, so a subdirectory
+   that leads back up is caught instead of followed for ever. */
+static int gather_dir(fat_volume *vol, struct free_set *set, uint16_t cluster,
+		      int recursive)
+{
+    struct fat_dir dir;
+    struct direntry *dirent;
+    struct fat_stat st;
+    int rv;
+
+    if (!is_valid_cluster(cluster, vol->bpb))
+	return FAT_ECORRUPT;
+    gather_chain(vol, set, cluster);
+    dir_start(vol, cluster, &dir);
+    while ((rv = dir_next(&dir, &dirent)) > 0)
+    {
+	if (skip_dirent(dirent))
+	    continue;
+	if (!recursive)
+	    return FAT_ENOTEMPTY;
+	dirent_to_stat(vol, dirent, &st);
+	if (!st.is_dir)
+	    gather_chain(vol, set, st.cluster);
+	else if (is_valid_cluster(st.cluster, vol->bpb)
+		 && (set->bits[st.cluster / 64] & ((uint64_t)1 << (st.cluster % 64))))
+	    return FAT_ECORRUPT;
+	else if ((rv = gather_dir(vol, set, st.cluster, TRUE)) < 0)
+	    return rv;
+    }
+    return rv;
+}
+
+
+/* merge_set adds the clusters of add to set */
+static void merge_set(struct free_set *set, const struct free_set *add)
+{
+    uint32_t w;
+
+    if (add->n == 0)
+	return;
+    for (w = add->lo / 64; w <= add->hi / 64; w++)
+    {
+	set->n += __builtin_popcountll(add->bits[w] & ~set->bits[w]);
+	set->bits[w] |= add->bits[w];
+    }
+    if (add->lo < set->lo)
+	set->lo = add->lo;
+    if (add->hi > set->hi)
+	set->hi = add->hi;
+}
+
+
+/* remove_file deletes the entry at path and adds its chain, or for a
+   directory every chain below it, to set for the caller to free.  The
+   entry is left held at *entry for the caller to release after the
+   flush, since releasing it flushes.  A path that fails adds nothing
+   and holds nothing.  The entries inside a removed directory are left
+   as they were in its clusters, which are free. */
+static int remove_file(fat_volume *vol, const char *path, int recursive,
+		       struct free_set *set, off_t *entry)
+{
+    struct direntry *dirent;
+    struct free_set mine;
+    struct fat_stat fst;
+    int rv;
+
+    rv = lookup(vol, path, &dirent);
+    if (rv < 0)
+	return rv;
+    if (dirent == NULL)
+	return FAT_EINVAL;	/* the root */
+    dirent_to_stat(vol, dirent, &fst);
+
+    set_init(&mine);
+    if (fst.is_dir)
+	rv = gather_dir(vol, &mine, fst.cluster, recursive);
+    else
+	gather_chain(vol, &mine, fst.cluster);
+    if (rv < 0)
+	return rv;
+
+    rv = hold_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    if (rv < 0)
+	return rv;
+    rv = get_bytes(vol, dirent, sizeof(struct direntry), IO_WRITE | IO_DIR);
+    if (rv < 0)
+    {
+	release_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+	return rv;
+    }
+    dirent->deName[0] = SLOT_DELETED;
+    merge_set(set, &mine);
+    *entry = fst.entry;
+    return FAT_OK;
+}
+
+
+/* fat_remove_paths holds the FAT exclusive, and each entry too while
+   it is deleted, so nobody reading a file sees its clusters go.  Every
+   path's chains are gathered first and freed in one sweep; the entries
+   are flushed before the sweep and the FAT after it, whatever the
+   number of paths.  A path given twice, or inside a directory removed before it,
+   is FAT_ENOENT like any other missing one. */
+int fat_remove_paths(fat_volume *vol, char *const *paths, int n,
+		     int recursive, int *results)
+{
+    struct free_set set;
+    off_t *held;
+    int rv, i, first = FAT_OK, removed = 0;
+
+    held = malloc((n > 0 ? n : 1) * sizeof(off_t));
+    if (held == NULL)
+	rv = FAT_ENOMEM;
+    else if (!vol->writable)
+	rv = FAT_EROFS;
+    else
+    {
+	io_begin(&vol->io);
+	rv = hold_meta(vol, F_WRLCK);
+	if (rv < 0)
+	    io_end(&vol->io);
+    }
+    if (rv < 0)
+    {
+	for (i = 0; results != NULL && i < n; i++)
+	    results[i] = rv;
+	free(held);
+	return rv;
+    }
+
+    set_init(&set);
+    for (i = 0; i < n; i++)
+    {
+	rv = remove_file(vol, paths[i], recursive, &set, &held[removed]);
+	if (results != NULL)
+	    results[i] = rv;
+	if (rv == FAT_OK)
+	    removed++;
+	else if (first == FAT_OK)
+	    first = rv;
+    }
+    /* the entries go out before their clusters are freed */
+    rv = FAT_OK;
+    if (removed > 0)
+	rv = io_flush(&vol->io);
+    if (rv == FAT_OK && removed > 0)
+    {
+	clear_set(vol, &set);
+	rv = io_flush(&vol->io);
+    }
+    for (i = 0; i < removed; i++)
+	release_range(vol, F_WRLCK, held[i], sizeof(struct direntry));
+    free(held);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv < 0 ? rv : first;
+}
+
+
+int fat_remove(fat_volume *vol, const char *path, int recursive)
+{
+    char *paths[1];
+
+    paths[0] = (char *)path;
+    return fat_remove_paths(vol, paths, 1, recursive, NULL);
+}
+
+
+/* truncate_file cuts the file at path down to size bytes, freeing the
+   clusters past the new end in one sweep */
+static int truncate_file(fat_volume *vol, const char *path, uint32_t size,
+			 struct fat_stat *st)
+{
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t csize = CLUSTER_SIZE(bpb);
+    uint32_t keep = (size + csize - 1) / csize, i;
+    struct direntry *dirent;
+    struct free_set set;
+    struct fat_stat fst;
+    uint16_t tail = 0;
+    int rv;
+
+    rv = lookup(vol, path, &dirent);
+    if (rv < 0)
+	return rv;
+    if (dirent == NULL)
+	return FAT_EISDIR;
+    dirent_to_stat(vol, dirent, &fst);
+    if (fst.is_dir)
+	return FAT_EISDIR;
+    if (size > fst.size)
+	return FAT_EINVAL;
+
+    /* the new last cluster */
+    set_init(&set);
+    if (keep > 0)
+    {
+	DOS_STAT(bpb, chains_walked, 1);
+	tail = fst.cluster;
+	for (i = 1; i < keep && is_valid_cluster(tail, bpb); i++)
+	    tail = get_fat_entry(tail, vol->image_buf, bpb);
+	if (!is_valid_cluster(tail, bpb))
+	    return FAT_ECORRUPT;
+	gather_chain(vol, &set, get_fat_entry(tail, vol->image_buf, bpb));
+    }
+    else
+	gather_chain(vol, &set, fst.cluster);
+
+    rv = hold_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    if (rv < 0)
+	return rv;
+    rv = get_bytes(vol, dirent, sizeof(struct direntry), IO_WRITE | IO_DIR);
+    if (rv == FAT_OK)
+    {
+	if (keep == 0)
+	    putushort(dirent->deStartCluster, 0);
+	putulong(dirent->deFileSize, size);
+	if (st != NULL)
+	    dirent_to_stat(vol, dirent, st);
+	/* the entry goes out before the clusters are freed, so a crash
+	   between leaves lost clusters rather than a file on free ones */
+	if (set.n > 0)
+	    rv = io_flush(&vol->io);
+    }
+    if (rv == FAT_OK && set.n > 0)
+    {
+	if (tail != 0)
+	    put_fat(vol, tail, FAT12_MASK & CLUST_EOFS);
+	clear_set(vol, &set);
+    }
+    release_range(vol, F_WRLCK, fst.entry, sizeof(struct direntry));
+    return rv;
+}
+
+
+int fat_truncate(fat_volume *vol, const char *path, uint32_t size,
+		 struct fat_stat *st)
+{
+    int rv;
+
+    if (!vol->writable)
+	return FAT_EROFS;
+    io_begin(&vol->io);
+    rv = hold_meta(vol, F_WRLCK);
+    if (rv < 0)
+    {
+	io_end(&vol->io);
+	return rv;
+    }
+    rv = truncate_file(vol, path, size, st);
+    if (rv == FAT_OK)
+	rv = io_flush(&vol->io);
+    release_meta(vol, F_WRLCK);
+    io_end(&vol->io);
+    return rv;
+}
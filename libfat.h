@@ -0,0 +1,271 @@
+#ifndef __LIBFAT_H__
+#define __LIBFAT_H__
+
+/* libfat: access to FAT-12 disk images for tools and long-running
+   services.  There is no global state: everything hangs off a
+   fat_volume, and separate volumes can be used from separate threads.
+   Functions return FAT_OK (or a count) on success and a negative
+   FAT_E* code on failure; nothing exits, and nothing prints outside
+   DEBUG builds. */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#include "dos.h"
+
+/* error codes */
+#define FAT_OK		0
+#define FAT_EIO		(-1)	/* a system call failed; errno says why */
+#define FAT_EBADFS	(-2)	/* not a usable FAT-12 image */
+#define FAT_ENOENT	(-3)	/* no such file or directory */
+#define FAT_EEXIST	(-4)	/* the file already exists */
+#define FAT_ENOTDIR	(-5)	/* a path component is not a directory */
+#define FAT_EISDIR	(-6)	/* a directory where a file was expected */
+#define FAT_ENOSPC	(-7)	/* no free cluster or directory slot */
+#define FAT_EINVAL	(-8)	/* bad argument, e.g. an empty file name */
+#define FAT_ENOMEM	(-9)
+#define FAT_EROFS	(-10)	/* the volume was opened read-only */
+#define FAT_ECORRUPT	(-11)	/* a chain runs off the disk or loops */
+#define FAT_ENOTEMPTY	(-12)	/* removing a directory that has entries */
+
+/* fat_open flags */
+#define FAT_RDONLY	0
+#define FAT_RDWR	1
+
+/* How the image is reached, or'ed into the flags.  mmap maps it whole;
+   pread reads pages into a small cache as they are wanted and turns I/O
+   errors into FAT_EIO instead of SIGBUS; uring does the same with
+   batches of requests in flight on an io_uring.  With none of these
+   $FAT_IO names one ("mmap", "pread" or "uring"), and mmap is the
+   default.  $FAT_IO_CACHE sets the cache size in kilobytes. */
+#define FAT_IO_MMAP	0x10
+#define FAT_IO_PREAD	0x20
+#define FAT_IO_URING	0x30
+#define FAT_IO_MASK	0x30
+
+/* FAT_PUNCH: when the volume is closed, give the host back the space
+   under every free cluster by punching holes in the image file, so it
+   is sparse and no stale data is left in free space */
+#define FAT_PUNCH	0x40
+
+/* How hard a write is pushed out when it finishes, or'ed into the
+   flags.  none leaves it to the kernel; ordered waits for the data,
+   then the FAT, then the directory entries (or, when clusters are
+   freed, the entries first), so a crash part way leaves at worst lost
+   clusters; full also waits for the file's own metadata.
+   With none of these $FAT_SYNC names one, and none is the default. */
+#define FAT_SYNC_NONE	 0x100
+#define FAT_SYNC_ORDERED 0x200
+#define FAT_SYNC_FULL	 0x300
+#define FAT_SYNC_MASK	 0x300
+
+/* fat_sync_mode turns "none", "ordered" or "full" into its flag, or
+   returns FAT_EINVAL */
+int fat_sync_mode(const char *name);
+
+typedef struct fat_volume fat_volume;
+
+/* what fat_lookup and fat_readdir report about a directory entry */
+struct fat_stat
+{
+    char name[MAXFILENAME];	/* NAME.EXT, or just NAME with no extension */
+    char base[9];		/* the 8.3 parts with the padding removed */
+    char ext[4];
+    uint8_t attr;		/* ATTR_* bits */
+    uint16_t cluster;		/* first cluster, 0 for an empty file */
+    uint32_t size;
+    uint32_t entry;		/* image offset of the entry, 0 for the root */
+    int is_dir;
+};
+
+/* a position in a directory, filled in by fat_opendir */
+struct fat_dir
+{
+    fat_volume *vol;
+    uint16_t cluster;		/* cluster being read, 0 for the root */
+    int index;			/* next entry within it */
+    uint32_t steps;		/* clusters visited, to catch loops */
+};
+
+int fat_open(const char *path, int flags, fat_volume **volp);
+int fat_close(fat_volume *vol);
+const char *fat_strerror(int err);
+
+/* Paths are relative to the root, '/' or '\' separated; names match
+   without regard to case. */
+int fat_lookup(fat_volume *vol, const char *path, struct fat_stat *st);
+
+/* fat_readdir returns 1 and fills st for each entry, skipping deleted,
+   long-name and "."/".." entries, then 0 at the end */
+int fat_opendir(fat_volume *vol, const char *path, struct fat_dir *dir);
+int fat_readdir(struct fat_dir *dir, struct fat_stat *st);
+
+/* read up to len bytes of a file from offset; returns the byte count */
+ssize_t fat_read(fat_volume *vol, const struct fat_stat *st,
+		 uint32_t offset, void *buf, size_t len);
+
+/* A skip index over a file's chain keeps every FAT_SKIP_STRIDE-th
+   cluster, noted as reads pass it, so fat_read_at reaches any offset
+   by following fewer than FAT_SKIP_STRIDE links from the nearest one
+   instead of the whole chain.  It is only good while the chain stays
+   put, so hold the file with fat_hold_file while it is used; it starts
+   over by itself if the file's first cluster is not the one it knew. */
+#define FAT_SKIP_STRIDE	8
+#define FAT_SKIP_MAX	(4096 / FAT_SKIP_STRIDE)	/* FAT12 has < 4096 clusters */
+struct fat_skip
+{
+    uint16_t first;		/* the chain it describes */
+    uint16_t n;			/* entries known */
+    uint16_t cluster[FAT_SKIP_MAX]; /* cluster i * FAT_SKIP_STRIDE of the chain */
+};
+
+void fat_skip_init(struct fat_skip *skip, const struct fat_stat *st);
+ssize_t fat_read_at(fat_volume *vol, const struct fat_stat *st,
+		    struct fat_skip *skip, uint32_t offset, void *buf, size_t len);
+
+/* fat_scan hands fn a whole file where it lies in the image, a run of
+   contiguous clusters at a time, with nothing copied.  It stops at the
+   first nonzero return from fn and passes it back. */
+typedef int (*fat_scan_fn)(void *arg, const void *data, size_t len);
+int fat_scan(fat_volume *vol, const struct fat_stat *st,
+	     fat_scan_fn fn, void *arg);
+
+/* Readahead for a reader moving forward through a file: call
+   fat_readahead before each fat_read and the clusters ahead of offset
+   are requested from the kernel an extent at a time, however the chain
+   is scattered.  The window follows the measured read rate. */
+struct fat_readahead
+{
+    uint32_t issued;		/* file offset readahead has reached */
+    uint16_t cluster;		/* the cluster holding offset issued */
+    uint32_t window;		/* bytes to keep requested ahead */
+    uint32_t last_offset;	/* where the reader was last time */
+    double last_time;
+};
+
+void fat_readahead_init(struct fat_readahead *ra, const struct fat_stat *st);
+void fat_readahead(fat_volume *vol, const struct fat_stat *st,
+		   struct fat_readahead *ra, uint32_t offset);
+
+/* free clusters and the runs they make (struct dos_free in dos.h) */
+int fat_free_space(fat_volume *vol, struct dos_free *space);
+
+/* create a new file holding len bytes of buf; st may be NULL.  A file
+   that cannot fit is refused with FAT_ENOSPC before the image is
+   touched. */
+int fat_write(fat_volume *vol, const char *path, const void *buf,
+	      uint32_t len, struct fat_stat *st);
+
+/* add len bytes of buf to the end of a file, or create it.  The last
+   cluster's slack is filled first, new clusters follow the chain's
+   tail where they are free, and the size changes last. */
+int fat_append(fat_volume *vol, const char *path, const void *buf,
+	       uint32_t len, struct fat_stat *st);
+
+/* replace a file's contents with len bytes of buf, or create it.  Its
+   clusters are reused and only bytes that differ are written; clusters
+   are allocated or freed only at the end of the chain. */
+int fat_overwrite(fat_volume *vol, const char *path, const void *buf,
+		  uint32_t len, struct fat_stat *st);
+
+/* give a file or directory a new name, or move it into another
+   directory (into to itself if to is one).  Only directory entries
+   change, however big it is. */
+int fat_rename(fat_volume *vol, const char *from, const char *to,
+	       struct fat_stat *st);
+
+/* create an empty directory */
+int fat_mkdir(fat_volume *vol, const char *path, struct fat_stat *st);
+
+/* copy the file sst describes in src to a new file at to in dst, which
+   may be another image.  Its clusters go straight from one image to
+   the other, into the first free run in dst long enough to hold them. */
+int fat_copy(fat_volume *src, const struct fat_stat *sst, fat_volume *dst,
+	     const char *to, struct fat_stat *st);
+
+/* delete a file, or a directory: an empty one, or with recursive one
+   and everything below it.  The chains are each walked once and the
+   FAT entries freed in a single sweep. */
+int fat_remove(fat_volume *vol, const char *path, int recursive);
+
+/* fat_remove for n paths at once, their chains all freed in the one
+   sweep, with one flush of the entries and one of the FAT.  Each path's result goes in results[i] if
+   results is not NULL; it returns the first error, or FAT_OK. */
+int fat_remove_paths(fat_volume *vol, char *const *paths, int n,
+		     int recursive, int *results);
+
+/* cut a file down to size bytes, freeing the clusters past it; it
+   cannot grow a file (see fat_append) */
+int fat_truncate(fat_volume *vol, const char *path, uint32_t size,
+		 struct fat_stat *st);
+
+/* Advisory locking between processes sharing an image, with fcntl
+   byte-range locks.  Lookups and fat_readdir hold the FAT shared for
+   the length of the call; fat_write holds it exclusive, along with the
+   directory slots it fills; fat_read holds the file's directory entry
+   shared.  fat_hold_file keeps that hold across calls, so whatever
+   rewrites the file's chain must wait.  fat_check, and tools that work
+   on the raw structures, lock the whole image with fat_lock_volume. */
+int fat_hold_file(fat_volume *vol, const struct fat_stat *st);
+void fat_release_file(fat_volume *vol, const struct fat_stat *st);
+int fat_lock_volume(fat_volume *vol, int exclusive);
+void fat_unlock_volume(fat_volume *vol);
+
+/* Raw access, for tools that work on the on-disk structures.
+   fat_image loads the whole image if it is not mapped, and returns NULL
+   if that fails; fat_sync writes back changes made through it and
+   waits for the disk. */
+uint8_t *fat_image(fat_volume *vol);
+int fat_sync(fat_volume *vol);
+struct bpb33 *fat_bpb(fat_volume *vol);
+size_t fat_image_size(fat_volume *vol);
+int fat_writable(fat_volume *vol);
+struct dos_stats *fat_stats(fat_volume *vol);
+
+
+/* ---------- checking and repair ---------- */
+
+/* one problem found by fat_check */
+struct fat_finding
+{
+    const char *type;		/* "cross_link", "orphan", ... */
+    char *path;
+    uint16_t *clusters;
+    int nclusters;
+    char *action;		/* what was done, NULL if nothing could be */
+};
+
+/* phases of a check, timed separately */
+#define FAT_PHASE_TREE		0
+#define FAT_PHASE_ORPHAN_SCAN	1
+#define FAT_PHASE_REPAIR	2
+#define FAT_NPHASES		3
+
+struct fat_check_result
+{
+    int files;
+    int dirs;
+    int repairs;		/* fixes applied to the tree or the FAT */
+    int orphans;		/* orphan chains recovered into FOUND.000 */
+    int unrecovered;		/* set if some orphans had no home */
+    struct fat_finding *findings;
+    int nfindings;
+    int findings_size;
+    double wall[FAT_NPHASES];	/* seconds */
+    double cpu[FAT_NPHASES];
+};
+
+/* commentary from fat_check; FAT_LOG_ERROR is for things going wrong */
+#define FAT_LOG_INFO	0
+#define FAT_LOG_ERROR	1
+typedef void (*fat_log_fn)(void *arg, int level, const char *fmt, va_list ap);
+
+/* Walk the whole volume, repairing what it can and recovering orphan
+   chains into /FOUND.000.  The volume must be writable.  log may be
+   NULL.  Release the result with fat_check_free. */
+int fat_check(fat_volume *vol, fat_log_fn log, void *arg,
+	      struct fat_check_result *result);
+void fat_check_free(struct fat_check_result *result);
+
+#endif // __LIBFAT_H__
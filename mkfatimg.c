@@ -0,0 +1,923 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <math.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+/* mkfatimg writes a FAT12, FAT16 or FAT32 image of any size, populated
+   with a directory tree and files whose sizes, placement and
+   fragmentation are drawn from a seeded PRNG, and can inject the kinds
+   of damage scandisk repairs.  The same seed and options always give a
+   byte-identical image.  A manifest of what was created (and broken)
+   can be written alongside for checking tools against. */
+
+
+/* ---------- PRNG (splitmix64): small, fast and fully deterministic ---------- */
+
+static uint64_t rng_state;
+
+uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, n) */
+uint64_t rng_below(uint64_t n)
+{
+    return n ? rng_next() % n : 0;
+}
+
+/* uniform in [0, 1) */
+double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* ---------- options ---------- */
+
+enum size_dist { DIST_UNIFORM, DIST_EXP, DIST_LOGNORMAL, DIST_FIXED };
+
+enum corruption {
+    CORRUPT_BAD,		/* a bad cluster marker in the middle of a chain */
+    CORRUPT_LONG,		/* chain longer than the dirent size */
+    CORRUPT_SHORT,		/* dirent size larger than the chain */
+    CORRUPT_CROSSLINK,		/* a chain running into another file's chain */
+    CORRUPT_ORPHAN,		/* an allocated chain no dirent points to */
+    NCORRUPT
+};
+
+static const char *corruption_names[NCORRUPT] = {
+    "bad", "long", "short", "crosslink", "orphan"
+};
+
+struct options
+{
+    int fat_type;		/* 12, 16, 32 or 0 for automatic */
+    uint64_t size;		/* image size in bytes */
+    int sec_per_clust;		/* 0 for automatic */
+    int fill_percent;		/* share of data clusters to give to files */
+    long max_files;		/* stop after this many files, -1 for no limit */
+    enum size_dist dist;
+    double dist_a, dist_b;	/* parameters of the size distribution */
+    int depth;			/* levels of subdirectories below the root */
+    int fanout;			/* subdirectories per directory */
+    int frag_percent;		/* chance that a cluster is placed elsewhere */
+    int inject[NCORRUPT];	/* how many of each corruption to inject */
+    uint64_t seed;
+    int random_data;		/* fill file clusters with PRNG bytes */
+    char *manifest;
+    char *output;
+};
+
+
+/* ---------- geometry ---------- */
+
+struct layout
+{
+    int fat_type;
+    uint32_t bytes_per_sec;
+    uint32_t sec_per_clust;
+    uint32_t clust_size;
+    uint32_t res_sectors;
+    uint32_t nfats;
+    uint32_t root_ents;		/* 0 on FAT32, where the root is a chain */
+    uint32_t root_secs;
+    uint32_t fat_secs;
+    uint64_t total_sectors;
+    uint32_t nclusters;		/* data clusters, numbered from CLUST_FIRST */
+    uint64_t fat_offset, root_offset, data_offset;
+};
+
+static uint32_t fat_eof(int type)
+{
+    return type == 12 ? 0xfff : type == 16 ? 0xffff : 0x0fffffff;
+}
+
+static uint32_t fat_bad(int type)
+{
+    return fat_eof(type) - 8;
+}
+
+/* pick a cluster size that gives a legal cluster count for the type */
+static uint32_t auto_sec_per_clust(int type, uint64_t sectors)
+{
+    uint32_t spc;
+
+    if (type == 32)
+    {
+	if (sectors <= 532480) return 1;		/* <= 260 MB */
+	if (sectors <= 16777216) return 8;		/* <= 8 GB */
+	if (sectors <= 33554432) return 16;
+	if (sectors <= 67108864) return 32;
+	return 64;
+    }
+    for (spc = 1; spc < 128; spc *= 2)
+    {
+	if (sectors / spc < (type == 12 ? 4085 : 65525))
+	    break;
+    }
+    return spc;
+}
+
+/* fill in the layout, returning an error message or NULL */
+const char *compute_layout(struct options *opt, struct layout *l)
+{
+    uint64_t sectors = opt->size / 512;
+    uint32_t bits;
+
+    l->bytes_per_sec = 512;
+    l->total_sectors = sectors;
+    l->nfats = 2;
+    l->fat_type = opt->fat_type;
+    if (l->fat_type == 0)
+    {
+	if (sectors < 4085 * 8)
+	    l->fat_type = 12;
+	else if (sectors < 1048576)	/* 512 MB */
+	    l->fat_type = 16;
+	else
+	    l->fat_type = 32;
+    }
+    if (sectors < 64)
+	return "image is too small";
+    if (sectors > 0xffffffffULL)
+	return "image is too large";
+    if (l->fat_type != 32 && sectors > 0xffff * 128ULL * 2)
+	return "image is too large for FAT16, use -F 32";
+
+    l->sec_per_clust = opt->sec_per_clust ? opt->sec_per_clust
+	: auto_sec_per_clust(l->fat_type, sectors);
+    l->clust_size = l->sec_per_clust * l->bytes_per_sec;
+    bits = l->fat_type;
+
+    if (l->fat_type == 32)
+    {
+	l->res_sectors = 32;
+	l->root_ents = 0;
+    }
+    else
+    {
+	l->res_sectors = 1;
+	l->root_ents = sectors <= 5760 ? 224 : 512;
+    }
+    l->root_secs = l->root_ents * sizeof(struct direntry) / l->bytes_per_sec;
+
+    /* the FAT size depends on the cluster count and vice versa; a couple
+       of rounds settle it */
+    l->fat_secs = 1;
+    for (int i = 0; i < 4; i++)
+    {
+	uint64_t meta = l->res_sectors + l->root_secs + (uint64_t)l->nfats * l->fat_secs;
+	if (meta >= sectors)
+	    return "image is too small for its metadata";
+	l->nclusters = (sectors - meta) / l->sec_per_clust;
+	l->fat_secs = ((uint64_t)(l->nclusters + 2) * bits / 8 + l->bytes_per_sec - 1)
+	    / l->bytes_per_sec;
+    }
+    l->nclusters = (sectors - l->res_sectors - l->root_secs
+		    - (uint64_t)l->nfats * l->fat_secs) / l->sec_per_clust;
+
+    if (l->fat_type == 12 && l->nclusters >= 4085)
+	return "too many clusters for FAT12, use a larger -c";
+    if (l->fat_type == 16 && (l->nclusters < 4085 || l->nclusters >= 65525))
+	return "cluster count does not fit FAT16, adjust -s or -c";
+    if (l->fat_type == 32 && l->nclusters < 65525)
+	return "too few clusters for FAT32, use a smaller -c or a larger -s";
+
+    l->fat_offset = (uint64_t)l->res_sectors * l->bytes_per_sec;
+    l->root_offset = l->fat_offset + (uint64_t)l->nfats * l->fat_secs * l->bytes_per_sec;
+    l->data_offset = l->root_offset + (uint64_t)l->root_secs * l->bytes_per_sec;
+    return NULL;
+}
+
+
+/* ---------- the in-memory model of the volume ---------- */
+
+struct node
+{
+    char name[13];		/* 8.3 name with the dot, for the manifest */
+    uint8_t raw[11];		/* blank padded name as stored */
+    int is_dir;
+    struct node *parent;
+    char *path;
+    uint32_t size;
+    uint32_t first;		/* first cluster, 0 for an empty file */
+    uint32_t nclusters;
+    uint32_t extents;
+    uint64_t dirent_off;	/* where the node's dirent is in the image */
+
+    /* directories only */
+    uint32_t last;		/* last cluster of the directory */
+    uint32_t used;		/* dirents used so far */
+    struct node **subdirs;
+    int nsubdirs;
+};
+
+struct volume
+{
+    struct layout *l;
+    uint8_t *image;
+    uint32_t *fat;		/* FAT in memory, encoded at the end */
+    uint8_t *used;		/* per-cluster allocation map */
+    uint32_t nused;
+    uint32_t cursor;		/* where the next allocation looks first */
+    int frag_percent;
+    struct node *root;
+    struct node **files;
+    long nfiles, files_size;
+    struct node **dirs;
+    long ndirs, dirs_size;
+};
+
+static uint8_t *cluster_addr(struct volume *v, uint32_t cluster)
+{
+    return v->image + v->l->data_offset
+	+ (uint64_t)(cluster - CLUST_FIRST) * v->l->clust_size;
+}
+
+/* allocate one cluster.  Normally the next free one after the cursor;
+   with probability frag_percent the cursor first jumps somewhere random,
+   which splits the chain being built into another extent. */
+uint32_t alloc_cluster(struct volume *v, int may_jump)
+{
+    uint32_t n = v->l->nclusters, c;
+
+    if (v->nused == n)
+	return 0;
+    if (may_jump && (int)rng_below(100) < v->frag_percent)
+	v->cursor = CLUST_FIRST + rng_below(n);
+    for (c = v->cursor; ; )
+    {
+	if (c >= n + CLUST_FIRST)
+	    c = CLUST_FIRST;
+	if (!v->used[c])
+	    break;
+	c++;
+    }
+    v->used[c] = 1;
+    v->nused++;
+    v->fat[c] = fat_eof(v->l->fat_type);
+    v->cursor = c + 1;
+    return c;
+}
+
+/* allocate a chain for n clusters; returns the first cluster or 0 */
+uint32_t alloc_chain(struct volume *v, uint32_t n, uint32_t *extents, uint32_t *lastp)
+{
+    uint32_t first = 0, last = 0, c;
+
+    *extents = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+	c = alloc_cluster(v, i > 0);
+	if (c == 0)
+	    return 0;
+	if (last)
+	    v->fat[last] = c;
+	else
+	    first = c;
+	if (last == 0 || c != last + 1)
+	    (*extents)++;
+	last = c;
+    }
+    if (lastp)
+	*lastp = last;
+    return first;
+}
+
+static void set_raw_name(struct node *n, const char *base, const char *ext)
+{
+    memset(n->raw, ' ', 11);
+    memcpy(n->raw, base, strlen(base));
+    memcpy(n->raw + 8, ext, strlen(ext));
+    snprintf(n->name, sizeof(n->name), ext[0] ? "%s.%s" : "%s", base, ext);
+}
+
+static void write_dirent(struct volume *v, struct direntry *d, const uint8_t *raw,
+			 uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    memset(d, 0, sizeof(struct direntry));
+    memcpy(d->deName, raw, 8);
+    memcpy(d->deExtension, raw + 8, 3);
+    d->deAttributes = attr;
+    putushort(d->deStartCluster, cluster & 0xffff);
+    if (v->l->fat_type == 32)
+	putushort(d->deHighClust, cluster >> 16);
+    putulong(d->deFileSize, size);
+}
+
+/* find room for one more dirent in dir, growing it if needed */
+struct direntry *dir_slot(struct volume *v, struct node *dir)
+{
+    uint32_t per_clust = v->l->clust_size / sizeof(struct direntry);
+
+    if (dir == v->root && v->l->fat_type != 32)
+    {
+	if (dir->used >= v->l->root_ents)
+	    return NULL;
+	return (struct direntry *)(v->image + v->l->root_offset) + dir->used++;
+    }
+    if (dir->used > 0 && dir->used % per_clust == 0)
+    {
+	uint32_t c = alloc_cluster(v, 1);
+	if (c == 0)
+	    return NULL;
+	v->fat[dir->last] = c;
+	if (c != dir->last + 1)
+	    dir->extents++;
+	dir->last = c;
+	dir->nclusters++;
+    }
+    return (struct direntry *)cluster_addr(v, dir->last) + dir->used++ % per_clust;
+}
+
+static void add_node(struct node ***list, long *count, long *size, struct node *n)
+{
+    if (*count == *size)
+    {
+	*size = *size ? *size * 2 : 64;
+	*list = realloc(*list, sizeof(struct node *) * *size);
+    }
+    (*list)[(*count)++] = n;
+}
+
+static char *child_path(struct node *parent, const char *name)
+{
+    size_t len = strlen(parent->path) + strlen(name) + 2;
+    char *p = malloc(len);
+    snprintf(p, len, "%s%s%s", parent->path,
+	     parent->path[strlen(parent->path) - 1] == '/' ? "" : "/", name);
+    return p;
+}
+
+struct node *make_dir(struct volume *v, struct node *parent, int index)
+{
+    struct node *d = calloc(1, sizeof(struct node));
+    struct direntry *slot, *dot;
+    char base[9];
+
+    snprintf(base, sizeof(base), "DIR%05d", index);
+    set_raw_name(d, base, "");
+    d->is_dir = 1;
+    d->parent = parent;
+
+    slot = dir_slot(v, parent);
+    if (slot == NULL || (d->first = alloc_cluster(v, 1)) == 0)
+    {
+	free(d);
+	return NULL;
+    }
+    d->last = d->first;
+    d->nclusters = d->extents = 1;
+    d->path = child_path(parent, d->name);
+    write_dirent(v, slot, d->raw, ATTR_DIRECTORY, d->first, 0);
+
+    /* "." and "..", whose parent is cluster 0 when it is the root */
+    dot = (struct direntry *)cluster_addr(v, d->first);
+    memset(dot, 0, v->l->clust_size);
+    write_dirent(v, &dot[0], (const uint8_t *)".          ", ATTR_DIRECTORY, d->first, 0);
+    write_dirent(v, &dot[1], (const uint8_t *)"..         ", ATTR_DIRECTORY,
+		 parent == v->root ? 0 : parent->first, 0);
+    d->used = 2;
+
+    add_node(&v->dirs, &v->ndirs, &v->dirs_size, d);
+    return d;
+}
+
+/* subdirectories, fanout per level, down to depth */
+void make_tree(struct volume *v, struct node *dir, int depth, int fanout, int *counter)
+{
+    if (depth == 0)
+	return;
+    dir->subdirs = calloc(fanout, sizeof(struct node *));
+    for (int i = 0; i < fanout; i++)
+    {
+	struct node *d = make_dir(v, dir, (*counter)++);
+	if (d == NULL)
+	    return;
+	dir->subdirs[dir->nsubdirs++] = d;
+	make_tree(v, d, depth - 1, fanout, counter);
+    }
+}
+
+uint32_t draw_size(struct options *opt)
+{
+    double s;
+
+    switch (opt->dist)
+    {
+    case DIST_FIXED:
+	s = opt->dist_a;
+	break;
+    case DIST_EXP:
+	s = -opt->dist_a * log(1.0 - rng_unit());
+	break;
+    case DIST_LOGNORMAL:
+    {
+	/* Box-Muller */
+	double u1 = 1.0 - rng_unit(), u2 = rng_unit();
+	double z = sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+	s = opt->dist_a * exp(opt->dist_b * z);
+	break;
+    }
+    default:
+	s = opt->dist_a + rng_unit() * (opt->dist_b - opt->dist_a);
+	break;
+    }
+    if (s < 0)
+	s = 0;
+    if (s > 0xffffffffU)
+	s = 0xffffffffU;
+    return (uint32_t)s;
+}
+
+static const char *extensions[] = { "DAT", "TXT", "BIN", "JPG", "LOG", "DOC" };
+
+/* add files until the fill level or file count is reached */
+void populate(struct volume *v, struct options *opt)
+{
+    uint64_t target = (uint64_t)v->l->nclusters * opt->fill_percent / 100;
+    int failures = 0;
+
+    while (v->nused < target && (opt->max_files < 0 || v->nfiles < opt->max_files))
+    {
+	struct node *f = calloc(1, sizeof(struct node));
+	struct node *dir = v->dirs[rng_below(v->ndirs)];
+	struct direntry *slot;
+	char base[9];
+	uint32_t need;
+
+	f->size = draw_size(opt);
+	need = (f->size + v->l->clust_size - 1) / v->l->clust_size;
+	if (v->nused + need > v->l->nclusters || (slot = dir_slot(v, dir)) == NULL)
+	{
+	    /* doesn't fit: try a few more before giving up */
+	    free(f);
+	    if (++failures > 100)
+		break;
+	    continue;
+	}
+	snprintf(base, sizeof(base), "F%07ld", v->nfiles);
+	set_raw_name(f, base, extensions[rng_below(sizeof(extensions) / sizeof(extensions[0]))]);
+	f->parent = dir;
+	f->path = child_path(dir, f->name);
+	f->nclusters = need;
+	if (need)
+	    f->first = alloc_chain(v, need, &f->extents, NULL);
+	write_dirent(v, slot, f->raw, ATTR_ARCHIVE, f->first, f->size);
+	f->dirent_off = (uint8_t *)slot - v->image;
+
+	if (opt->random_data)
+	{
+	    for (uint32_t c = f->first; need-- > 0; c = v->fat[c])
+	    {
+		uint64_t *p = (uint64_t *)cluster_addr(v, c);
+		for (uint32_t i = 0; i < v->l->clust_size / 8; i++)
+		    p[i] = rng_next();
+	    }
+	}
+	add_node(&v->files, &v->nfiles, &v->files_size, f);
+    }
+}
+
+
+/* ---------- corruption ---------- */
+
+/* the k-th cluster of a file's chain */
+static uint32_t nth_cluster(struct volume *v, struct node *f, uint32_t k)
+{
+    uint32_t c = f->first;
+    while (k-- > 0)
+	c = v->fat[c];
+    return c;
+}
+
+/* a random file with at least min_clusters that hasn't been damaged yet */
+struct node *pick_file(struct volume *v, uint32_t min_clusters, uint8_t *damaged)
+{
+    for (int tries = 0; tries < 1000 && v->nfiles > 0; tries++)
+    {
+	long i = rng_below(v->nfiles);
+	if (!damaged[i] && v->files[i]->nclusters >= min_clusters)
+	{
+	    damaged[i] = 1;
+	    return v->files[i];
+	}
+    }
+    return NULL;
+}
+
+void inject(struct volume *v, struct options *opt, FILE *manifest)
+{
+    uint8_t *damaged = calloc(v->nfiles + 1, 1);
+
+    for (int kind = 0; kind < NCORRUPT; kind++)
+    {
+	for (int n = 0; n < opt->inject[kind]; n++)
+	{
+	    struct node *f = NULL, *g;
+	    uint32_t c, k, extra, first;
+
+	    switch (kind)
+	    {
+	    case CORRUPT_BAD:
+		if ((f = pick_file(v, 2, damaged)) == NULL)
+		    break;
+		k = rng_below(f->nclusters - 1);
+		c = nth_cluster(v, f, k);
+		v->fat[c] = fat_bad(v->l->fat_type);
+		if (manifest)
+		    fprintf(manifest, "corrupt bad %s cluster %u (chain index %u)\n", f->path, c, k);
+		break;
+	    case CORRUPT_LONG:
+		if ((f = pick_file(v, 1, damaged)) == NULL)
+		    break;
+		extra = 1 + rng_below(3);
+		c = nth_cluster(v, f, f->nclusters - 1);
+		first = alloc_chain(v, extra, &k, NULL);
+		if (first == 0)
+		    break;
+		v->fat[c] = first;
+		if (manifest)
+		    fprintf(manifest, "corrupt long %s +%u clusters from %u\n", f->path, extra, first);
+		break;
+	    case CORRUPT_SHORT:
+		if ((f = pick_file(v, 1, damaged)) == NULL)
+		    break;
+		extra = v->l->clust_size * (1 + rng_below(3));
+		putulong(((struct direntry *)(v->image + f->dirent_off))->deFileSize,
+			 f->size + extra);
+		if (manifest)
+		    fprintf(manifest, "corrupt short %s size %u -> %u\n", f->path, f->size, f->size + extra);
+		break;
+	    case CORRUPT_CROSSLINK:
+		if ((f = pick_file(v, 1, damaged)) == NULL || (g = pick_file(v, 2, damaged)) == NULL)
+		    break;
+		k = 1 + rng_below(g->nclusters - 1);
+		c = nth_cluster(v, f, f->nclusters - 1);
+		v->fat[c] = nth_cluster(v, g, k);
+		if (manifest)
+		    fprintf(manifest, "corrupt crosslink %s -> %s cluster %u\n", f->path, g->path, v->fat[c]);
+		break;
+	    case CORRUPT_ORPHAN:
+		extra = 1 + rng_below(8);
+		first = alloc_chain(v, extra, &k, NULL);
+		if (first == 0)
+		    break;
+		if (manifest)
+		    fprintf(manifest, "corrupt orphan %u clusters from %u\n", extra, first);
+		f = v->root;	/* anything non-NULL: it worked */
+		break;
+	    }
+	    if (f == NULL)
+		fprintf(stderr, "Could not inject %s corruption #%d\n", corruption_names[kind], n + 1);
+	}
+    }
+    free(damaged);
+}
+
+
+/* ---------- writing the metadata ---------- */
+
+void write_fats(struct volume *v)
+{
+    struct layout *l = v->l;
+    uint8_t *fat = v->image + l->fat_offset;
+    uint32_t n = l->nclusters + CLUST_FIRST;
+    uint8_t media = l->total_sectors <= 5760 ? 0xf0 : 0xf8;
+
+    v->fat[0] = (fat_eof(l->fat_type) & ~0xffU) | media;
+    v->fat[1] = fat_eof(l->fat_type);
+
+    for (uint32_t c = 0; c < n; c++)
+    {
+	uint32_t value = v->fat[c];
+	switch (l->fat_type)
+	{
+	case 12:
+	{
+	    uint8_t *p = fat + 3 * (c / 2);
+	    if (c % 2 == 0)
+	    {
+		p[0] = value & 0xff;
+		p[1] = (p[1] & 0xf0) | ((value >> 8) & 0x0f);
+	    }
+	    else
+	    {
+		p[1] = (p[1] & 0x0f) | ((value & 0x0f) << 4);
+		p[2] = (value >> 4) & 0xff;
+	    }
+	    break;
+	}
+	case 16:
+	    putushort(fat + 2 * c, value);
+	    break;
+	default:
+	    putulong(fat + 4 * c, value);
+	    break;
+	}
+    }
+    for (uint32_t i = 1; i < l->nfats; i++)
+	memcpy(fat + (uint64_t)i * l->fat_secs * l->bytes_per_sec, fat,
+	       (uint64_t)l->fat_secs * l->bytes_per_sec);
+}
+
+/* putulong truncates constants noisily; going through a variable
+   keeps the compiler quiet */
+static void put_le32(uint8_t *p, uint32_t value)
+{
+    putulong(p, value);
+}
+
+void write_boot(struct volume *v)
+{
+    struct layout *l = v->l;
+    uint8_t *bs = v->image;
+    struct byte_bpb710 *bpb = (struct byte_bpb710 *)(bs + 11);
+    struct extboot *ext;
+
+    bs[0] = 0xeb; bs[1] = l->fat_type == 32 ? 0x58 : 0x3c; bs[2] = 0x90;
+    memcpy(bs + 3, "MKFATIMG", 8);
+    putushort(bpb->bpbBytesPerSec, l->bytes_per_sec);
+    bpb->bpbSecPerClust = l->sec_per_clust;
+    putushort(bpb->bpbResSectors, l->res_sectors);
+    bpb->bpbFATs = l->nfats;
+    putushort(bpb->bpbRootDirEnts, l->root_ents);
+    if (l->total_sectors < 65536 && l->fat_type != 32)
+	putushort(bpb->bpbSectors, l->total_sectors);
+    else
+	putulong(bpb->bpbHugeSectors, l->total_sectors);
+    bpb->bpbMedia = l->total_sectors <= 5760 ? 0xf0 : 0xf8;
+    putushort(bpb->bpbSecPerTrack, 63);
+    putushort(bpb->bpbHeads, 255);
+
+    if (l->fat_type == 32)
+    {
+	putulong(bpb->bpbBigFATsecs, l->fat_secs);
+	putulong(bpb->bpbRootClust, v->root->first);
+	putushort(bpb->bpbFSInfo, 1);
+	putushort(bpb->bpbBackup, 6);
+	ext = (struct extboot *)(bs + 11 + 53);
+    }
+    else
+    {
+	putushort(bpb->bpbFATsecs, l->fat_secs);
+	ext = (struct extboot *)(bs + 11 + 25);
+    }
+    ext->exDriveNumber = l->total_sectors <= 5760 ? 0x00 : 0x80;
+    ext->exBootSignature = EXBOOTSIG;
+    putulong(ext->exVolumeID, (uint32_t)rng_next());
+    memcpy(ext->exVolumeLabel, "NO NAME    ", 11);
+    memcpy(ext->exFileSysType, l->fat_type == 12 ? "FAT12   "
+	   : l->fat_type == 16 ? "FAT16   " : "FAT32   ", 8);
+    bs[510] = BOOTSIG0;
+    bs[511] = BOOTSIG1;
+
+    if (l->fat_type == 32)
+    {
+	/* FSInfo in sector 1, and backups of both in sectors 6 and 7 */
+	uint8_t *fsi = bs + l->bytes_per_sec;
+	put_le32(fsi, 0x41615252);
+	put_le32(fsi + 484, 0x61417272);
+	put_le32(fsi + 488, l->nclusters - v->nused);
+	put_le32(fsi + 492, v->cursor);
+	put_le32(fsi + 508, 0xaa550000);
+	memcpy(bs + 6 * l->bytes_per_sec, bs, 2 * l->bytes_per_sec);
+    }
+}
+
+
+/* ---------- command line ---------- */
+
+uint64_t parse_size(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    switch (*end)
+    {
+    case 'k': case 'K': v *= 1024; break;
+    case 'm': case 'M': v *= 1024 * 1024; break;
+    case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+    }
+    return (uint64_t)v;
+}
+
+int parse_dist(struct options *opt, char *spec)
+{
+    char *a = strchr(spec, ':'), *b;
+
+    if (a == NULL)
+	return -1;
+    *a++ = '\0';
+    b = strchr(a, ':');
+    if (b)
+	*b++ = '\0';
+    if (strcmp(spec, "uniform") == 0 && b)
+	opt->dist = DIST_UNIFORM;
+    else if (strcmp(spec, "exp") == 0)
+	opt->dist = DIST_EXP;
+    else if (strcmp(spec, "lognormal") == 0 && b)
+	opt->dist = DIST_LOGNORMAL;
+    else if (strcmp(spec, "fixed") == 0)
+	opt->dist = DIST_FIXED;
+    else
+	return -1;
+    opt->dist_a = parse_size(a);
+    opt->dist_b = b ? (opt->dist == DIST_LOGNORMAL ? atof(b) : parse_size(b)) : 0;
+    return 0;
+}
+
+int parse_inject(struct options *opt, char *spec)
+{
+    char *count = strchr(spec, ':');
+
+    if (count)
+	*count++ = '\0';
+    for (int i = 0; i < NCORRUPT; i++)
+    {
+	if (strcmp(spec, corruption_names[i]) == 0)
+	{
+	    opt->inject[i] += count ? atoi(count) : 1;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [options] <imagename>\n", progname);
+    fprintf(stderr, "\t-s size      image size, e.g. 1440K, 64M, 2G (default 1440K)\n");
+    fprintf(stderr, "\t-F 12|16|32  FAT type (default: by size)\n");
+    fprintf(stderr, "\t-c spc       sectors per cluster (default: by size)\n");
+    fprintf(stderr, "\t-f percent   fill level of the data area (default 50)\n");
+    fprintf(stderr, "\t-n files     stop after this many files\n");
+    fprintf(stderr, "\t-d dist      file sizes: uniform:MIN:MAX, exp:MEAN,\n");
+    fprintf(stderr, "\t             lognormal:MEDIAN:SIGMA or fixed:SIZE (default uniform:1K:64K)\n");
+    fprintf(stderr, "\t-D depth     levels of subdirectories (default 1)\n");
+    fprintf(stderr, "\t-w fanout    subdirectories per directory (default 4)\n");
+    fprintf(stderr, "\t-r percent   fragmentation: chance a cluster starts a new extent (default 0)\n");
+    fprintf(stderr, "\t-x kind[:n]  inject n corruptions of a kind: bad, long, short,\n");
+    fprintf(stderr, "\t             crosslink, orphan (repeatable)\n");
+    fprintf(stderr, "\t-S seed      PRNG seed (default 1)\n");
+    fprintf(stderr, "\t-z           leave file data zeroed instead of random\n");
+    fprintf(stderr, "\t-m file      write a manifest of files, layout and corruptions\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt;
+    struct layout l;
+    struct volume v;
+    const char *err;
+    FILE *manifest = NULL;
+    int fd, c;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.size = 1440 * 1024;
+    opt.fill_percent = 50;
+    opt.max_files = -1;
+    opt.dist = DIST_UNIFORM;
+    opt.dist_a = 1024;
+    opt.dist_b = 64 * 1024;
+    opt.depth = 1;
+    opt.fanout = 4;
+    opt.seed = 1;
+    opt.random_data = 1;
+
+    while ((c = getopt(argc, argv, "s:F:c:f:n:d:D:w:r:x:S:zm:")) != -1)
+    {
+	switch (c)
+	{
+	case 's': opt.size = parse_size(optarg); break;
+	case 'F':
+	    opt.fat_type = atoi(optarg);
+	    if (opt.fat_type != 12 && opt.fat_type != 16 && opt.fat_type != 32)
+		usage(argv[0]);
+	    break;
+	case 'c':
+	    opt.sec_per_clust = atoi(optarg);
+	    if (opt.sec_per_clust < 1 || opt.sec_per_clust > 128
+		|| (opt.sec_per_clust & (opt.sec_per_clust - 1)))
+		usage(argv[0]);
+	    break;
+	case 'f': opt.fill_percent = atoi(optarg); break;
+	case 'n': opt.max_files = atol(optarg); break;
+	case 'd':
+	    if (parse_dist(&opt, optarg) < 0)
+		usage(argv[0]);
+	    break;
+	case 'D': opt.depth = atoi(optarg); break;
+	case 'w': opt.fanout = atoi(optarg); break;
+	case 'r': opt.frag_percent = atoi(optarg); break;
+	case 'x':
+	    if (parse_inject(&opt, optarg) < 0)
+		usage(argv[0]);
+	    break;
+	case 'S': opt.seed = strtoull(optarg, NULL, 0); break;
+	case 'z': opt.random_data = 0; break;
+	case 'm': opt.manifest = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || opt.fill_percent < 0 || opt.fill_percent > 100)
+	usage(argv[0]);
+    opt.output = argv[optind];
+    rng_state = opt.seed;
+
+    if ((err = compute_layout(&opt, &l)) != NULL)
+    {
+	fprintf(stderr, "%s\n", err);
+	exit(1);
+    }
+
+    /* a sparse file, so zeroed free space costs nothing on the host */
+    fd = open(opt.output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, l.total_sectors * l.bytes_per_sec) < 0)
+    {
+	fprintf(stderr, "Cannot create %s: %s\n", opt.output, strerror(errno));
+	exit(1);
+    }
+    memset(&v, 0, sizeof(v));
+    v.l = &l;
+    v.image = mmap(NULL, l.total_sectors * l.bytes_per_sec, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+    if (v.image == MAP_FAILED)
+    {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+    v.fat = calloc(l.nclusters + CLUST_FIRST, sizeof(uint32_t));
+    v.used = calloc(l.nclusters + CLUST_FIRST, 1);
+    v.cursor = CLUST_FIRST;
+    v.frag_percent = opt.frag_percent;
+
+    v.root = calloc(1, sizeof(struct node));
+    v.root->is_dir = 1;
+    v.root->path = "/";
+    if (l.fat_type == 32)
+    {
+	v.root->first = v.root->last = alloc_cluster(&v, 0);
+	v.root->nclusters = v.root->extents = 1;
+    }
+    add_node(&v.dirs, &v.ndirs, &v.dirs_size, v.root);
+
+    int counter = 0;
+    make_tree(&v, v.root, opt.depth, opt.fanout, &counter);
+    populate(&v, &opt);
+
+    if (opt.manifest)
+    {
+	manifest = fopen(opt.manifest, "w");
+	if (manifest == NULL)
+	{
+	    fprintf(stderr, "Cannot write manifest %s\n", opt.manifest);
+	    exit(1);
+	}
+	fprintf(manifest, "image %s fat%d size %llu cluster_size %u clusters %u seed %llu\n",
+		opt.output, l.fat_type, (unsigned long long)opt.size, l.clust_size,
+		l.nclusters, (unsigned long long)opt.seed);
+	for (long i = 1; i < v.ndirs; i++)
+	    fprintf(manifest, "dir %s cluster %u clusters %u extents %u\n", v.dirs[i]->path,
+		    v.dirs[i]->first, v.dirs[i]->nclusters, v.dirs[i]->extents);
+	for (long i = 0; i < v.nfiles; i++)
+	    fprintf(manifest, "file %s size %u cluster %u clusters %u extents %u\n",
+		    v.files[i]->path, v.files[i]->size, v.files[i]->first,
+		    v.files[i]->nclusters, v.files[i]->extents);
+    }
+
+    inject(&v, &opt, manifest);
+    write_fats(&v);
+    write_boot(&v);
+
+    if (manifest)
+    {
+	fprintf(manifest, "summary files %ld dirs %ld used_clusters %u free_clusters %u\n",
+		v.nfiles, v.ndirs - 1, v.nused, l.nclusters - v.nused);
+	fclose(manifest);
+    }
+
+    if (munmap(v.image, l.total_sectors * l.bytes_per_sec) < 0 || close(fd) < 0)
+    {
+	fprintf(stderr, "Cannot write %s: %s\n", opt.output, strerror(errno));
+	exit(1);
+    }
+    return 0;
+}
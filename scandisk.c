@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -9,487 +8,587 @@
 #include <string.h>
 
 #include <assert.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "libfat.h"
 
 
-#define TOTAL_CLUSTERS(bpb) (bpb->bpbSectors / bpb->bpbSecPerClust)
-#define CLUSTER_SIZE(bpb) (bpb->bpbSecPerClust * bpb->bpbBytesPerSec)
-
-/* helper functions related to managing orphans */
+/* tallies for one image; in batch mode each worker sends its copy back
+   to the parent through a pipe */
 typedef struct {
-    uint16_t *cluster_p;
-    int list_size;  //actual size of the array
-    int orphan_size; //how many cluster currently in this orphan
-} orphan;
-
-typedef struct orphans_node{
-    orphan *one_orphan;
-    struct orphans_node *next;
-} orphans_node;
-
-void orphan_init(orphan *orp){
-    orp->list_size = 5; //default size 5
-    orp->orphan_size = 0;
-    orp->cluster_p = (uint16_t *) malloc(sizeof(uint16_t) * orp->list_size);
+    int files;
+    int dirs;
+    int repairs;        //fixes applied to the tree or the FAT
+    int orphans;        //orphan chains recovered into FOUND.000
+    int unrecovered;    //set if some orphans could not be given a home
+} scan_result;
+
+static scan_result result;
+
+/* exit codes, following fsck: they are OR-ed together in batch mode */
+#define SCAN_CLEAN       0
+#define SCAN_REPAIRED    1
+#define SCAN_UNREPAIRED  4
+#define SCAN_ERROR       8
+#define SCAN_USAGE       16
+
+/* --------findings and the JSON report-------------- */
+
+/* Every problem fat_check finds is recorded as a finding, so it can be
+ * reported as JSON instead of (or as well as) the running commentary.
+ * In JSON mode the commentary is suppressed and stdout carries only the
+ * report. */
+static struct fat_check_result check;
+
+static int json_mode = 0;
+static int stats_mode = 0;
+static int punch_mode = 0;
+static int sync_flags = 0;	/* FAT_SYNC_*, from --sync */
+
+/* phases of a check, as reported; the boot sector is timed here, the
+   rest by fat_check */
+#define NPHASES (FAT_NPHASES + 1)
+static const char *phase_names[NPHASES] = {
+    "boot_sector", "tree_walk", "orphan_scan", "repair"
+};
+static double boot_wall, boot_cpu;
+
+double seconds_since(struct timespec *a, clockid_t clock){
+    struct timespec b;
+    clock_gettime(clock, &b);
+    return (b.tv_sec - a->tv_sec) + (b.tv_nsec - a->tv_nsec) / 1e9;
 }
 
-int orphan_add(orphan *orp, uint16_t first, uint16_t second){
-    if (orp->orphan_size == orp->list_size){ //need to resize
-        orp->list_size = orp->list_size * 2;
-        orp->cluster_p = (uint16_t *) realloc(orp->cluster_p, sizeof(uint16_t) * orp->list_size);
-    }
-
-    //add here
-    if (orp->orphan_size == 0){ // orphan list is empty initially
-        orp->cluster_p[0] = first;
-        orp->cluster_p[1] = second;
-        orp->orphan_size = 2;
-    } else if (first == orp->cluster_p[orp->orphan_size - 1]){ //new orphan tail
-        orp->cluster_p[orp->orphan_size] = second;
-        orp->orphan_size++;
-    } else if (second == orp->cluster_p[0]){   //new orphan head
-        uint16_t *chain = orp->cluster_p;
-        orp->cluster_p = (uint16_t *) malloc(sizeof(uint16_t) * orp->list_size);
-        orp->cluster_p[0] = first;
-        memcpy(&(orp->cluster_p[1]), chain, sizeof(uint16_t) * (orp->orphan_size));
-        orp->orphan_size++;
-        free(chain); 
-    } else {
-        return 0;
+void json_string(FILE *out, const char *str){
+    fputc('"', out);
+    for (; *str; str++){
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
     }
-    return 1;
+    fputc('"', out);
 }
 
-void fix_orphan_EOF(orphan *orp){
-    uint16_t last = orp->cluster_p[orp->orphan_size - 1];
-    if (!is_end_of_file(last)){
-        orphan_add(orp, last, FAT12_MASK & CLUST_EOFS);
-    }
+const char *status_name(int code){
+    if (code & SCAN_ERROR)
+        return "error";
+    if (code & SCAN_UNREPAIRED)
+        return "unrepaired";
+    if (code & SCAN_REPAIRED)
+        return "repaired";
+    return "clean";
 }
 
-void orphan_print(orphan *orp){
-    printf("printing an orphan chain: ");
-    for (int i = 0; i < orp->orphan_size; i++){
-        printf("%d ", orp->cluster_p[i]);
+void json_report(FILE *out, const char *image, int code){
+    fprintf(out, "{\"image\": ");
+    json_string(out, image);
+    fprintf(out, ", \"status\": \"%s\", \"exit_code\": %d,\n", status_name(code), code);
+
+    fprintf(out, " \"findings\": [");
+    for (int i = 0; i < check.nfindings; i++){
+        struct fat_finding *f = &check.findings[i];
+        fprintf(out, "%s\n  {\"type\": \"%s\", \"path\": ", i ? "," : "", f->type);
+        json_string(out, f->path);
+        fprintf(out, ", \"clusters\": [");
+        for (int j = 0; j < f->nclusters; j++)
+            fprintf(out, "%s%u", j ? ", " : "", f->clusters[j]);
+        fprintf(out, "], \"action\": ");
+        if (f->action)
+            json_string(out, f->action);
+        else
+            fprintf(out, "null");
+        fprintf(out, "}");
+    }
+    fprintf(out, "%s],\n", check.nfindings ? "\n " : "");
+
+    fprintf(out, " \"summary\": {\"files\": %d, \"directories\": %d, \"findings\": %d, "
+            "\"repairs\": %d, \"orphans_recovered\": %d, \"orphans_unrecovered\": %s},\n",
+            check.files, check.dirs, check.nfindings, check.repairs, check.orphans,
+            check.unrecovered ? "true" : "false");
+
+    fprintf(out, " \"phases\": {");
+    for (int i = 0; i < NPHASES; i++){
+        double wall = i ? check.wall[i - 1] : boot_wall;
+        double cpu = i ? check.cpu[i - 1] : boot_cpu;
+        fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", i ? ", " : "",
+                phase_names[i], wall * 1e3, cpu * 1e3);
     }
-    printf("\n");
+    fprintf(out, "}}\n");
 }
-
-void orphan_destroy(orphan *orp){
-    free(orp->cluster_p);
-    free(orp);
+/* --------end of findings and the JSON report-------------- */
+
+/* fat_check commentary: progress to stdout, trouble to stderr */
+void scan_log(void *arg, int level, const char *fmt, va_list ap){
+    if (level == FAT_LOG_ERROR)
+        vfprintf(stderr, fmt, ap);
+    else if (!json_mode)
+        vprintf(fmt, ap);
 }
 
-void orphans_list_add(orphans_node **list, uint16_t first, uint16_t second){
-    if (*list == NULL){ //first orphan encountered
-        orphan *add = (orphan *) malloc(sizeof(orphan));
-        orphan_init(add);
-        orphan_add(add, first, second);
-
-        orphans_node *new_orphan = (orphans_node *) malloc(sizeof(orphans_node));
-        new_orphan->one_orphan = add;
-        new_orphan->next = NULL;
-
-        *list = new_orphan;
-    } else { //need to iterate through the orphans list
-        orphans_node *temp = *list;
-        orphans_node *tail = temp;
-
-        for (; temp != NULL; temp = temp->next){
-            if (orphan_add(temp->one_orphan, first, second)){ //part of existing orphan
-                return;
-            }
-            if (temp->next == NULL){ //update tail
-                tail = temp;
-            }
-        }
-
-        //new orphan
-        orphan *add = (orphan *) malloc(sizeof(orphan));
-        orphan_init(add);
-        orphan_add(add, first, second);
-
-        orphans_node *new_orphan = (orphans_node *) malloc(sizeof(orphans_node));
-        new_orphan->one_orphan = add;
-        new_orphan->next = NULL;
-
-        tail->next = new_orphan;
+/* check and repair a single image, returning one of the SCAN_* codes */
+int scan_image(char *filename){
+    fat_volume *vol;
+    struct timespec wall, cpu;
+    int err;
+
+    memset(&check, 0, sizeof(check));
+    memset(&result, 0, sizeof(result));
+    boot_wall = boot_cpu = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    err = fat_open(filename, FAT_RDWR | sync_flags | (punch_mode ? FAT_PUNCH : 0), &vol);
+    boot_wall = seconds_since(&wall, CLOCK_MONOTONIC);
+    boot_cpu = seconds_since(&cpu, CLOCK_PROCESS_CPUTIME_ID);
+    if (err == FAT_EIO){
+        fprintf(stderr, "Cannot read disk image file %s:\n%s\n", filename, strerror(errno));
+        return SCAN_ERROR;
     }
-}
-
-void orphans_list_clear(orphans_node *list){
-    orphans_node *temp = list;
-    while (list != NULL){
-        orphan_destroy(list->one_orphan);
-        list = list->next;
-        free(temp);
-        temp = list;
+    if (err < 0){
+        fprintf(stderr, "Disk image file %s: %s\n", filename, fat_strerror(err));
+        return SCAN_ERROR;
     }
-}
-/* --------end of orphan management helpers-------------- */
 
-void write_dirent(struct direntry *dirent, uint16_t starting_cluster, uint32_t size, int orphan_id){
-    printf("Getting orphan%d (starting from: %d, size: %d) home as FOUND%d.DAT\n", orphan_id, starting_cluster, size, orphan_id);
+    err = fat_check(vol, scan_log, NULL, &check);
+    if (stats_mode)
+        dos_print_stats(stderr, fat_stats(vol));
+    if (fat_close(vol) < 0 && err == FAT_OK){
+        fprintf(stderr, "Cannot write back %s: %s\n", filename, strerror(errno));
+        return SCAN_ERROR;
+    }
+    if (err < 0){
+        fprintf(stderr, "Cannot check %s: %s\n", filename, fat_strerror(err));
+        return SCAN_ERROR;
+    }
 
-    char id[4];
+    result.files = check.files;
+    result.dirs = check.dirs;
+    result.repairs = check.repairs;
+    result.orphans = check.orphans;
+    result.unrecovered = check.unrecovered;
+
+    if (result.unrecovered)
+        return SCAN_UNREPAIRED;
+    if (result.repairs || result.orphans)
+        return SCAN_REPAIRED;
+    return SCAN_CLEAN;
+}
 
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+/* --------batch mode: many images on a bounded pool of workers-------------- */
 
-    // name and extension
-    sprintf(id, "%d", orphan_id);
-    memset(dirent->deName, ' ', 8);
-    memcpy(&(dirent->deName[0]), "FOUND", 5);
-    memcpy(&(dirent->deName[5]), id, strlen(id));
+/* Each image is checked in a forked child, so a corrupt image that makes
+ * the checker exit() or fault only loses that one image.  Forking without
+ * exec keeps the per-image startup cost to a page-table copy. */
+typedef struct {
+    scan_result res;
+    int code;
+} batch_msg;
 
-    memcpy(dirent->deExtension, "dat", 3);
+typedef struct {
+    char *path;
+    batch_msg msg;
+    int status;         //wait status of the worker
+    int got_result;     //worker reported back before exiting
+    double seconds;
+    char *report;       //JSON report of the worker, in JSON mode
+} batch_image;
 
-    // attribute, starting_cluster and size
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, starting_cluster);
-    putulong(dirent->deFileSize, size);
-}
+typedef struct {
+    pid_t pid;          //0 if the slot is idle
+    int pipe_fd;
+    FILE *report;       //unlinked temp file the worker writes its report to
+    int image;
+    struct timespec start;
+} batch_worker;
 
-void get_orphan_home(orphan *orp, uint8_t *img_buf, struct bpb33 *bpb, int orphan_id){
-    uint16_t cluster = 0;   //indicates root directory
-    struct direntry *dirent = (struct direntry *) cluster_to_addr(cluster, img_buf, bpb);
-
-    for (int i = 0; i < bpb->bpbRootDirEnts ;i++){   //go through every entry in root dir
-        if (dirent->deName[0] == SLOT_EMPTY){   //empty dirent found
-            uint16_t starting_cluster = orp->cluster_p[0];
-            uint32_t size = (orp->orphan_size - 1) * CLUSTER_SIZE(bpb); // minus 1 for EOF
-            write_dirent(dirent, starting_cluster, size, orphan_id);
-            dirent++;
-
-            /* make sure the next dirent is set to be empty, just in
-               case it wasn't before */
-            memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-            dirent->deName[0] = SLOT_EMPTY;
-            return;
-        }
-        dirent++;   //still in root dir, just increment to get next dir entry
+typedef struct {
+    batch_image *images;
+    int count;
+    int size;
+} image_list;
+
+void image_list_add(image_list *list, char *path){
+    if (list->count == list->size){
+        list->size = list->size ? list->size * 2 : 16;
+        list->images = (batch_image *) realloc(list->images, sizeof(batch_image) * list->size);
     }
-    fprintf(stderr, "No more available entry in root directory! Give up!\n");
-    exit(EXIT_FAILURE);
+    memset(&list->images[list->count], 0, sizeof(batch_image));
+    list->images[list->count].path = strdup(path);
+    list->count++;
 }
 
-/* Mark the given cluster as referenced
- * 0 - unreferenced
- * 1 - referenced
- * ref should have been initialized to all 0's */
-int update_ref(uint16_t cluster, char *ref){
-    if (ref[cluster]){
-        return 1;
-    }
-    ref[cluster] = 1;
-    return 0;
+int compare_names(const void *a, const void *b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
 }
 
-int is_chained(uint16_t cluster){
-    if (cluster >= (CLUST_RSRVDS & FAT12_MASK) && cluster <= (CLUST_RSRVDE & FAT12_MASK))
-        return 0;
-    else if (cluster == (CLUST_BAD & FAT12_MASK))
-        return 0;
-    else if (cluster == (CLUST_FREE & FAT12_MASK))
-        return 0;
-    else
-        return 1;
-}
+/* add every regular file in a directory, in name order */
+void image_list_add_dir(image_list *list, char *dirname){
+    DIR *dir = opendir(dirname);
+    struct dirent *de;
+    char **names = NULL;
+    int n = 0, size = 0;
+    char path[MAXPATHLEN];
+    struct stat st;
 
-void traverse_ref(char *ref, uint8_t *img_buf, struct bpb33 *bpb){
-    uint16_t fat_value;
-    int orphan_id = 1;
-    orphans_node *orphans_list = NULL;
-
-    for(int i = 2; i < TOTAL_CLUSTERS(bpb); i++){
-        if (ref[i] == 0){
-            fat_value = get_fat_entry(i, img_buf, bpb);
-            if (is_chained(fat_value)){
-                if (fat_value == (CLUST_BAD & FAT12_MASK) || fat_value == (CLUST_FREE & FAT12_MASK) || ref[fat_value]){
-                    orphans_list_add(&orphans_list, i, (CLUST_EOFS & FAT12_MASK));
-                } else {
-                    orphans_list_add(&orphans_list, i, fat_value);
-                }             
-            }
+    if (dir == NULL){
+        fprintf(stderr, "Cannot open directory %s: %s\n", dirname, strerror(errno));
+        return;
+    }
+    while ((de = readdir(dir)) != NULL){
+        if (snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name) >= sizeof(path))
+            continue;
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (n == size){
+            size = size ? size * 2 : 64;
+            names = (char **) realloc(names, sizeof(char *) * size);
         }
+        names[n++] = strdup(path);
     }
-    orphans_node *to_free = orphans_list;
+    closedir(dir);
 
-    for (; orphans_list != NULL; orphans_list = orphans_list->next){
-        fix_orphan_EOF(orphans_list->one_orphan);
-        orphan_print(orphans_list->one_orphan);
-        get_orphan_home(orphans_list->one_orphan, img_buf, bpb, orphan_id);
-        orphan_id++;
+    qsort(names, n, sizeof(char *), compare_names);
+    for (int i = 0; i < n; i++){
+        image_list_add(list, names[i]);
+        free(names[i]);
     }
-    
-    orphans_list_clear(to_free);
+    free(names);
 }
 
-/* Free all clusters starting from the given cluster*/
-void free_clusters(uint16_t cluster, uint8_t *img_buf, struct bpb33 *bpb){
-    uint16_t next_cluster;
+/* add the images named one per line in a list file ("-" for stdin) */
+void image_list_add_file(image_list *list, char *listname){
+    FILE *f = strcmp(listname, "-") == 0 ? stdin : fopen(listname, "r");
+    char line[MAXPATHLEN + 2];
 
-    while (is_valid_cluster(cluster, bpb)){
-        next_cluster = get_fat_entry(cluster, img_buf, bpb);
-        set_fat_entry(cluster, FAT12_MASK&CLUST_FREE, img_buf, bpb);
-        cluster = next_cluster;
+    if (f == NULL){
+        fprintf(stderr, "Cannot open image list %s: %s\n", listname, strerror(errno));
+        exit(SCAN_USAGE);
+    }
+    while (fgets(line, sizeof(line), f) != NULL){
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#')
+            image_list_add(list, line);
     }
+    if (f != stdin)
+        fclose(f);
 }
 
-/* Returns the chain size if needed to update dirent size, 0 otherwise */
-uint32_t follow_file(uint16_t cluster, uint32_t size, uint8_t *img_buf, struct bpb33 *bpb, char *ref, char *path){
-    uint32_t size_from_dirent = size;
-    uint16_t last_fat_entry = 0;
-    uint32_t chain_size = 0;
-    int has_bad_sector = 0;
-    int has_free_sector = 0;
-    //printf("before size: %d\n", size);
-    
-    //assert(cluster != 0);
-    while (is_valid_cluster(cluster, bpb)){
-        /* !!! mark this cluster referenced here !!!
-            if overlap, change EOF */
-        if (update_ref(cluster, ref)){
-            printf("Chain overlap found, truncating FAT chain...\n");
-            set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
-            cluster = (CLUST_FREE & FAT12_MASK);
-            break;
-        }
-
-        chain_size += CLUSTER_SIZE(bpb);
+double elapsed_since(struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-        if (size < CLUSTER_SIZE(bpb)){ //should be the last cluster according to dirent size
-            last_fat_entry = cluster;
-            cluster = get_fat_entry(cluster, img_buf, bpb);
-            has_bad_sector = (cluster == (CLUST_BAD & FAT12_MASK));
-            has_free_sector = (cluster == (CLUST_FREE & FAT12_MASK));
-            break;
-        }
-        size -= CLUSTER_SIZE(bpb);
+void batch_start(batch_worker *w, image_list *list, int image, int verbose){
+    int pipefd[2];
 
-        last_fat_entry = cluster;
-        cluster = get_fat_entry(cluster, img_buf, bpb);
-        has_bad_sector = (cluster == (CLUST_BAD & FAT12_MASK));
-        has_free_sector = (cluster == (CLUST_FREE & FAT12_MASK));
+    if (pipe(pipefd) < 0){
+        perror("pipe");
+        exit(SCAN_ERROR);
     }
-
-    /* Fix any possible in-chain bad cluster */
-    if (has_bad_sector){ 
-        printf("Bad sector found in %s, truncating FAT chain...\n", path);
-        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    w->report = NULL;
+    if (json_mode && (w->report = tmpfile()) == NULL){
+        perror("tmpfile");
+        exit(SCAN_ERROR);
     }
+    fflush(stdout);
+    fflush(stderr);
 
-    /* Fix any possible in-chain free cluster */
-    if (has_free_sector){
-        printf("Free sector found in %s, truncating FAT chain...\n", path);
-        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    w->pid = fork();
+    if (w->pid < 0){
+        perror("fork");
+        exit(SCAN_ERROR);
     }
-
-    // printf("cluster number: %d\n", cluster);
-    //printf("chain size: %d\n", chain_size);
-    if (is_valid_cluster(cluster, bpb)){    //still in the middle of a chain, free following clusters
-        printf("%s: chain size (>%d) greater than dirent size (%d)\n", path, chain_size, size_from_dirent);
-         
-        /* !!! fix chain > dirent size issue - truncate and free clusters !!! */
-        printf("Truncating the file and releasing extra clusters...\n");
-        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
-        free_clusters(cluster, img_buf, bpb);
-
-    } else if (size_from_dirent > chain_size){  //reached the end of chain, but dirent size is still too big
-        printf("%s: chain size (%d) less than dirent size (%d)\n", path, chain_size, size_from_dirent);
-        return chain_size;
-    } else {
-        printf("%s: normal file!\n", path);
+    if (w->pid == 0){
+        batch_msg msg;
+
+        close(pipefd[0]);
+        if (!verbose || json_mode){
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            if (!verbose)
+                dup2(devnull, STDERR_FILENO);
+            close(devnull);
+        }
+        msg.code = scan_image(list->images[image].path);
+        msg.res = result;
+        if (json_mode){
+            json_report(w->report, list->images[image].path, msg.code);
+            fflush(w->report);
+        }
+        fflush(stdout);
+        if (write(pipefd[1], &msg, sizeof(msg)) != sizeof(msg))
+            _exit(SCAN_ERROR);
+        _exit(0);
     }
-
-    return 0;
+    close(pipefd[1]);
+    w->pipe_fd = pipefd[0];
+    w->image = image;
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
 }
 
-/* parse a given dirent, returns the starting cluster if the given
-dirent indicates a directory and 0 otherwise */
-uint16_t parse_dirent(struct direntry *dirent, uint8_t *img_buf, struct bpb33 *bpb, char *ref, char *path){
-    uint16_t subdir_cluster = 0;  //initialize to an invalid cluster
-
-    char name[9];
-    char extension[4];
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-
-    //char *fullname = (char *) malloc(MAXPATHLEN * sizeof(char)); //holds the name of this file or dir
-    //strcpy(fullname, buffer); //buffer holds the parent path
-
-    int i;
+/* read back everything a worker wrote to its report file */
+char *slurp_report(FILE *f){
+    long len;
+    char *buf;
+
+    fflush(f);
+    len = ftell(f);
+    if (len <= 0)
+        return NULL;
+    buf = (char *) malloc(len + 1);
+    rewind(f);
+    len = fread(buf, 1, len, f);
+    buf[len] = '\0';
+    /* strip the trailing newline so it nests in the batch array */
+    while (len > 0 && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+    return buf;
+}
 
-    if (((uint8_t)name[0]) == SLOT_EMPTY){ //no more stuff in this dir
-        return subdir_cluster;
+/* wait for any worker to finish and collect what it sent back */
+void batch_reap(batch_worker *workers, int jobs, image_list *list){
+    int status;
+    pid_t pid = wait(&status);
+
+    for (int i = 0; i < jobs; i++){
+        batch_worker *w = &workers[i];
+        if (w->pid != pid)
+            continue;
+
+        batch_image *img = &list->images[w->image];
+        img->status = status;
+        img->seconds = elapsed_since(&w->start);
+        img->got_result = (read(w->pipe_fd, &img->msg, sizeof(img->msg)) == sizeof(img->msg));
+        close(w->pipe_fd);
+        if (w->report != NULL){
+            if (img->got_result)
+                img->report = slurp_report(w->report);
+            fclose(w->report);
+        }
+        w->pid = 0;
+        return;
     }
+}
 
-    if (((uint8_t)name[0]) == SLOT_DELETED){ //skip deleted entry  
-        return subdir_cluster;
-    }
+/* the SCAN_* code for an image, treating a crashed worker as an error */
+int batch_code(batch_image *img){
+    if (WIFSIGNALED(img->status) || !img->got_result || WEXITSTATUS(img->status) != 0)
+        return SCAN_ERROR;
+    return img->msg.code;
+}
 
-    if (((uint8_t)name[0]) == 0x2E){    //skip "." or ".."
-        return subdir_cluster;
+void batch_describe(batch_image *img, char *buf, size_t len){
+    scan_result *res = &img->msg.res;
+
+    if (WIFSIGNALED(img->status)){
+        snprintf(buf, len, "FAILED (killed by signal %d)", WTERMSIG(img->status));
+    } else if (!img->got_result || WEXITSTATUS(img->status) != 0){
+        snprintf(buf, len, "FAILED (exit status %d)", WEXITSTATUS(img->status));
+    } else if (img->msg.code & SCAN_ERROR){
+        snprintf(buf, len, "FAILED (cannot read image)");
+    } else if (img->msg.code & SCAN_UNREPAIRED){
+        snprintf(buf, len, "UNREPAIRED (%d repairs, %d orphans recovered, some left)",
+                 res->repairs, res->orphans);
+    } else if (img->msg.code & SCAN_REPAIRED){
+        snprintf(buf, len, "repaired (%d repairs, %d orphans recovered)",
+                 res->repairs, res->orphans);
+    } else {
+        snprintf(buf, len, "clean");
     }
+}
 
-    for (i = 8; i > 0; i--){    //remove padded spaces in name
-        if (name[i] == ' ') 
-            name[i] = '\0';
-        else 
-            break;
-    }
+void batch_json_image(batch_image *img){
+    char desc[128];
 
-    for (i = 3; i > 0; i--){    //remove padded spaces in extension
-    if (extension[i] == ' ') 
-        extension[i] = '\0';
-    else 
-        break;
+    if (img->report != NULL){
+        printf("%s", img->report);
+        return;
     }
+    /* the worker died before it could write a report */
+    batch_describe(img, desc, sizeof(desc));
+    printf("{\"image\": ");
+    json_string(stdout, img->path);
+    printf(", \"status\": \"error\", \"exit_code\": %d, \"error\": ", SCAN_ERROR);
+    json_string(stdout, desc);
+    printf("}");
+}
 
-    strcat(path, name); //append name first, append extension later if needed
-
-    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN){
-        /* skip long file name */
-    } else if ((dirent->deAttributes & ATTR_VOLUME) != 0){
-        /* skip volume */
-    } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0){
-        /* skip hidden dir */
-        if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN){
-            // a normal dir
-            strcat(path, "/");
-            subdir_cluster = getushort(dirent->deStartCluster);
-
-            //delete entry if the starting cluster is bad
-            if (subdir_cluster == (CLUST_BAD & FAT12_MASK) || ref[subdir_cluster] || subdir_cluster == (CLUST_FREE & FAT12_MASK)){
-                printf("Deleting %s because of bad starting cluster(or duplicate references or free cluster)...\n", path);
-                dirent->deName[0] = SLOT_DELETED;
-                return 0;
+int scan_batch(image_list *list, int jobs, int verbose){
+    batch_worker *workers = (batch_worker *) calloc(jobs, sizeof(batch_worker));
+    struct timespec start;
+    int running = 0, next = 0;
+    int clean = 0, repaired = 0, unrepaired = 0, failed = 0;
+    int files = 0, dirs = 0;
+    int code = SCAN_CLEAN;
+    char desc[128];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (next < list->count || running > 0){
+        if (next < list->count && running < jobs){
+            for (int i = 0; i < jobs; i++){
+                if (workers[i].pid == 0){
+                    batch_start(&workers[i], list, next++, verbose);
+                    running++;
+                    break;
+                }
             }
+            continue;
         }
-    } else {
-        // a normal file
-        strcat(path, ".");
-        strcat(path, extension); //append the extension since it's a file
-
-        uint32_t size_from_dirent = getulong(dirent->deFileSize);
-        uint16_t starting_cluster = getushort(dirent->deStartCluster);
-
-        //delete entry if the starting cluster is bad
-        if (starting_cluster == (CLUST_BAD & FAT12_MASK) || ref[starting_cluster] || starting_cluster == (CLUST_FREE & FAT12_MASK)){
-            printf("Deleting %s entry because of bad starting cluster(or duplicate references or free cluster)...\n", path);
-            dirent->deName[0] = SLOT_DELETED;
-            return 0;
-        }
-
-        uint32_t chain_size = follow_file(starting_cluster, size_from_dirent, img_buf, bpb, ref, path);
-
-        if (chain_size){
-            /* !!! fix dirent size > chain issue - adjust dirent size !!! */
-            printf("Changing directory entry size metadata to %d...\n", chain_size);
-            putulong(dirent->deFileSize, chain_size);
-        }
+        batch_reap(workers, jobs, list);
+        running--;
     }
 
-    return subdir_cluster;
-}
-
-void follow_dir(uint16_t cluster, uint8_t *img_buf, struct bpb33 *bpb, char *ref, char *path){
-    uint16_t last_fat_entry;
-    int has_bad_sector = 0;
-    int has_free_sector = 0;
-
-    char pathcopy[MAXPATHLEN];
-    
-
-    while (is_valid_cluster(cluster, bpb)){
-        /* !!! mark this cluster referenced here !!! */
-        update_ref(cluster, ref);
-
-        struct direntry *dirent = (struct direntry *) cluster_to_addr(cluster, img_buf, bpb);
-
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        for (int i = 0; i < numDirEntries; i++){    //parse every direntry and follow subdir if any
-            strcpy(pathcopy, path); //intilizes pathcopy to this dir's path for every entry
-
-            uint16_t subdir_cluster = parse_dirent(dirent, img_buf, bpb, ref, pathcopy);
-            if (is_valid_cluster(subdir_cluster, bpb)){
-                follow_dir(subdir_cluster, img_buf, bpb, ref, pathcopy);
-            }
-            dirent++;
+    if (json_mode)
+        printf("{\"images\": [\n");
+    for (int i = 0; i < list->count; i++){
+        batch_image *img = &list->images[i];
+        int img_code = batch_code(img);
+
+        code |= img_code;
+        if (json_mode){
+            printf("%s", i ? ",\n" : "");
+            batch_json_image(img);
+        } else {
+            batch_describe(img, desc, sizeof(desc));
+            printf("%s: %s [%.3fs]\n", img->path, desc, img->seconds);
         }
-        last_fat_entry = cluster;
-        cluster = get_fat_entry(cluster, img_buf, bpb);
-        has_bad_sector = (cluster == (CLUST_BAD & FAT12_MASK));
-        has_free_sector = (cluster == (CLUST_FREE & FAT12_MASK));
-    }
 
-    /* Fix any possible in-chain bad cluster */
-    if (has_bad_sector){ 
-        printf("Bad sector found in %s, truncating FAT chain...\n", path);
-        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+        if (img_code & SCAN_ERROR){
+            failed++;
+            continue;
+        }
+        files += img->msg.res.files;
+        dirs += img->msg.res.dirs;
+        if (img_code & SCAN_UNREPAIRED)
+            unrepaired++;
+        else if (img_code & SCAN_REPAIRED)
+            repaired++;
+        else
+            clean++;
     }
 
-    /* Fix any possible in-chain free cluster */
-    if (has_free_sector){ 
-        printf("Free sector found in %s, truncating FAT chain...\n", path);
-        set_fat_entry(last_fat_entry, FAT12_MASK&CLUST_EOFS, img_buf, bpb);
+    if (json_mode){
+        printf("\n],\n \"summary\": {\"images\": %d, \"clean\": %d, \"repaired\": %d, "
+               "\"unrepaired\": %d, \"failed\": %d, \"files\": %d, \"directories\": %d, "
+               "\"workers\": %d, \"wall_ms\": %.3f, \"exit_code\": %d}}\n",
+               list->count, clean, repaired, unrepaired, failed, files, dirs,
+               jobs, elapsed_since(&start) * 1e3, code);
+    } else {
+        printf("\n%d images (%d clean, %d repaired, %d unrepaired, %d failed), "
+               "%d files, %d directories, %d workers, %.3fs\n",
+               list->count, clean, repaired, unrepaired, failed, files, dirs,
+               jobs, elapsed_since(&start));
     }
-}
-
-char *traverse_root(uint8_t *img_buf, struct bpb33 *bpb){
-    uint16_t cluster = 0;   //indicates root directory
-    struct direntry *dirent = (struct direntry *) cluster_to_addr(cluster, img_buf, bpb);
-
-    char path[MAXPATHLEN];
 
-    //ref keeps track of clusters referenced by some dirent metadata
-    char *ref = (char *) malloc(sizeof(char) * TOTAL_CLUSTERS(bpb));
-    memset(ref, 0, TOTAL_CLUSTERS(bpb));
-
-    for (int i = 0; i < bpb->bpbRootDirEnts ;i++){   //go through every entry in root dir
-        strcpy(path, "/"); //reinitialize path back to "/" for the next root dir entry
-
-        uint16_t subdir_cluster = parse_dirent(dirent, img_buf, bpb, ref, path);
-        if (is_valid_cluster(subdir_cluster, bpb)){
-            follow_dir(subdir_cluster, img_buf, bpb, ref, path);
-        }
-        dirent++;   //still in root dir, just increment to get next dir entry
-    }
-    return ref;
+    free(workers);
+    return code;
 }
+/* --------end of batch mode-------------- */
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
-    exit(1);
+    fprintf(stderr, "usage: %s [--json] [--stats] [--punch] [--sync mode] <imagename>\n", progname);
+    fprintf(stderr, "       %s [--json] [--punch] [--sync mode] [-j jobs] [-v] [-l listfile] <imagename|directory>...\n", progname);
+    fprintf(stderr, "\tchecks many images in parallel and prints one summary\n");
+    fprintf(stderr, "\t--json prints a JSON report instead of the running commentary\n");
+    fprintf(stderr, "\t--stats prints FAT, directory and I/O counters on stderr (single image)\n");
+    fprintf(stderr, "\t--punch leaves each image sparse over its free clusters\n");
+    fprintf(stderr, "\t--sync none|ordered|full says how hard repairs are pushed to disk\n");
+    fprintf(stderr, "exit status: 0 clean, 1 repaired, 4 left unrepaired, 8 error (OR-ed over images)\n");
+    exit(SCAN_USAGE);
 }
 
 int main(int argc, char** argv) {
-    uint8_t *img_buf;
-    int fd;
-    struct bpb33* bpb;
-
-    char *ref; //keeps track of clusters referenced by some dir entry metadata
-
+    image_list list = {NULL, 0, 0};
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int verbose = 0;
+    int batch = 0;
+    int stats = 0;
+    int opt;
+    struct stat st;
+    static struct option long_options[] = {
+        {"json", no_argument, NULL, 'J'},
+        {"stats", no_argument, NULL, 'S'},
+        {"punch", no_argument, NULL, 'P'},
+        {"sync", required_argument, NULL, 'Y'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "j:l:v", long_options, NULL)) != -1){
+        switch (opt){
+        case 'J':
+            json_mode = 1;
+            break;
+        case 'S':
+            stats = 1;
+            break;
+        case 'P':
+            punch_mode = 1;
+            break;
+        case 'Y':
+            sync_flags = fat_sync_mode(optarg);
+            if (sync_flags < 0)
+                usage(argv[0]);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+                usage(argv[0]);
+            batch = 1;
+            break;
+        case 'l':
+            image_list_add_file(&list, optarg);
+            batch = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            batch = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    img_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(img_buf);
-    
-    // your code should start here...
-    ref = traverse_root(img_buf, bpb);
+    if (!batch && argc - optind == 1 &&
+        !(stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode))){
+        stats_mode = stats;
+        int code = scan_image(argv[optind]);
+        if (json_mode)
+            json_report(stdout, argv[optind], code);
+        fat_check_free(&check);
+        return code;
+    }
+    for (int i = optind; i < argc; i++){
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            image_list_add_dir(&list, argv[i]);
+        else
+            image_list_add(&list, argv[i]);
+    }
+    if (list.count == 0)
+        usage(argv[0]);
+    if (jobs < 1)
+        jobs = 1;
 
-    printf("\nStart checking for orphans...\n");
-    traverse_ref(ref, img_buf, bpb);
-    printf("Finished checking for orphans...\n");
+    int rv = scan_batch(&list, jobs, verbose);
 
-    unmmap_file(img_buf, &fd);
-    free(bpb);
-    free(ref);
-    return 0;
+    for (int i = 0; i < list.count; i++){
+        free(list.images[i].path);
+        free(list.images[i].report);
+    }
+    free(list.images);
+    return rv;
 }